@@ -0,0 +1,58 @@
+#include "atlas_eviction.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+//------------------------------------------------------------------------------
+
+// True if page a is a better victim than page b.
+static bool colder(const AtlasPageUse &a, const AtlasPageUse &b, uint64_t frame)
+{
+    bool aOnScreen = (a.LastUse == frame);
+    bool bOnScreen = (b.LastUse == frame);
+    if (aOnScreen != bOnScreen)
+        return bOnScreen;
+    if (aOnScreen && a.FrameGlyphs != b.FrameGlyphs)
+        return a.FrameGlyphs < b.FrameGlyphs;
+    if (a.RecentGlyphs != b.RecentGlyphs)
+        return a.RecentGlyphs < b.RecentGlyphs;
+    return a.LastUse < b.LastUse;
+}
+
+EvictionHistory::EvictionHistory()
+: frames_(), count_(0), next_(0)
+{
+}
+
+void EvictionHistory::Add(uint64_t frame)
+{
+    frames_[next_] = frame;
+    next_ = (next_ + 1) % ThrashEvictions;
+    count_ = std::min(count_ + 1, ThrashEvictions);
+}
+
+bool EvictionHistory::Thrashing(uint64_t frame) const
+{
+    return count_ == ThrashEvictions && frames_[next_] + ThrashFrames > frame;
+}
+
+size_t ChooseEvictionPage(const std::vector<AtlasPageUse> &pages, uint64_t frame, EvictionPolicy policy)
+{
+    assert(!pages.empty());
+
+    if (policy == EvictionPolicy::Random)
+    {
+        return (size_t)rand() % pages.size();
+    }
+
+    size_t best = 0;
+    for (size_t i = 1; i < pages.size(); i++)
+    {
+        if (colder(pages[i], pages[best], frame))
+        {
+            best = i;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,90 @@
+#ifndef __ATLAS_EVICTION_H__
+#define __ATLAS_EVICTION_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+// Glyphs drawn within this many frames count as recently used.
+const uint64_t EvictionRecentFrames = 60;
+// Glyphs drawn in the current or the previous frame are on screen.
+const uint64_t EvictionKeepFrames = 2;
+// A page that refused a glyph is compacted if its glyphs drawn within
+// CompactionLiveFrames take at most CompactionMaxLive of it, the others are
+// dropped.
+const uint64_t CompactionLiveFrames = 600;
+const float CompactionMaxLive = 0.7f;
+// Pinned glyphs placed among the others, no reserved room left, are kept
+// through the eviction of their page while they take at most this much of it.
+const float PinOverflowMaxKept = 0.5f;
+// Evictions thrash if ThrashEvictions of them happen within ThrashFrames, the
+// atlases get another page then.
+const uint64_t ThrashFrames = 1800;
+const int ThrashEvictions = 4;
+
+enum class EvictionPolicy {
+    LeastRecentlyUsed,
+    Random             // The former policy, the baseline of the churn benchmark
+};
+
+// Residency classes of glyphs, see TextRender::SetFontPriority.
+enum class GlyphPriority {
+    Normal,
+    Pinned,            // On reserved pages, never evicted or compacted away
+    Transient          // Evicted first, dropped on compaction unless on screen
+};
+const int NumGlyphPriorities = 3;
+
+// Use of an atlas page, gathered from the last-use frame stamps of its glyphs.
+struct AtlasPageUse {
+    size_t Page;           // Index of the page, for the caller
+    uint64_t LastUse;      // Frame a glyph of the page was last drawn in
+    size_t RecentGlyphs;   // Glyphs drawn within the last EvictionRecentFrames, but transient ones
+    size_t FrameGlyphs;    // Glyphs drawn in the current frame
+};
+
+// Picks the page to clear when all pages are full and returns its position
+// in pages, which must not be empty. The least recently used policy takes
+// the page with the fewest recently drawn glyphs among the pages not drawn
+// from in the current frame, older pages first. Only when every page was
+// drawn from this frame it takes the one with the fewest glyphs on screen.
+size_t ChooseEvictionPage(const std::vector<AtlasPageUse> &pages, uint64_t frame, EvictionPolicy policy);
+
+// Frames of the last evictions among the pages of a channel count.
+class EvictionHistory
+{
+public:
+    EvictionHistory();
+
+    void Add(uint64_t frame);
+    // True if the last ThrashEvictions evictions happened within ThrashFrames
+    // before frame.
+    bool Thrashing(uint64_t frame) const;
+
+private:
+    uint64_t frames_[ThrashEvictions];
+    int count_;
+    int next_;    // Oldest entry once full
+};
+
+// True if a glyph last drawn in frame lastUse is on screen, or pinned, and is
+// moved over to its page once cleared rather than evicted with it.
+inline bool KeepOnEviction(uint64_t lastUse, uint64_t frame, GlyphPriority priority = GlyphPriority::Normal)
+{
+    return priority == GlyphPriority::Pinned || lastUse + EvictionKeepFrames > frame;
+}
+
+// True if a glyph last drawn in frame lastUse survives a compaction. Pinned
+// glyphs always do, transient ones only while on screen.
+inline bool KeepOnCompaction(uint64_t lastUse, uint64_t frame, GlyphPriority priority = GlyphPriority::Normal)
+{
+    if (priority == GlyphPriority::Transient)
+        return KeepOnEviction(lastUse, frame);
+    return priority == GlyphPriority::Pinned || lastUse + CompactionLiveFrames > frame;
+}
+
+//------------------------------------------------------------------------------
+
+#endif // !__ATLAS_EVICTION_H__
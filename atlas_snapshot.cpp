@@ -0,0 +1,291 @@
+#include "atlas_snapshot.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include <cstring>
+
+//------------------------------------------------------------------------------
+
+static const char AtlasSnapshotMagic[4] = { 'G', 'A', 'T', 'L' };
+
+static bool replaceFile(const char *from, const char *to)
+{
+#if defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+AtlasSnapshotWriter::AtlasSnapshotWriter()
+: fp_(NULL), ok_(false)
+{
+}
+
+AtlasSnapshotWriter::~AtlasSnapshotWriter()
+{
+    if (fp_ != NULL)
+    {
+        close();
+        remove(tempPath_.c_str());
+    }
+}
+
+bool AtlasSnapshotWriter::Open(const char *path)
+{
+    path_ = path;
+    tempPath_ = path_ + ".tmp";
+    fp_ = fopen(tempPath_.c_str(), "wb");
+    if (fp_ == NULL)
+    {
+        return false;
+    }
+    ok_ = true;
+    write(AtlasSnapshotMagic, 4);
+    put(AtlasSnapshotVersion, 4);
+    return ok_;
+}
+
+void AtlasSnapshotWriter::Write(const AtlasSnapshotHeader &header)
+{
+    put(header.numFonts, 4);
+    put(header.numPages, 4);
+    put(header.numGlyphs, 4);
+    put(header.packChannels, 4);
+    put(header.packer, 4);
+    put(header.frame, 8);
+    write(header.coverageLUT, sizeof(header.coverageLUT));
+}
+
+void AtlasSnapshotWriter::Write(const SnapshotFont &font)
+{
+    put(font.hash, 8);
+    put(font.varKey, 8);
+    put((uint64_t)font.charHeight, 8);
+    put(font.format, 4);
+    put(font.bold, 1);
+    put(font.italic, 1);
+}
+
+void AtlasSnapshotWriter::Write(const SnapshotPage &page)
+{
+    put(page.width, 2);
+    put(page.height, 2);
+    put(page.layer, 2);
+    put(page.channels, 1);
+    put(page.plane, 1);
+    put(page.numNodes, 4);
+    put(page.pinned, 1);
+    put(page.usedArea, 8);
+}
+
+void AtlasSnapshotWriter::Write(const SnapshotNode &node)
+{
+    put((uint32_t)node.x, 4);
+    put((uint32_t)node.y, 4);
+    put((uint32_t)node.width, 4);
+}
+
+void AtlasSnapshotWriter::Write(const SnapshotGlyph &glyph)
+{
+    put(glyph.faceID, 8);
+    put(glyph.varKey, 8);
+    put((uint64_t)glyph.strokeWidth, 8);
+    put((uint64_t)glyph.keyCharHeight, 8);
+    put(glyph.glyphIndex, 4);
+    put((uint32_t)glyph.blurRadius, 4);
+    put((uint32_t)glyph.keyFormat, 4);
+    put((uint32_t)glyph.format, 4);
+    for (int i = 0; i < 2; i++)
+    {
+        put((uint32_t)glyph.size[i], 4);
+        put((uint32_t)glyph.bearing[i], 4);
+        put((uint32_t)glyph.texOffset[i], 4);
+    }
+    put((uint32_t)glyph.texIdx, 4);
+    putFloat(glyph.scale);
+    put((uint32_t)glyph.priority, 4);
+    put((uint32_t)glyph.pad, 4);
+    put((uint64_t)glyph.charHeight, 8);
+    put(glyph.lastUse, 8);
+}
+
+void AtlasSnapshotWriter::WriteTexels(const uint8_t *texels, size_t size)
+{
+    write(texels, size);
+}
+
+bool AtlasSnapshotWriter::Commit()
+{
+    if (fp_ == NULL)
+    {
+        return false;
+    }
+    ok_ = ok_ && fflush(fp_) == 0;
+    close();
+    if (!ok_ || !replaceFile(tempPath_.c_str(), path_.c_str()))
+    {
+        remove(tempPath_.c_str());
+        return false;
+    }
+    return true;
+}
+
+void AtlasSnapshotWriter::put(uint64_t value, int bytes)
+{
+    uint8_t data[8];
+    for (int i = 0; i < bytes; i++)
+    {
+        data[i] = (uint8_t)(value >> (8 * i));
+    }
+    write(data, bytes);
+}
+
+void AtlasSnapshotWriter::putFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    put(bits, 4);
+}
+
+void AtlasSnapshotWriter::write(const void *data, size_t size)
+{
+    ok_ = ok_ && fwrite(data, 1, size, fp_) == size;
+}
+
+void AtlasSnapshotWriter::close()
+{
+    ok_ = (fclose(fp_) == 0) && ok_;
+    fp_ = NULL;
+}
+
+//------------------------------------------------------------------------------
+
+AtlasSnapshotReader::AtlasSnapshotReader()
+: pos_(0)
+{
+}
+
+bool AtlasSnapshotReader::Open(const char *path)
+{
+    pos_ = 0;
+    if (!file_.Open(path) || !has(8) || memcmp(file_.Data(), AtlasSnapshotMagic, 4) != 0)
+    {
+        return false;
+    }
+    pos_ = 4;
+    return get(4) == AtlasSnapshotVersion;
+}
+
+bool AtlasSnapshotReader::Read(AtlasSnapshotHeader &header)
+{
+    if (!has(SnapshotHeaderBytes))
+    {
+        return false;
+    }
+    header.numFonts = (uint32_t)get(4);
+    header.numPages = (uint32_t)get(4);
+    header.numGlyphs = (uint32_t)get(4);
+    header.packChannels = (uint32_t)get(4);
+    header.packer = (uint32_t)get(4);
+    header.frame = get(8);
+    memcpy(header.coverageLUT, file_.Data() + pos_, sizeof(header.coverageLUT));
+    pos_ += sizeof(header.coverageLUT);
+    return true;
+}
+
+bool AtlasSnapshotReader::Read(SnapshotFont &font)
+{
+    if (!has(SnapshotFontBytes))
+    {
+        return false;
+    }
+    font.hash = get(8);
+    font.varKey = get(8);
+    font.charHeight = (int64_t)get(8);
+    font.format = (uint32_t)get(4);
+    font.bold = (uint8_t)get(1);
+    font.italic = (uint8_t)get(1);
+    return true;
+}
+
+bool AtlasSnapshotReader::Read(SnapshotPage &page)
+{
+    if (!has(SnapshotPageBytes))
+    {
+        return false;
+    }
+    page.width = (uint16_t)get(2);
+    page.height = (uint16_t)get(2);
+    page.layer = (uint16_t)get(2);
+    page.channels = (uint8_t)get(1);
+    page.plane = (uint8_t)get(1);
+    page.numNodes = (uint32_t)get(4);
+    page.pinned = (uint8_t)get(1);
+    page.usedArea = get(8);
+    return true;
+}
+
+bool AtlasSnapshotReader::Read(SnapshotNode &node)
+{
+    if (!has(SnapshotNodeBytes))
+    {
+        return false;
+    }
+    node.x = (int32_t)get(4);
+    node.y = (int32_t)get(4);
+    node.width = (int32_t)get(4);
+    return true;
+}
+
+bool AtlasSnapshotReader::Read(SnapshotGlyph &glyph)
+{
+    if (!has(SnapshotGlyphBytes))
+    {
+        return false;
+    }
+    glyph.faceID = get(8);
+    glyph.varKey = get(8);
+    glyph.strokeWidth = (int64_t)get(8);
+    glyph.keyCharHeight = (int64_t)get(8);
+    glyph.glyphIndex = (uint32_t)get(4);
+    glyph.blurRadius = (int32_t)get(4);
+    glyph.keyFormat = (int32_t)get(4);
+    glyph.format = (int32_t)get(4);
+    for (int i = 0; i < 2; i++)
+    {
+        glyph.size[i] = (int32_t)get(4);
+        glyph.bearing[i] = (int32_t)get(4);
+        glyph.texOffset[i] = (int32_t)get(4);
+    }
+    glyph.texIdx = (int32_t)get(4);
+    glyph.scale = getFloat();
+    glyph.priority = (int32_t)get(4);
+    glyph.pad = (int32_t)get(4);
+    glyph.charHeight = (int64_t)get(8);
+    glyph.lastUse = get(8);
+    return true;
+}
+
+uint64_t AtlasSnapshotReader::get(int bytes)
+{
+    // the caller checked there are enough
+    const uint8_t *data = file_.Data() + pos_;
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    pos_ += bytes;
+    return value;
+}
+
+float AtlasSnapshotReader::getFloat()
+{
+    uint32_t bits = (uint32_t)get(4);
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
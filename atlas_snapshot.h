@@ -0,0 +1,144 @@
+#ifndef __ATLAS_SNAPSHOT_H__
+#define __ATLAS_SNAPSHOT_H__
+
+#include "mapped_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+//------------------------------------------------------------------------------
+
+// Atlas snapshot file, see TextRender::SaveAtlasSnapshot: the header, a
+// SnapshotFont per font, a SnapshotPage per page followed by its skyline, a
+// SnapshotGlyph per glyph, then the texels of the glyphs in the atlases, in
+// glyph order and tightly packed. The fields are stored one after another in
+// little-endian order, whatever the layout of the structs and the CPU.
+const uint32_t AtlasSnapshotVersion = 5;
+
+// Bytes of the records in the file.
+const size_t SnapshotHeaderBytes = 5 * 4 + 8 + 256;
+const size_t SnapshotFontBytes = 3 * 8 + 4 + 2;
+const size_t SnapshotPageBytes = 3 * 2 + 2 + 4 + 1 + 8;
+const size_t SnapshotNodeBytes = 3 * 4;
+const size_t SnapshotGlyphBytes = 4 * 8 + 4 * 4 + 6 * 4 + 4 * 4 + 8 + 8;
+
+struct AtlasSnapshotHeader {
+    uint32_t numFonts;
+    uint32_t numPages;
+    uint32_t numGlyphs;
+    uint32_t packChannels;
+    uint32_t packer;
+    uint64_t frame;          // Frame count at saving, the clock of lastUse
+    uint8_t coverageLUT[256];
+};
+
+struct SnapshotFont {
+    uint64_t hash;
+    uint64_t varKey;
+    int64_t charHeight;
+    uint32_t format;
+    uint8_t bold;
+    uint8_t italic;
+};
+
+struct SnapshotPage {
+    uint16_t width;
+    uint16_t height;
+    uint16_t layer;
+    uint8_t channels;
+    uint8_t plane;
+    uint32_t numNodes;
+    uint8_t pinned;
+    uint64_t usedArea;
+};
+
+struct SnapshotNode {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+};
+
+struct SnapshotGlyph {
+    uint64_t faceID;
+    uint64_t varKey;
+    int64_t strokeWidth;
+    int64_t keyCharHeight;
+    uint32_t glyphIndex;
+    int32_t blurRadius;
+    int32_t keyFormat;
+    int32_t format;
+    int32_t size[2];
+    int32_t bearing[2];
+    int32_t texOffset[2];
+    int32_t texIdx;
+    float scale;
+    int32_t priority;
+    int32_t pad;
+    int64_t charHeight;
+    uint64_t lastUse;
+};
+
+// Writes a snapshot into a temporary file next to path, which Commit renames
+// over path, so a failed or interrupted save leaves the previous one intact.
+class AtlasSnapshotWriter
+{
+public:
+    AtlasSnapshotWriter();
+    // Removes the temporary file unless committed.
+    ~AtlasSnapshotWriter();
+
+    bool Open(const char *path);
+    void Write(const AtlasSnapshotHeader &header);
+    void Write(const SnapshotFont &font);
+    void Write(const SnapshotPage &page);
+    void Write(const SnapshotNode &node);
+    void Write(const SnapshotGlyph &glyph);
+    void WriteTexels(const uint8_t *texels, size_t size);
+    // False if a write failed, the file is discarded then.
+    bool Commit();
+
+private:
+    void write(const void *data, size_t size);
+    void put(uint64_t value, int bytes);
+    void putFloat(float value);
+    void close();
+
+    FILE *fp_;
+    bool ok_;
+    std::string path_;
+    std::string tempPath_;
+};
+
+// Reads a snapshot from a mapping of the file. The reads fail once the file
+// is too short, Open if it isn't a snapshot of this version.
+class AtlasSnapshotReader
+{
+public:
+    AtlasSnapshotReader();
+
+    bool Open(const char *path);
+    bool Read(AtlasSnapshotHeader &header);
+    bool Read(SnapshotFont &font);
+    bool Read(SnapshotPage &page);
+    bool Read(SnapshotNode &node);
+    bool Read(SnapshotGlyph &glyph);
+    // Bytes not read yet, to check counts in the file against before
+    // allocating for them.
+    size_t Remaining() const { return file_.Size() - pos_; }
+    // The rest of the file, the texels.
+    const uint8_t *Texels() const { return file_.Data() + pos_; }
+    size_t TexelBytes() const { return file_.Size() - pos_; }
+
+private:
+    bool has(size_t bytes) const { return file_.Size() - pos_ >= bytes; }
+    uint64_t get(int bytes);
+    float getFloat();
+
+    MappedFile file_;
+    size_t pos_;
+};
+
+//------------------------------------------------------------------------------
+
+#endif // !__ATLAS_SNAPSHOT_H__
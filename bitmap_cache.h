@@ -0,0 +1,134 @@
+#ifndef __BITMAP_CACHE_H__
+#define __BITMAP_CACHE_H__
+
+#include "glyph_raster.h"
+#include "rle.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+// Second level glyph store behind the texture atlases: keeps the bitmaps of
+// glyphs RLE compressed in memory, so a glyph evicted from the atlas is
+// decompressed and uploaded again rather than rasterized. The least recently
+// used bitmaps are dropped beyond the byte budget.
+template <typename Key>
+class BitmapCache
+{
+    struct Entry {
+        int Width;
+        int Rows;
+        int Left;
+        int Top;
+        int Channels;
+        float Scale;
+        GlyphFormat Format;
+        std::vector<uint8_t> Data;                 // RLE compressed pixels
+        typename std::list<Key>::iterator LruPos;  // Position in lru_
+    };
+
+    typedef std::map<Key, Entry> EntryMap;
+
+    EntryMap entries_;
+    std::list<Key> lru_;   // Most recently used first
+    size_t bytes_;
+    size_t maxBytes_;
+
+public:
+    BitmapCache() : bytes_(0), maxBytes_(0) {}
+
+    void SetMaxBytes(size_t maxBytes)
+    {
+        maxBytes_ = maxBytes;
+        shrink();
+    }
+
+    size_t MaxBytes() const { return maxBytes_; }
+    size_t Bytes() const { return bytes_; }
+    size_t Count() const { return entries_.size(); }
+
+    // Stores a copy of bitmap unless key is already there.
+    void Insert(const Key &key, const GlyphBitmap &bitmap)
+    {
+        if (maxBytes_ == 0 || bitmap.Pixels.empty() || entries_.count(key))
+        {
+            return;
+        }
+        Entry e;
+        e.Width = bitmap.Width;
+        e.Rows = bitmap.Rows;
+        e.Left = bitmap.Left;
+        e.Top = bitmap.Top;
+        e.Channels = bitmap.Channels;
+        e.Scale = bitmap.Scale;
+        e.Format = bitmap.Format;
+        RleEncode(bitmap.Pixels.data(), bitmap.Pixels.size(), e.Data);
+        e.Data.shrink_to_fit();
+        size_t bytes = entryBytes(e);
+        if (bytes > maxBytes_)
+        {
+            return;
+        }
+        lru_.push_front(key);
+        e.LruPos = lru_.begin();
+        entries_[key] = std::move(e);
+        bytes_ += bytes;
+        shrink();
+    }
+
+    // Decompresses the bitmap of key into bitmap.
+    bool Find(const Key &key, GlyphBitmap &bitmap)
+    {
+        typename EntryMap::iterator iter = entries_.find(key);
+        if (iter == entries_.end())
+        {
+            return false;
+        }
+        const Entry &e = iter->second;
+        bitmap.Width = e.Width;
+        bitmap.Rows = e.Rows;
+        bitmap.Left = e.Left;
+        bitmap.Top = e.Top;
+        bitmap.Channels = e.Channels;
+        bitmap.Scale = e.Scale;
+        bitmap.Format = e.Format;
+        bitmap.Pixels.resize((size_t)e.Width * e.Rows * e.Channels);
+        if (!RleDecode(e.Data.data(), e.Data.size(), bitmap.Pixels.data(), bitmap.Pixels.size()))
+        {
+            erase(iter);
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, e.LruPos);
+        return true;
+    }
+
+private:
+    static size_t entryBytes(const Entry &e)
+    {
+        // map node and lru node, roughly
+        return e.Data.size() + sizeof(Entry) + sizeof(Key) * 2 + 64;
+    }
+
+    void erase(typename EntryMap::iterator iter)
+    {
+        bytes_ -= entryBytes(iter->second);
+        lru_.erase(iter->second.LruPos);
+        entries_.erase(iter);
+    }
+
+    void shrink()
+    {
+        while (bytes_ > maxBytes_ && !lru_.empty())
+        {
+            erase(entries_.find(lru_.back()));
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+
+#endif // !__BITMAP_CACHE_H__
@@ -0,0 +1,472 @@
+#include "churn_bench.h"
+#include "atlas_eviction.h"
+#include "skyline_binpack.h"
+#include "shelf_packer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <vector>
+
+// Atlas pages of one channel count, as TextRender has them, and the pages
+// it grows to while evictions thrash.
+static const int ChurnPages = 4;
+static const int ChurnMaxPages = 16;
+static const int ChurnPageSize = 1024;
+// Distinct glyphs of the streams, a CJK font, several times what the pages
+// hold.
+static const int ChurnGlyphs = 20000;
+// Glyphs of a UI drawn in every frame, e.g. menus and labels.
+static const int ChurnHotGlyphs = 100;
+// Glyphs of the document on screen and frames per run.
+static const int ChurnScreenGlyphs = 600;
+static const int ChurnFrames = 6000;
+// Atlas padding of bitmap glyphs, on each side.
+static const int ChurnPadding = 3;
+
+struct ChurnScenario {
+    const char *name;
+    int scrollGlyphs;   // Document glyphs scrolled per frame
+    int jumpFrames;     // Frames between jumps of a whole screen, 0 for none
+    int resizeFrames;   // Frames between font size changes, 0 for none
+};
+
+// Scrolling and paging need more glyphs than the atlases hold. Resizing the
+// font of a static screen leaves dead glyphs of the former sizes behind,
+// which only compaction reclaims before the atlases run full.
+static const ChurnScenario ChurnScenarios[] = {
+    { "scroll",     20,  0,   0 },
+    { "page flip",   0, 30,   0 },
+    { "resize",      0,  0, 200 },
+};
+// Glyph ids of a size change are shifted by this.
+static const int ChurnSizeStride = 997;
+
+//------------------------------------------------------------------------------
+
+// Deterministic stream, independent of rand(), which the random policy uses.
+static uint32_t nextRandom(uint32_t &state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+struct ChurnGlyph {
+    int Width;
+    int Height;
+    int Page;           // -1 if not in an atlas
+    unsigned int Gen;
+    uint64_t LastUse;
+    bool Drawn;         // Drawn at least once
+    int X;              // Position in the page, with the shelf packer
+    int Y;
+};
+
+struct ChurnResult {
+    uint64_t requests;
+    uint64_t hits;
+    uint64_t reloads;            // Misses of glyphs drawn before, evicted since
+    uint64_t evictions;          // Pages cleared, glyphs freed with the shelf packer
+    uint64_t onScreenEvictions;  // Pages cleared while drawn from in the frame
+    uint64_t onScreenMisses;     // Misses of glyphs drawn in the previous frame
+    uint64_t kept;               // Glyphs moved over to the cleared page
+    uint64_t compactions;
+    size_t pages;                // Pages at the end
+};
+
+// The document, glyphs in text frequency order (Zipf distributed).
+static std::vector<int> makeDocument(size_t length)
+{
+    const int n = ChurnGlyphs - ChurnHotGlyphs;
+    std::vector<double> cdf(n);
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+    uint32_t state = 7;
+    std::vector<int> doc(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        double u = (nextRandom(state) / (double)(1u << 24)) * sum;
+        int lo = 0, hi = n - 1;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        doc[i] = ChurnHotGlyphs + lo;
+    }
+    return doc;
+}
+
+static std::vector<ChurnGlyph> makeGlyphs()
+{
+    std::vector<ChurnGlyph> glyphs(ChurnGlyphs);
+    uint32_t state = 11;
+    for (size_t i = 0; i < glyphs.size(); i++)
+    {
+        glyphs[i] = ChurnGlyph{ 12 + (int)(nextRandom(state) % 29), 16 + (int)(nextRandom(state) % 33),
+                                -1, 0, 0, false, 0, 0 };
+    }
+    return glyphs;
+}
+
+// Draws the glyphs of the UI and of the document on screen in each frame of
+// scenario through draw(id, frame), then calls endFrame(frame).
+template <typename Draw, typename EndFrame>
+static void playChurn(const ChurnScenario &scenario, const std::vector<int> &doc, Draw draw, EndFrame endFrame)
+{
+    size_t top = 0;
+    for (uint64_t frame = 1; frame <= (uint64_t)ChurnFrames; frame++)
+    {
+        for (int i = 0; i < ChurnHotGlyphs; i++)
+        {
+            draw(i, frame);
+        }
+        int size = scenario.resizeFrames > 0 ? (int)(frame / scenario.resizeFrames) : 0;
+        for (size_t i = 0; i < (size_t)ChurnScreenGlyphs; i++)
+        {
+            int id = doc[top + i] - ChurnHotGlyphs + size * ChurnSizeStride;
+            draw(ChurnHotGlyphs + id % (ChurnGlyphs - ChurnHotGlyphs), frame);
+        }
+        top += scenario.scrollGlyphs;
+        if (scenario.jumpFrames > 0 && frame % scenario.jumpFrames == 0)
+        {
+            top += ChurnScreenGlyphs;
+        }
+        endFrame(frame);
+    }
+}
+
+static ChurnResult runChurn(const ChurnScenario &scenario, const std::vector<int> &doc, EvictionPolicy policy,
+                            bool keep, bool compact, bool grow)
+{
+    std::vector<ChurnGlyph> glyphs = makeGlyphs();
+    std::vector<binpack::SkylineBinPack> pages(ChurnPages);
+    std::vector<unsigned int> pageGen(ChurnPages, 0);
+    std::vector<bool> pageFull(ChurnPages, false);
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        pages[i].Init(ChurnPageSize, ChurnPageSize);
+    }
+    EvictionHistory evictions;
+    srand(1);
+
+    ChurnResult result = ChurnResult{};
+    auto draw = [&](int id, uint64_t frame)
+    {
+        ChurnGlyph &g = glyphs[id];
+        result.requests++;
+        if (g.Page >= 0 && g.Gen == pageGen[g.Page])
+        {
+            result.hits++;
+            g.LastUse = frame;
+            return;
+        }
+        if (g.Drawn)
+        {
+            result.reloads++;
+            if (g.LastUse + 1 == frame)
+                result.onScreenMisses++;
+        }
+        int w = g.Width + 2 * ChurnPadding;
+        int h = g.Height + 2 * ChurnPadding;
+        g.Page = -1;
+        for (size_t i = 0; i < pages.size() && g.Page < 0; i++)
+        {
+            if (pages[i].Insert(w, h).height > 0)
+                g.Page = (int)i;
+            else
+                pageFull[i] = true;
+        }
+        if (g.Page < 0 && grow && pages.size() < (size_t)ChurnMaxPages && evictions.Thrashing(frame))
+        {
+            pages.push_back(binpack::SkylineBinPack(ChurnPageSize, ChurnPageSize));
+            pageGen.push_back(0);
+            pageFull.push_back(false);
+            evictions = EvictionHistory();
+            pages.back().Insert(w, h);
+            g.Page = (int)(pages.size() - 1);
+        }
+        if (g.Page < 0)
+        {
+            std::vector<AtlasPageUse> use(pages.size(), AtlasPageUse{});
+            for (size_t i = 0; i < use.size(); i++)
+            {
+                use[i].Page = i;
+            }
+            for (size_t i = 0; i < glyphs.size(); i++)
+            {
+                const ChurnGlyph &o = glyphs[i];
+                if (o.Page < 0 || o.Gen != pageGen[o.Page])
+                    continue;
+                AtlasPageUse &page = use[o.Page];
+                page.LastUse = std::max(page.LastUse, o.LastUse);
+                if (o.LastUse + EvictionRecentFrames > frame)
+                    page.RecentGlyphs++;
+                if (o.LastUse == frame)
+                    page.FrameGlyphs++;
+            }
+            size_t victim = ChooseEvictionPage(use, frame, policy);
+            if (use[victim].LastUse == frame)
+            {
+                result.onScreenEvictions++;
+            }
+            pages[victim].Init(ChurnPageSize, ChurnPageSize);
+            pageGen[victim]++;
+            pageFull[victim] = false;
+            result.evictions++;
+            evictions.Add(frame);
+            pages[victim].Insert(w, h);
+            g.Page = (int)victim;
+            for (size_t i = 0; keep && i < glyphs.size(); i++)
+            {
+                ChurnGlyph &o = glyphs[i];
+                if (o.Page != (int)victim || o.Gen + 1 != pageGen[victim] || !KeepOnEviction(o.LastUse, frame))
+                    continue;
+                if (pages[victim].Insert(o.Width + 2 * ChurnPadding, o.Height + 2 * ChurnPadding).height > 0)
+                {
+                    o.Gen = pageGen[victim];
+                    result.kept++;
+                }
+            }
+        }
+        g.Gen = pageGen[g.Page];
+        g.LastUse = frame;
+        g.Drawn = true;
+    };
+
+    // TextRender spreads a compaction over idle frames, here it is done at
+    // the end of the frame
+    auto compactPages = [&](uint64_t frame)
+    {
+        std::vector<size_t> liveArea(pages.size(), 0);
+        for (size_t i = 0; i < glyphs.size(); i++)
+        {
+            const ChurnGlyph &o = glyphs[i];
+            if (o.Page >= 0 && o.Gen == pageGen[o.Page] && KeepOnCompaction(o.LastUse, frame))
+                liveArea[o.Page] += (size_t)(o.Width + 2 * ChurnPadding) * (o.Height + 2 * ChurnPadding);
+        }
+        int index = -1;
+        float bestLive = CompactionMaxLive;
+        for (size_t i = 0; i < pages.size(); i++)
+        {
+            float live = liveArea[i] / ((float)ChurnPageSize * ChurnPageSize);
+            if (pageFull[i] && live <= bestLive)
+            {
+                index = (int)i;
+                bestLive = live;
+            }
+        }
+        if (index < 0)
+            return;
+
+        std::vector<int> live;
+        for (size_t i = 0; i < glyphs.size(); i++)
+        {
+            ChurnGlyph &o = glyphs[i];
+            if (o.Page != index || o.Gen != pageGen[index])
+                continue;
+            if (KeepOnCompaction(o.LastUse, frame))
+                live.push_back((int)i);
+            else
+                o.Page = -1;
+        }
+        std::stable_sort(live.begin(), live.end(), [&](int a, int b)
+        {
+            return glyphs[a].Height > glyphs[b].Height;
+        });
+        pages[index].Init(ChurnPageSize, ChurnPageSize);
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            ChurnGlyph &o = glyphs[live[i]];
+            if (pages[index].Insert(o.Width + 2 * ChurnPadding, o.Height + 2 * ChurnPadding).height <= 0)
+                o.Page = -1;
+        }
+        pageFull[index] = false;
+        result.compactions++;
+    };
+
+    playChurn(scenario, doc, draw, [&](uint64_t frame)
+    {
+        if (compact)
+        {
+            compactPages(frame);
+        }
+    });
+    result.pages = pages.size();
+    return result;
+}
+
+// Shelf-packed pages free glyphs one by one, rather than clearing a page, as
+// TextRender::evictGlyphs does: the least recently used of the height class
+// of the glyph, until it fits where one was. Glyphs drawn recently are not
+// freed, once the least recently used is one the least recently used page is
+// cleared instead, keeping the glyphs on screen.
+static ChurnResult runShelfChurn(const ChurnScenario &scenario, const std::vector<int> &doc)
+{
+    std::vector<ChurnGlyph> glyphs = makeGlyphs();
+    std::vector<ShelfPacker> pages(ChurnPages);
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        pages[i].Init(ChurnPageSize, ChurnPageSize);
+    }
+    // glyphs in the pages per height class, least recently used first
+    std::vector<std::list<int>> lru;
+    std::vector<std::list<int>::iterator> lruPos(glyphs.size());
+    auto classOf = [&](const ChurnGlyph &g)
+    {
+        return ShelfClassHeight(g.Height + 2 * ChurnPadding) / ShelfHeightStep;
+    };
+
+    ChurnResult result = ChurnResult{};
+    auto draw = [&](int id, uint64_t frame)
+    {
+        ChurnGlyph &g = glyphs[id];
+        result.requests++;
+        int c = classOf(g);
+        if (g.Page >= 0)
+        {
+            result.hits++;
+            g.LastUse = frame;
+            lru[c].splice(lru[c].end(), lru[c], lruPos[id]);
+            return;
+        }
+        if (g.Drawn)
+        {
+            result.reloads++;
+            if (g.LastUse + 1 == frame)
+                result.onScreenMisses++;
+        }
+        g.LastUse = frame;
+        g.Drawn = true;
+        if ((size_t)c >= lru.size())
+        {
+            lru.resize(c + 1);
+        }
+        int w = g.Width + 2 * ChurnPadding;
+        int h = g.Height + 2 * ChurnPadding;
+        binpack::Rect r = binpack::Rect{ 0, 0, 0, 0 };
+        for (size_t i = 0; i < pages.size() && r.height <= 0; i++)
+        {
+            r = pages[i].Insert(w, h);
+            g.Page = (int)i;
+        }
+        while (r.height <= 0 && !lru[c].empty() && glyphs[lru[c].front()].LastUse + EvictionRecentFrames <= frame)
+        {
+            ChurnGlyph &o = glyphs[lru[c].front()];
+            pages[o.Page].Free(o.X, o.Y);
+            lru[c].pop_front();
+            result.evictions++;
+            r = pages[o.Page].Insert(w, h);
+            g.Page = o.Page;
+            o.Page = -1;
+        }
+        if (r.height <= 0)
+        {
+            std::vector<AtlasPageUse> use(pages.size(), AtlasPageUse{});
+            for (size_t i = 0; i < use.size(); i++)
+            {
+                use[i].Page = i;
+            }
+            g.Page = -1;
+            for (size_t i = 0; i < glyphs.size(); i++)
+            {
+                const ChurnGlyph &o = glyphs[i];
+                if (o.Page < 0)
+                    continue;
+                AtlasPageUse &page = use[o.Page];
+                page.LastUse = std::max(page.LastUse, o.LastUse);
+                if (o.LastUse + EvictionRecentFrames > frame)
+                    page.RecentGlyphs++;
+                if (o.LastUse == frame)
+                    page.FrameGlyphs++;
+            }
+            size_t victim = ChooseEvictionPage(use, frame, EvictionPolicy::LeastRecentlyUsed);
+            if (use[victim].LastUse == frame)
+            {
+                result.onScreenEvictions++;
+            }
+            pages[victim].Init(ChurnPageSize, ChurnPageSize);
+            result.evictions++;
+            r = pages[victim].Insert(w, h);
+            g.Page = (int)victim;
+            // the kept glyphs stay where they are in their lists
+            for (size_t i = 0; i < glyphs.size(); i++)
+            {
+                ChurnGlyph &o = glyphs[i];
+                if (o.Page != (int)victim || (int)i == id)
+                    continue;
+                binpack::Rect k = binpack::Rect{ 0, 0, 0, 0 };
+                if (KeepOnEviction(o.LastUse, frame))
+                    k = pages[victim].Insert(o.Width + 2 * ChurnPadding, o.Height + 2 * ChurnPadding);
+                if (k.height > 0)
+                {
+                    o.X = k.x;
+                    o.Y = k.y;
+                    result.kept++;
+                    continue;
+                }
+                lru[classOf(o)].erase(lruPos[i]);
+                o.Page = -1;
+            }
+        }
+        if (r.height <= 0)
+        {
+            // all on screen, drawn without caching
+            g.Page = -1;
+            return;
+        }
+        g.X = r.x;
+        g.Y = r.y;
+        lruPos[id] = lru[c].insert(lru[c].end(), id);
+    };
+    playChurn(scenario, doc, draw, [](uint64_t) {});
+    result.pages = pages.size();
+    return result;
+}
+
+void RunChurnBenchmark()
+{
+    fprintf(stdout, "----atlas churn benchmark (%d pages %dx%d, %d glyphs, %d frames)----\n",
+            ChurnPages, ChurnPageSize, ChurnPageSize, ChurnGlyphs, ChurnFrames);
+    fprintf(stdout, "%-10s %-12s %9s %9s %9s %10s %10s %8s %14s %8s %6s\n", "scenario", "policy", "hit rate",
+            "misses", "reloads", "evictions", "on screen", "kept", "on-screen miss", "compact", "pages");
+
+    for (size_t s = 0; s < sizeof(ChurnScenarios) / sizeof(ChurnScenarios[0]); s++)
+    {
+        const ChurnScenario &scenario = ChurnScenarios[s];
+        size_t screens = (size_t)ChurnFrames / (scenario.jumpFrames > 0 ? scenario.jumpFrames : ChurnFrames) + 1;
+        std::vector<int> doc = makeDocument((size_t)scenario.scrollGlyphs * ChurnFrames +
+                                            screens * ChurnScreenGlyphs);
+        // the former policy, least recently used pages, those keeping the
+        // glyphs on screen, with compaction, and adding pages on thrashing as
+        // TextRender does
+        const EvictionPolicy policies[] = { EvictionPolicy::Random, EvictionPolicy::LeastRecentlyUsed,
+                                            EvictionPolicy::LeastRecentlyUsed, EvictionPolicy::LeastRecentlyUsed,
+                                            EvictionPolicy::LeastRecentlyUsed };
+        const bool keep[] = { false, false, true, true, true };
+        const bool compact[] = { false, false, false, true, true };
+        const bool grow[] = { false, false, false, false, true };
+        const char *names[] = { "random", "lru page", "lru", "lru compact", "lru grow", "shelf lru" };
+        // then shelf-packed pages evicting glyphs rather than pages
+        for (int p = 0; p < 6; p++)
+        {
+            ChurnResult r = (p < 5) ? runChurn(scenario, doc, policies[p], keep[p], compact[p], grow[p]) :
+                                      runShelfChurn(scenario, doc);
+            fprintf(stdout, "%-10s %-12s %8.2f%% %9llu %9llu %10llu %10llu %8llu %14llu %8llu %6zu\n",
+                    scenario.name, names[p],
+                    (double)r.hits / r.requests * 100.0, (unsigned long long)(r.requests - r.hits),
+                    (unsigned long long)r.reloads, (unsigned long long)r.evictions, (unsigned long long)r.onScreenEvictions,
+                    (unsigned long long)r.kept, (unsigned long long)r.onScreenMisses,
+                    (unsigned long long)r.compactions, r.pages);
+        }
+    }
+    fprintf(stdout, "\n");
+}
@@ -0,0 +1,16 @@
+#ifndef __CHURN_BENCH_H__
+#define __CHURN_BENCH_H__
+
+//------------------------------------------------------------------------------
+
+// Replays glyph streams that need more than the atlases hold against the
+// atlas packer and the eviction policies (see atlas_eviction.h), and prints
+// hit rates and evictions of the least recently used policy, with and
+// without compaction and pages added on thrashing, against random eviction
+// and against shelf-packed pages (see shelf_packer.h) evicting glyphs one by
+// one, to stdout.
+void RunChurnBenchmark();
+
+//------------------------------------------------------------------------------
+
+#endif // !__CHURN_BENCH_H__
@@ -1,16 +1,127 @@
 #include "font.h"
 #include "scope_guard.h"
+#include FT_ADVANCES_H
+#include FT_OUTLINE_H
+#include FT_MULTIPLE_MASTERS_H
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+struct MetricsFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint32_t numGlyphs;
+    uint32_t reserved;
+};
+
+// 2: always the default instance, 1 was of whatever instance was current
+static const uint32_t MetricsFileVersion = 2;
+
+static uint64_t fnv1a64(const uint8_t *data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static bool makeDirectory(const std::string &path)
+{
+#if defined(_WIN32)
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Per-user directory for files derived from the fonts: %LOCALAPPDATA% on
+// Windows, else $XDG_CACHE_HOME, ~/Library/Caches on macOS or ~/.cache.
+// Empty if there is none.
+static std::string cacheDirectory()
+{
+    std::string dir;
+#if defined(_WIN32)
+    const char *base = getenv("LOCALAPPDATA");
+    if (base == NULL || base[0] == '\0')
+    {
+        return std::string();
+    }
+    dir = base;
+#else
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg != NULL && xdg[0] != '\0')
+    {
+        dir = xdg;
+    }
+    else if (home != NULL && home[0] != '\0')
+    {
+#if defined(__APPLE__)
+        dir = std::string(home) + "/Library/Caches";
+#else
+        dir = std::string(home) + "/.cache";
+#endif
+    }
+    else
+    {
+        return std::string();
+    }
+#endif
+    makeDirectory(dir);
+    dir += "/drawtext-gl-freetype-harfbuzz";
+    if (!makeDirectory(dir))
+    {
+        return std::string();
+    }
+    return dir;
+}
 
 Font::Font(FT_Library ftLib, const char* fontFile, float fontSize, float contentScale, bool bold, bool italic)
-: ftFont_(NULL), hbFont_(NULL), 
-  fontSize_(0), contentScale_(0), bold_(false), italic_(false), underlinePos_(0), underlineThickness_(0), 
-  initOK_(false)
+: ftLib_(NULL), ftFont_(NULL), hbFont_(NULL), maxIdleInstances_(4), hash_(0), metricsReady_(false),
+  fontSize_(0), contentScale_(0), bold_(false), italic_(false), glyphFormat_(GlyphFormat::Bitmap),
+  underlinePos_(0), underlineThickness_(0),
+  layoutGen_(0), prevCharHeight_(0), varStep_(1.0f / 32), varKey_(0), initOK_(false)
 {
     init(ftLib, fontFile, fontSize, contentScale, bold, italic);
 }
 
 Font::~Font()
 {
+    if (metricsThread_.joinable())
+    {
+        metricsThread_.join();
+    }
+    if (hashThread_.joinable())
+    {
+        hashThread_.join();
+    }
+
+    for (InstanceMap::iterator iter = threadInstances_.begin(); iter != threadInstances_.end(); ++iter)
+    {
+        doneInstance(*iter->second);
+    }
+    threadInstances_.clear();
+    for (size_t i = 0; i < idleInstances_.size(); i++)
+    {
+        doneInstance(*idleInstances_[i]);
+    }
+    idleInstances_.clear();
+
     if (hbFont_)
     {
         hb_font_destroy(hbFont_);
@@ -18,6 +129,7 @@ Font::~Font()
     }
     if (ftFont_)
     {
+        std::lock_guard<std::mutex> lock(LibraryMutex());
         FT_Done_Face(ftFont_);
         ftFont_ = NULL;
     }
@@ -25,52 +137,457 @@ Font::~Font()
 
 void Font::init(FT_Library ftLib, const char* fontFile, float fontSize, float contentScale, bool bold, bool italic)
 {
-    if (FT_New_Face(ftLib, fontFile, 0, &ftFont_))
+    // all instances are created over the same mapped bytes
+    if (!fontData_.Open(fontFile))
     {
         return;
     }
-    auto ftFont_guard = scopeGuard([this]{ FT_Done_Face(ftFont_); ftFont_ = NULL; });
 
+    ftLib_ = ftLib;
+    fontSize_ = fontSize;
+    contentScale_ = contentScale;
+
+    Instance inst;
+    if (!newInstance(inst))
+    {
+        return;
+    }
+    ftFont_ = inst.ftFont;
+    hbFont_ = inst.hbFont;
+
+    ID_ = genID();
+    fontFile_ = fontFile;
+    ownerThread_ = std::this_thread::get_id();
+    bold_ = bold;
+    italic_ = italic;
+    updateUnderline();
+    // hashing a large (e.g. CJK) font takes a while, keep it off the first
+    // glyph lookup
+    hashThread_ = std::thread([this]{ hash_ = fnv1a64(fontData_.Data(), fontData_.Size()); });
+    initOK_ = true;
+    return;
+}
+
+void Font::SetContentScale(float contentScale)
+{
+    applySize(fontSize_, contentScale);
+}
+
+void Font::SetSize(float fontSize)
+{
+    applySize(fontSize, contentScale_);
+}
+
+void Font::applySize(float fontSize, float contentScale)
+{
+    assert(std::this_thread::get_id() == ownerThread_);
+    if (fontSize == fontSize_ && contentScale == contentScale_)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(instanceMutex_);
+    prevCharHeight_ = getCharHeight();
+    fontSize_ = fontSize;
+    contentScale_ = contentScale;
+    Instance primary = Instance{ ftFont_, hbFont_, 0, 0 };
+    setInstanceState(primary);
+    // instances in use are resized by their own thread in ForThread()
+    for (size_t i = 0; i < idleInstances_.size(); i++)
+    {
+        setInstanceState(*idleInstances_[i]);
+    }
+    updateUnderline();
+    layoutGen_++;
+}
+
+void Font::SetVariation(const float* coords, unsigned int numCoords)
+{
+    assert(std::this_thread::get_id() == ownerThread_);
+    if (!FT_HAS_MULTIPLE_MASTERS(ftFont_))
+    {
+        return;
+    }
+
+    FT_MM_Var *mm_var;
+    if (FT_Get_MM_Var(ftFont_, &mm_var))
+    {
+        return;
+    }
+    unsigned int num_axis = mm_var->num_axis;
+    FT_Done_MM_Var(ftLib_, mm_var);
+
+    std::vector<float> quantized(std::min(numCoords, num_axis));
+    std::vector<uint8_t> f2dot14(2 * quantized.size());
+    bool isDefault = true;
+    for (size_t i = 0; i < quantized.size(); i++)
+    {
+        float c = std::max(-1.0f, std::min(1.0f, coords[i]));
+        if (varStep_ > 0)
+        {
+            c = std::round(c / varStep_) * varStep_;
+        }
+        quantized[i] = c;
+        uint16_t v = (uint16_t)(int16_t)std::lround(c * 16384);
+        f2dot14[2 * i] = (uint8_t)v;
+        f2dot14[2 * i + 1] = (uint8_t)(v >> 8);
+        isDefault = isDefault && v == 0;
+    }
+    // all axes take part in the key, 0 is kept for the default instance
+    uint64_t key = 0;
+    if (!isDefault)
+    {
+        key = std::max<uint64_t>(1, fnv1a64(f2dot14.data(), f2dot14.size()));
+    }
+    if (key == varKey_ && quantized == varCoords_)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(instanceMutex_);
+    varCoords_.swap(quantized);
+    varKey_ = key;
+    Instance primary = Instance{ ftFont_, hbFont_, 0, 0 };
+    setInstanceState(primary);
+    for (size_t i = 0; i < idleInstances_.size(); i++)
+    {
+        setInstanceState(*idleInstances_[i]);
+    }
+    layoutGen_++;
+}
+
+Font::Instance Font::ForThread()
+{
+    std::thread::id tid = std::this_thread::get_id();
+    if (tid == ownerThread_)
+    {
+        return Instance{ ftFont_, hbFont_, getCharHeight(), varKey_ };
+    }
+
+    std::lock_guard<std::mutex> lock(instanceMutex_);
+    InstanceMap::iterator iter = threadInstances_.find(tid);
+    if (iter != threadInstances_.end())
+    {
+        if (iter->second->charHeight != getCharHeight() || iter->second->varKey != varKey_)
+        {
+            setInstanceState(*iter->second);
+        }
+        return *iter->second;
+    }
+
+    std::unique_ptr<Instance> inst;
+    if (!idleInstances_.empty())
+    {
+        inst = std::move(idleInstances_.back());
+        idleInstances_.pop_back();
+    }
+    else
+    {
+        inst.reset(new Instance);
+        if (!newInstance(*inst))
+        {
+            return Instance{ NULL, NULL, 0, 0 };
+        }
+    }
+    Instance result = *inst;
+    threadInstances_[tid] = std::move(inst);
+    return result;
+}
+
+void Font::ReleaseThread()
+{
+    std::lock_guard<std::mutex> lock(instanceMutex_);
+    InstanceMap::iterator iter = threadInstances_.find(std::this_thread::get_id());
+    if (iter == threadInstances_.end())
+    {
+        return;
+    }
+    idleInstances_.push_back(std::move(iter->second));
+    threadInstances_.erase(iter);
+    while (idleInstances_.size() > maxIdleInstances_)
+    {
+        doneInstance(*idleInstances_.front());
+        idleInstances_.erase(idleInstances_.begin());
+    }
+}
+
+void Font::SetMaxIdleInstances(size_t maxIdle)
+{
+    std::lock_guard<std::mutex> lock(instanceMutex_);
+    maxIdleInstances_ = maxIdle;
+    while (idleInstances_.size() > maxIdleInstances_)
+    {
+        doneInstance(*idleInstances_.front());
+        idleInstances_.erase(idleInstances_.begin());
+    }
+}
+
+uint64_t Font::getHash()
+{
+    std::call_once(hashOnce_, [this]{
+        if (hashThread_.joinable())
+        {
+            hashThread_.join();
+        }
+    });
+    return hash_;
+}
+
+bool Font::BuildMetrics(bool background)
+{
+    if (metricsReady_ || metricsThread_.joinable())
+    {
+        return true;
+    }
+    if (background)
+    {
+        metricsThread_ = std::thread([this]{ buildMetrics(); });
+        return true;
+    }
+    buildMetrics();
+    return metricsReady_;
+}
+
+void Font::buildMetrics()
+{
+    // the sidecar is named by the content hash in the per-user cache, fonts
+    // may be read-only and copies of a font share it
+    std::vector<RawMetrics> metrics;
+    std::string path = cacheDirectory();
+    if (!path.empty())
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.metrics", (unsigned long long)getHash());
+        path += name;
+    }
+    if (path.empty() || !loadMetrics(path, metrics))
+    {
+        if (!computeMetrics(metrics))
+        {
+            return;
+        }
+        if (!path.empty())
+        {
+            saveMetrics(path, metrics);
+        }
+    }
+    metrics_.swap(metrics);
+    metricsReady_ = true;
+}
+
+bool Font::loadMetrics(const std::string &path, std::vector<RawMetrics> &metrics)
+{
+    MappedFile file;
+    if (!file.Open(path.c_str()) || file.Size() < sizeof(MetricsFileHeader))
+    {
+        return false;
+    }
+    MetricsFileHeader header;
+    memcpy(&header, file.Data(), sizeof(header));
+    if (memcmp(header.magic, "GMTX", 4) != 0 ||
+        header.version != MetricsFileVersion ||
+        header.hash != getHash() ||
+        header.numGlyphs != (uint32_t)ftFont_->num_glyphs ||
+        file.Size() != sizeof(header) + header.numGlyphs * sizeof(RawMetrics))
+    {
+        return false;
+    }
+    metrics.resize(header.numGlyphs);
+    memcpy(metrics.data(), file.Data() + sizeof(header), header.numGlyphs * sizeof(RawMetrics));
+    return true;
+}
+
+bool Font::saveMetrics(const std::string &path, const std::vector<RawMetrics> &metrics)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp == NULL)
+    {
+        return false;
+    }
+    auto fp_guard = scopeGuard([&fp]{ fclose(fp); });
+
+    MetricsFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "GMTX", 4);
+    header.version = MetricsFileVersion;
+    header.hash = getHash();
+    header.numGlyphs = (uint32_t)metrics.size();
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(metrics.data(), sizeof(RawMetrics), metrics.size(), fp) != metrics.size())
+    {
+        return false;
+    }
+    return true;
+}
+
+bool Font::computeMetrics(std::vector<RawMetrics> &metrics)
+{
+    // may run on the metrics thread, which needs its own face. The table
+    // describes the default instance, so don't share the variable ones.
+    FT_Face face;
+    {
+        std::lock_guard<std::mutex> lock(LibraryMutex());
+        if (FT_New_Memory_Face(ftLib_, fontData_.Data(), (FT_Long)fontData_.Size(), 0, &face))
+        {
+            return false;
+        }
+    }
+    auto face_guard = scopeGuard([&face]{
+        std::lock_guard<std::mutex> lock(LibraryMutex());
+        FT_Done_Face(face);
+    });
+
+    if (!FT_IS_SCALABLE(face) || FT_HAS_COLOR(face))
+    {
+        // an empty outline doesn't make an empty glyph here
+        return false;
+    }
+    FT_UInt num_glyphs = (FT_UInt)face->num_glyphs;
+    std::vector<FT_Fixed> advances(num_glyphs);
+    if (num_glyphs > 0 && FT_Get_Advances(face, 0, num_glyphs, FT_LOAD_NO_SCALE, advances.data()))
+    {
+        return false;
+    }
+
+    metrics.resize(num_glyphs);
+    for (FT_UInt i = 0; i < num_glyphs; i++)
+    {
+        RawMetrics &m = metrics[i];
+        memset(&m, 0, sizeof(m));
+        m.advance = (uint16_t)advances[i];
+        if (FT_Load_Glyph(face, i, FT_LOAD_NO_SCALE) == 0 &&
+            face->glyph->format == FT_GLYPH_FORMAT_OUTLINE &&
+            face->glyph->outline.n_points > 0)
+        {
+            FT_BBox cbox;
+            FT_Outline_Get_CBox(&face->glyph->outline, &cbox);
+            m.xMin = (int16_t)cbox.xMin;
+            m.yMin = (int16_t)cbox.yMin;
+            m.xMax = (int16_t)cbox.xMax;
+            m.yMax = (int16_t)cbox.yMax;
+        }
+    }
+    return true;
+}
+
+float Font::getStrikeScale() const
+{
+    if (FT_IS_SCALABLE(ftFont_) || ftFont_->size->metrics.y_ppem == 0)
+    {
+        return 1.0f;
+    }
+    float ppem = getCharHeight() * getResolution() / 72.0f / 64.0f;
+    return ppem / ftFont_->size->metrics.y_ppem;
+}
+
+std::mutex& Font::LibraryMutex()
+{
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+
+int Font::getResolution()
+{
 #if defined(_WIN32)
-    const int logic_dpi_x = 96;
-    const int logic_dpi_y = 96;
+    const int logic_dpi = 96;
 #elif defined(__APPLE__)
-    const int logic_dpi_x = 72;
-    const int logic_dpi_y = 72;
+    const int logic_dpi = 72;
 #else
     #error "not implemented"
 #endif
-    FT_Set_Char_Size(
-        ftFont_, 
-        0,                                       // same as character height
-        (FT_F26Dot6)(fontSize*contentScale*64),  // char_height in 1/64th of points
-        logic_dpi_x,                             // horizontal device resolution
-        logic_dpi_y                              // vertical device resolution
-    );
-
-    underlinePos_ = 
-        ftFont_->underline_position / (float)ftFont_->units_per_EM * ftFont_->size->metrics.y_ppem;
-    underlineThickness_ = 
-        ftFont_->underline_thickness / (float)ftFont_->units_per_EM * ftFont_->size->metrics.y_ppem;
+    return logic_dpi;
+}
 
-    hbFont_ = hb_ft_font_create_referenced(ftFont_);
+unsigned int Font::genID()
+{
+    static unsigned int s_ID = 0;
+    return (++s_ID);
+}
 
-    ftFont_guard.dismiss();
-    ID_ = genID();
-    fontSize_ = fontSize;
-    contentScale_ = contentScale;
-    bold_ = bold;
-    italic_ = italic;
+bool Font::newInstance(Instance &inst)
+{
+    inst.hbFont = NULL;
+    FT_Face face;
+    {
+        std::lock_guard<std::mutex> lock(LibraryMutex());
+        if (FT_New_Memory_Face(ftLib_, fontData_.Data(), (FT_Long)fontData_.Size(), 0, &face))
+        {
+            return false;
+        }
+    }
+
+    inst.ftFont = face;
+    setInstanceState(inst);
+    // hb_font_t keeps a reference to the face
+    inst.hbFont = hb_ft_font_create_referenced(face);
+    return true;
+}
+
+void Font::setInstanceState(Instance &inst)
+{
+    inst.charHeight = getCharHeight();
+    if (FT_IS_SCALABLE(inst.ftFont) || !FT_HAS_FIXED_SIZES(inst.ftFont))
+    {
+        FT_Set_Char_Size(
+            inst.ftFont,
+            0,                                   // same as character height
+            inst.charHeight,                     // char_height in 1/64th of points
+            getResolution(),                     // horizontal device resolution
+            getResolution()                      // vertical device resolution
+        );
+    }
+    else
+    {
+        // the smallest strike not below the font size, scaled down when drawn
+        FT_Pos ppem = inst.charHeight * getResolution() / 72;
+        FT_Int best = 0;
+        for (FT_Int i = 1; i < inst.ftFont->num_fixed_sizes; i++)
+        {
+            FT_Pos size = inst.ftFont->available_sizes[i].y_ppem;
+            FT_Pos bestSize = inst.ftFont->available_sizes[best].y_ppem;
+            if ((bestSize < ppem && size > bestSize) || (size >= ppem && size < bestSize))
+            {
+                best = i;
+            }
+        }
+        FT_Select_Size(inst.ftFont, best);
+    }
+    inst.varKey = varKey_;
+    if (FT_HAS_MULTIPLE_MASTERS(inst.ftFont))
+    {
+        // no coordinates selects the default instance
+        std::vector<FT_Fixed> ft_coords(varCoords_.size());
+        for (size_t i = 0; i < varCoords_.size(); i++)
+        {
+            ft_coords[i] = (FT_Fixed)(varCoords_[i] * 0x10000L);
+        }
+        FT_Set_Var_Blend_Coordinates(inst.ftFont, (FT_UInt)ft_coords.size(), ft_coords.data());
+    }
+    if (inst.hbFont)
+    {
+        // also picks up the variation coordinates
+        hb_ft_font_changed(inst.hbFont);
+    }
+}
+
+void Font::updateUnderline()
+{
+    underlinePos_ =
+        ftFont_->underline_position / (float)ftFont_->units_per_EM * ftFont_->size->metrics.y_ppem;
+    underlineThickness_ =
+        ftFont_->underline_thickness / (float)ftFont_->units_per_EM * ftFont_->size->metrics.y_ppem;
     if (synthesisBold())
     {
         underlineThickness_ *= 1.5f;
     }
-    initOK_ = true;
-    return;
 }
 
-unsigned int Font::genID()
+void Font::doneInstance(Instance &inst)
 {
-    static unsigned int s_ID = 0;
-    return (++s_ID);
+    hb_font_destroy(inst.hbFont);
+    inst.hbFont = NULL;
+
+    std::lock_guard<std::mutex> lock(LibraryMutex());
+    FT_Done_Face(inst.ftFont);
+    inst.ftFont = NULL;
 }
@@ -6,19 +6,85 @@
 #include <hb.h>
 #include <hb-ft.h>
 
+#include "mapped_file.h"
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+
+// How glyphs of a font are stored in the texture atlas.
+enum class GlyphFormat {
+    Bitmap,     // Coverage bitmap at the exact font size
+    SDF,        // Signed distance field, one entry serves a range of sizes
+    MSDF,       // Multi-channel distance field, keeps corners sharp when magnified
+};
+
 //------------------------------------------------------------------------------
 
 class Font
 {
+public:
+    // A FreeType face (with its own FT_Size) and a HarfBuzz font created over
+    // the font file bytes. Each instance may only be used by one thread at a time.
+    struct Instance {
+        FT_Face ftFont;
+        hb_font_t* hbFont;
+        FT_F26Dot6 charHeight;
+        uint64_t varKey;
+    };
+
+    // Advance and ink extents of a glyph, in pixels at the current size.
+    struct GlyphMetrics {
+        float advance;
+        float xMin, yMin, xMax, yMax;
+    };
+
+private:
+    // Unscaled metrics, in font units.
+    struct RawMetrics {
+        uint16_t advance;
+        int16_t xMin, yMin, xMax, yMax;
+    };
+
+    typedef std::map<std::thread::id, std::unique_ptr<Instance>> InstanceMap;
+    typedef std::vector<std::unique_ptr<Instance>> InstanceVector;
+
     unsigned int ID_;
+    std::string fontFile_;
+    MappedFile fontData_;
+    FT_Library ftLib_;
     FT_Face ftFont_;
     hb_font_t* hbFont_;
+    std::thread::id ownerThread_;
+    std::mutex instanceMutex_;
+    InstanceMap threadInstances_;
+    InstanceVector idleInstances_;
+    size_t maxIdleInstances_;
+    std::once_flag hashOnce_;
+    std::thread hashThread_;
+    uint64_t hash_;
+    std::vector<RawMetrics> metrics_;
+    std::atomic<bool> metricsReady_;
+    std::thread metricsThread_;
     float fontSize_;
     float contentScale_;
     bool bold_;
     bool italic_;
+    GlyphFormat glyphFormat_;
     float underlinePos_;
     float underlineThickness_;
+    unsigned int layoutGen_;
+    FT_F26Dot6 prevCharHeight_;
+    float varStep_;
+    std::vector<float> varCoords_;
+    uint64_t varKey_;
     bool initOK_;
 
 public:
@@ -28,12 +94,82 @@ public:
     bool Ok() { return initOK_; }
     
     unsigned int getID() const { return ID_; }
+    const std::string& getFile() const { return fontFile_; }
     FT_Face getFTFont() const { return ftFont_; }
     hb_font_t* getHBFont() const { return hbFont_; }
+
+    // Returns the instance of the calling thread, created on first use. The
+    // thread that constructed the Font gets getFTFont()/getHBFont().
+    Instance ForThread();
+    // Returns the calling thread's instance to the idle cache, where another
+    // thread can pick it up. At most maxIdle instances are kept alive there.
+    void ReleaseThread();
+    void SetMaxIdleInstances(size_t maxIdle);
+
+    // Content hash of the font file, computed on a background thread when
+    // the font is loaded. Waits for it on first use.
+    uint64_t getHash();
+
+    // Builds the metrics table of all glyphs, optionally on a background
+    // thread. The table is loaded from / saved to a sidecar file in the
+    // per-user cache directory, named by the font hash, which holds the
+    // metrics of the default instance.
+    bool BuildMetrics(bool background);
+    bool MetricsReady() const { return metricsReady_; }
+    // Only valid once MetricsReady() returns true. The table is of the
+    // default instance, other instances of variable fonts have none.
+    bool GetGlyphMetrics(unsigned int glyph_index, GlyphMetrics &m) const
+    {
+        if (glyph_index >= metrics_.size() || varKey_ != 0)
+            return false;
+        const RawMetrics &r = metrics_[glyph_index];
+        // 16.16 scale from font units to 26.6 pixels
+        float sx = ftFont_->size->metrics.x_scale / (65536.f * 64.f);
+        float sy = ftFont_->size->metrics.y_scale / (65536.f * 64.f);
+        m.advance = r.advance * sx;
+        m.xMin = r.xMin * sx;
+        m.yMin = r.yMin * sy;
+        m.xMax = r.xMax * sx;
+        m.yMax = r.yMax * sy;
+        return true;
+    }
+
+    // Serializes FT_New_Face/FT_Done_Face on the shared FT_Library.
+    static std::mutex& LibraryMutex();
+
     float getSize() const { return fontSize_; }
     float getContentScale() const { return contentScale_; }
+    // Re-derives the FreeType sizes for a new content scale (e.g. the window
+    // moved to a monitor with a different DPI). Other threads pick the new
+    // size up on their next ForThread() call.
+    void SetContentScale(float contentScale);
+    // Changes the font size in place, e.g. for zooming.
+    void SetSize(float fontSize);
+    // Sets the normalized ([-1, 1]) coordinates of a variable font, in axis
+    // order. Coordinates are quantized to the variation step, so animating an
+    // axis (e.g. wght on hover) only produces a bounded set of instances.
+    void SetVariation(const float* coords, unsigned int numCoords);
+    void SetVariationStep(float step) { varStep_ = step; }
+    const std::vector<float>& getVariation() const { return varCoords_; }
+    // Hash of the quantized coordinates of all axes. Zero for the default
+    // instance.
+    uint64_t getVarKey() const { return varKey_; }
+
+    // Incremented on every size or variation change, TextRuns use it to redo
+    // their layout.
+    unsigned int getLayoutGen() const { return layoutGen_; }
+    // Char height before the last size or content scale change, 0 if the
+    // font was never resized.
+    FT_F26Dot6 getPrevCharHeight() const { return prevCharHeight_; }
+    FT_F26Dot6 getCharHeight() const { return (FT_F26Dot6)(fontSize_*contentScale_*64); }
+    static int getResolution();
+    // Bitmap-only fonts (e.g. CBDT emoji) come in fixed sizes; their glyphs and
+    // metrics are scaled by this to the font size. 1 for scalable fonts.
+    float getStrikeScale() const;
     bool getBold() const { return bold_; }
     bool getItalic() const { return italic_; }
+    GlyphFormat getGlyphFormat() const { return glyphFormat_; }
+    void SetGlyphFormat(GlyphFormat format) { glyphFormat_ = format; }
     bool synthesisBold() const
     { 
         return (bold_ && !(ftFont_->style_flags & FT_STYLE_FLAG_BOLD));
@@ -54,6 +190,15 @@ public:
 private:
     void init(FT_Library ftLib, const char* fontFile, float fontSize, float contentScale, bool bold, bool italic);
     unsigned int genID();
+    bool newInstance(Instance &inst);
+    void setInstanceState(Instance &inst);
+    void applySize(float fontSize, float contentScale);
+    void updateUnderline();
+    static void doneInstance(Instance &inst);
+    bool loadMetrics(const std::string &path, std::vector<RawMetrics> &metrics);
+    bool saveMetrics(const std::string &path, const std::vector<RawMetrics> &metrics);
+    bool computeMetrics(std::vector<RawMetrics> &metrics);
+    void buildMetrics();
 };
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,191 @@
+#include "font_cache.h"
+#include FT_MULTIPLE_MASTERS_H
+#include <vector>
+#include <cassert>
+
+// Size the unscaled (FT_LOAD_NO_SCALE) glyphs are looked up with, 12pt.
+static const FT_UInt UnscaledCharHeight = 12 * 64;
+
+FontCache::FontCache()
+: ftLib_(NULL), manager_(NULL), imageCache_(NULL), maxBytes_(0), lookups_(0)
+{
+}
+
+FontCache::~FontCache()
+{
+    if (manager_)
+    {
+        // also destroys all caches created by the manager
+        FTC_Manager_Done(manager_);
+        manager_ = NULL;
+    }
+    if (ftLib_)
+    {
+        FT_Done_FreeType(ftLib_);
+        ftLib_ = NULL;
+    }
+}
+
+bool FontCache::Init(unsigned int maxFaces, unsigned int maxSizes, unsigned long maxBytes)
+{
+    assert(manager_ == NULL);
+
+    // the manager closes faces in the middle of lookups, which on a shared
+    // library would race with the Fonts opening theirs
+    if (FT_Init_FreeType(&ftLib_))
+    {
+        ftLib_ = NULL;
+        return false;
+    }
+    if (FTC_Manager_New(ftLib_, maxFaces, maxSizes, maxBytes, faceRequester, this, &manager_))
+    {
+        return false;
+    }
+    if (FTC_ImageCache_New(manager_, &imageCache_))
+    {
+        FTC_Manager_Done(manager_);
+        manager_ = NULL;
+        return false;
+    }
+
+    maxBytes_ = maxBytes;
+    return true;
+}
+
+bool FontCache::LoadGlyph(const Font& font, unsigned int glyph_index, FT_Int32 loadFlags, FT_Glyph &glyph)
+{
+    assert(manager_ != NULL);
+
+    if (font.getVarKey() == 0)
+    {
+        return LoadGlyph(font, font.getCharHeight(), glyph_index, loadFlags, glyph);
+    }
+
+    // the image cache can't tell instances apart, load from the face
+    std::lock_guard<std::mutex> lock(mutex_);
+    FTC_FaceID face_id = getFaceID(font);
+    if (face_id == NULL)
+    {
+        return false;
+    }
+    FTC_ScalerRec scaler;
+    setScaler(scaler, face_id, font.getCharHeight(), loadFlags);
+    FT_Size size;
+    if (FTC_Manager_LookupSize(manager_, &scaler, &size))
+    {
+        return false;
+    }
+    setInstance((Face*)face_id, size->face, font.getVarKey(), font.getVariation());
+    if (FT_Load_Glyph(size->face, glyph_index, loadFlags) ||
+        FT_Get_Glyph(size->face->glyph, &glyph))
+    {
+        return false;
+    }
+    lookups_++;
+    return true;
+}
+
+bool FontCache::LoadGlyph(const Font& font, FT_F26Dot6 charHeight, unsigned int glyph_index, FT_Int32 loadFlags,
+                          FT_Glyph &glyph)
+{
+    assert(manager_ != NULL);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    FTC_FaceID face_id = getFaceID(font);
+    if (face_id == NULL)
+    {
+        return false;
+    }
+    FTC_ScalerRec scaler;
+    setScaler(scaler, face_id, charHeight, loadFlags);
+
+    // images are only cached for the default instance, which the face has to
+    // be set to when they are loaded
+    FT_Face face;
+    if (FTC_Manager_LookupFace(manager_, face_id, &face))
+    {
+        return false;
+    }
+    setInstance((Face*)face_id, face, 0, std::vector<float>());
+
+    // the cached glyph is only valid until the next lookup, make a copy
+    FT_Glyph cached;
+    if (FTC_ImageCache_LookupScaler(imageCache_, &scaler, loadFlags, glyph_index, &cached, NULL))
+    {
+        return false;
+    }
+    lookups_++;
+    if (FT_Glyph_Copy(cached, &glyph))
+    {
+        return false;
+    }
+    return true;
+}
+
+void FontCache::setScaler(FTC_ScalerRec &scaler, FTC_FaceID face_id, FT_F26Dot6 charHeight, FT_Int32 loadFlags)
+{
+    scaler.face_id = face_id;
+    scaler.width = 0;                           // same as character height
+    scaler.height = (FT_UInt)charHeight;
+    if (loadFlags & FT_LOAD_NO_SCALE)
+    {
+        // unscaled outlines are the same at every size, keep a single copy
+        scaler.height = UnscaledCharHeight;
+    }
+    scaler.pixel = 0;                           // size is in 1/64th of points
+    scaler.x_res = Font::getResolution();
+    scaler.y_res = Font::getResolution();
+}
+
+FTC_FaceID FontCache::getFaceID(const Font& font)
+{
+    FaceMap::iterator iter = faces_.find(font.getFile());
+    if (iter != faces_.end())
+    {
+        return (FTC_FaceID)iter->second.get();
+    }
+
+    std::unique_ptr<Face> face(new Face);
+    face->file = font.getFile();
+    if (!face->data.Open(face->file.c_str()))
+    {
+        return NULL;
+    }
+    face->index = 0;
+    face->varKey = 0;
+    FTC_FaceID face_id = (FTC_FaceID)face.get();
+    faces_[face->file] = std::move(face);
+    return face_id;
+}
+
+void FontCache::setInstance(Face *face, FT_Face ftFace, uint64_t varKey, const std::vector<float> &coords)
+{
+    if (face->varKey == varKey)
+    {
+        return;
+    }
+
+    // the coordinates are normalized, no coordinates select the default
+    std::vector<FT_Fixed> ft_coords(varKey != 0 ? coords.size() : 0);
+    for (size_t i = 0; i < ft_coords.size(); i++)
+    {
+        ft_coords[i] = (FT_Fixed)(coords[i] * 0x10000L);
+    }
+    FT_Set_Var_Blend_Coordinates(ftFace, (FT_UInt)ft_coords.size(), ft_coords.data());
+    face->varKey = varKey;
+}
+
+FT_Error FontCache::faceRequester(FTC_FaceID face_id, FT_Library library, FT_Pointer req_data, FT_Face *aface)
+{
+    FontCache *cache = (FontCache*)req_data;
+    return cache->openFace((Face*)face_id, library, aface);
+}
+
+FT_Error FontCache::openFace(Face *face, FT_Library library, FT_Face *aface)
+{
+    assert(face != NULL && face->data.IsOpen());
+
+    // a (re)opened face starts out as the default instance
+    face->varKey = 0;
+    return FT_New_Memory_Face(library, face->data.Data(), (FT_Long)face->data.Size(), face->index, aface);
+}
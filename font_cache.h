@@ -0,0 +1,81 @@
+#ifndef __FONT_CACHE_H__
+#define __FONT_CACHE_H__
+
+#include "font.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_GLYPH_H
+#include FT_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+// Wraps FreeType's cache subsystem. Faces, sizes and glyph images are owned
+// by an FTC_Manager and kept within an explicit byte budget, so faces can be
+// closed and reopened under memory pressure, and a glyph evicted from the
+// texture atlas can be rendered again without reloading its outline. The
+// manager opens and closes its faces on a library of its own, so lookups
+// only lock the cache, not the library the Fonts share.
+class FontCache
+{
+    // A face is opened once per file, the instances of a variable font are
+    // selected on it per lookup. The file is mapped along with the entry, so
+    // reopening a face the manager closed doesn't go to the disk.
+    struct Face {
+        std::string file;
+        MappedFile data;
+        int index;
+        uint64_t varKey;        // Instance the open face is set to
+    };
+    typedef std::map<std::string, std::unique_ptr<Face>> FaceMap;
+
+    FT_Library ftLib_;          // Private, see Init
+    FTC_Manager manager_;
+    FTC_ImageCache imageCache_;
+    FaceMap faces_;
+    std::mutex mutex_;          // Guards the manager and faces_
+    unsigned long maxBytes_;
+    std::atomic<uint64_t> lookups_;
+
+public:
+    FontCache();
+    ~FontCache();
+
+    bool Init(unsigned int maxFaces, unsigned int maxSizes, unsigned long maxBytes);
+
+    // Looks up the (unrendered) glyph image of font, loaded with loadFlags. On
+    // success glyph receives a copy owned by the caller, which must be released
+    // with FT_Done_Glyph. Only glyphs of the default instance are kept in the
+    // image cache, the others are loaded from the cached face. Thread safe.
+    bool LoadGlyph(const Font& font, unsigned int glyph_index, FT_Int32 loadFlags, FT_Glyph &glyph);
+    // Same for the default instance at charHeight, without reading the size
+    // of font, for threads other than its owner, which may resize it meanwhile.
+    bool LoadGlyph(const Font& font, FT_F26Dot6 charHeight, unsigned int glyph_index, FT_Int32 loadFlags,
+                   FT_Glyph &glyph);
+
+    FT_Library Library() const { return ftLib_; }
+    unsigned long MaxBytes() const { return maxBytes_; }
+    uint64_t Lookups() const { return lookups_; }
+
+private:
+    FTC_FaceID getFaceID(const Font& font);
+    void setScaler(FTC_ScalerRec &scaler, FTC_FaceID face_id, FT_F26Dot6 charHeight, FT_Int32 loadFlags);
+    // Sets the variation instance of varKey with normalized coords on the open
+    // face, no coords select the default.
+    void setInstance(Face *face, FT_Face ftFace, uint64_t varKey, const std::vector<float> &coords);
+    FT_Error openFace(Face *face, FT_Library library, FT_Face *aface);
+    // req_data is the FontCache owning the manager.
+    static FT_Error faceRequester(FTC_FaceID face_id, FT_Library library, FT_Pointer req_data, FT_Face *aface);
+};
+
+//------------------------------------------------------------------------------
+
+#endif // !__FONT_CACHE_H__
@@ -0,0 +1,409 @@
+#include "glyph_raster.h"
+#include "msdf.h"
+#include "pixel_kernels.h"
+#include "scope_guard.h"
+
+#include FT_OUTLINE_H
+#include FT_STROKER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+// The SDF is computed on a bitmap supersampled by this factor.
+static const int SDFSupersample = 4;
+
+// Blurs are made of this many box filter passes, close to a Gaussian.
+static const int BlurPasses = 3;
+
+//------------------------------------------------------------------------------
+
+// 1D squared Euclidean distance transform of f (Felzenszwalb & Huttenlocher).
+static void edt1d(const float *f, int n, float *d, int *v, float *z)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    int k = 0;
+    v[0] = 0;
+    z[0] = -inf;
+    z[1] = inf;
+    for (int q = 1; q < n; q++)
+    {
+        float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2.0f * (q - v[k]));
+        while (s <= z[k])
+        {
+            k--;
+            s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2.0f * (q - v[k]));
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = inf;
+    }
+    k = 0;
+    for (int q = 0; q < n; q++)
+    {
+        while (z[k + 1] < q)
+            k++;
+        d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+    }
+}
+
+// Squared distance of every cell to the nearest cell where inside == target.
+static void edt2d(const std::vector<uint8_t> &inside, uint8_t target, int width, int height,
+                  std::vector<float> &dist)
+{
+    const float inf = 1e20f;
+    int n = std::max(width, height);
+    std::vector<float> f(n), d(n), z(n + 1);
+    std::vector<int> v(n);
+
+    dist.resize(width * height);
+    for (int i = 0; i < width * height; i++)
+    {
+        dist[i] = (inside[i] == target) ? 0.0f : inf;
+    }
+    for (int x = 0; x < width; x++)
+    {
+        for (int y = 0; y < height; y++)
+            f[y] = dist[y * width + x];
+        edt1d(f.data(), height, d.data(), v.data(), z.data());
+        for (int y = 0; y < height; y++)
+            dist[y * width + x] = d[y];
+    }
+    for (int y = 0; y < height; y++)
+    {
+        edt1d(dist.data() + y * width, width, d.data(), v.data(), z.data());
+        memcpy(dist.data() + y * width, d.data(), width * sizeof(float));
+    }
+}
+
+// Renders outline (in 26.6 pixels) as a signed distance field. Distances are
+// measured on a supersampled bitmap and averaged down to output pixels.
+static bool renderSDF(FT_Library library, FT_Outline *outline, GlyphBitmap &bitmap)
+{
+    if (outline->n_points == 0)
+    {
+        bitmap.Width = bitmap.Rows = bitmap.Left = bitmap.Top = 0;
+        bitmap.Pixels.clear();
+        return true;
+    }
+
+    FT_BBox cbox;
+    FT_Outline_Get_CBox(outline, &cbox);
+    int x0 = (int)(cbox.xMin >> 6) - SDFSpread;
+    int y0 = (int)(cbox.yMin >> 6) - SDFSpread;
+    int x1 = (int)((cbox.xMax + 63) >> 6) + SDFSpread;
+    int y1 = (int)((cbox.yMax + 63) >> 6) + SDFSpread;
+    int width = x1 - x0;
+    int rows = y1 - y0;
+
+    const int ss = SDFSupersample;
+    int ss_width = width * ss;
+    int ss_rows = rows * ss;
+    std::vector<uint8_t> coverage(ss_width * ss_rows);
+
+    FT_Outline_Translate(outline, -x0 * 64, -y0 * 64);
+    FT_Matrix matrix;
+    matrix.xx = ss * 0x10000L;
+    matrix.xy = 0;
+    matrix.yx = 0;
+    matrix.yy = ss * 0x10000L;
+    FT_Outline_Transform(outline, &matrix);
+
+    FT_Bitmap target;
+    memset(&target, 0, sizeof(target));
+    target.width = ss_width;
+    target.rows = ss_rows;
+    target.pitch = ss_width;
+    target.buffer = coverage.data();
+    target.num_grays = 256;
+    target.pixel_mode = FT_PIXEL_MODE_GRAY;
+    if (FT_Outline_Get_Bitmap(library, outline, &target))
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> inside(ss_width * ss_rows);
+    for (size_t i = 0; i < inside.size(); i++)
+    {
+        inside[i] = (coverage[i] >= 128) ? 1 : 0;
+    }
+    std::vector<float> to_inside, to_outside;
+    edt2d(inside, 1, ss_width, ss_rows, to_inside);
+    edt2d(inside, 0, ss_width, ss_rows, to_outside);
+
+    bitmap.Width = width;
+    bitmap.Rows = rows;
+    bitmap.Left = x0;
+    bitmap.Top = y1;
+    bitmap.Pixels.resize(width * rows);
+    for (int y = 0; y < rows; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float sum = 0.0f;
+            for (int sy = y * ss; sy < (y + 1) * ss; sy++)
+            {
+                for (int sx = x * ss; sx < (x + 1) * ss; sx++)
+                {
+                    int i = sy * ss_width + sx;
+                    // the outline runs half a cell from the cell centers
+                    float d = inside[i] ? std::sqrt(to_outside[i]) - 0.5f
+                                        : 0.5f - std::sqrt(to_inside[i]);
+                    sum += d;
+                }
+            }
+            // positive inside, in output pixels, 0.5 on the outline
+            float dist = sum / (ss * ss) / ss;
+            float v = 0.5f + dist / (2.0f * SDFSpread);
+            bitmap.Pixels[y * width + x] = (uint8_t)(std::max(0.0f, std::min(1.0f, v)) * 255.0f + 0.5f);
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+// Blurs a single channel bitmap like a Gaussian of standard deviation
+// radius / 2 (as CSS shadows do), growing it by the reach of the blur.
+static void blurBitmap(int radius, GlyphBitmap &bitmap)
+{
+    // box widths whose passes add up to the variance of the Gaussian: n boxes
+    // of width w have variance n (w^2 - 1) / 12, so the ideal width is
+    // sqrt(12 sigma^2 / n + 1), rounded to the odd widths below and above
+    // with m passes of the lower one (Kovesi, fast almost-Gaussian filtering)
+    float sigma = radius * 0.5f;
+    float variance = 12.0f * sigma * sigma;
+    int lower = (int)std::floor(std::sqrt(variance / BlurPasses + 1.0f));
+    if (lower % 2 == 0)
+        lower--;
+    int m = (int)std::lround((variance - BlurPasses * lower * lower - 4 * BlurPasses * lower - 3 * BlurPasses) /
+                             (-4.0f * lower - 4.0f));
+    int radii[BlurPasses];
+    int pad = 0;
+    for (int i = 0; i < BlurPasses; i++)
+    {
+        radii[i] = std::max(0, std::min(128, (i < m ? lower : lower + 2) / 2));
+        pad += radii[i];
+    }
+    if (pad == 0)
+    {
+        // below one texel every box rounds away, keep the smallest blur
+        radii[BlurPasses - 1] = 1;
+        pad = 1;
+    }
+
+    int width = bitmap.Width + 2 * pad;
+    int rows = bitmap.Rows + 2 * pad;
+    std::vector<uint8_t> pixels(width * rows, 0);
+    BlitRows(&pixels[pad * width + pad], width, bitmap.Pixels.data(), bitmap.Width, bitmap.Width, bitmap.Rows);
+    BoxBlur(pixels.data(), width, rows, radii, BlurPasses);
+
+    bitmap.Width = width;
+    bitmap.Rows = rows;
+    bitmap.Left -= pad;
+    bitmap.Top += pad;
+    bitmap.Pixels.swap(pixels);
+}
+
+//------------------------------------------------------------------------------
+
+// Em size in pixels distance fields of format are generated at, 0 for bitmaps.
+static int fieldPixelSize(GlyphFormat format)
+{
+    switch (format)
+    {
+    case GlyphFormat::SDF:
+        return SDFPixelSize;
+    case GlyphFormat::MSDF:
+        return MSDFPixelSize;
+    default:
+        return 0;
+    }
+}
+
+// Em size in pixels glyphs of params are scaled to from the unscaled
+// outline, 0 for bitmaps hinted at the font size.
+static float unscaledPixelSize(const RasterParams &params)
+{
+    int fieldSize = fieldPixelSize(params.format);
+    if (fieldSize)
+    {
+        return (float)fieldSize;
+    }
+    return params.bucketCharHeight / 64.0f * Font::getResolution() / 72.0f;
+}
+
+FT_Int32 RasterLoadFlags(const RasterParams &params)
+{
+    // distance fields and zoom buckets are scaled at draw time, they need the
+    // unhinted outline
+    return unscaledPixelSize(params) > 0 ? FT_LOAD_NO_SCALE : FT_LOAD_DEFAULT;
+}
+
+FT_F26Dot6 RasterCharHeight(const RasterParams &params, FT_F26Dot6 charHeight)
+{
+    int pixelSize = fieldPixelSize(params.format);
+    if (pixelSize)
+    {
+        return (FT_F26Dot6)(pixelSize * 64 * 72 / Font::getResolution());
+    }
+    if (params.bucketCharHeight > 0)
+    {
+        return params.bucketCharHeight;
+    }
+    return charHeight;
+}
+
+bool RasterizeGlyph(FT_Glyph glyph, const RasterParams &params, GlyphBitmap &bitmap)
+{
+    auto glyph_guard = scopeGuard([&glyph]{ FT_Done_Glyph(glyph); });
+
+    bitmap.Format = params.format;
+    bitmap.Channels = 1;
+    bitmap.Scale = 1.0f;
+    float pixelSize = unscaledPixelSize(params);
+    if (pixelSize > 0)
+    {
+        if (glyph->format != FT_GLYPH_FORMAT_OUTLINE)
+        {
+            return false;
+        }
+        // from font units to 26.6 pixels at the distance field or bucket size
+        FT_Matrix matrix;
+        matrix.xx = (FT_Fixed)(64.0 * pixelSize / params.unitsPerEM * 0x10000L);
+        matrix.xy = 0;
+        matrix.yx = 0;
+        matrix.yy = matrix.xx;
+        FT_Outline_Transform(&((FT_OutlineGlyph)glyph)->outline, &matrix);
+    }
+
+    if (params.format == GlyphFormat::SDF)
+    {
+        return renderSDF(glyph->library, &((FT_OutlineGlyph)glyph)->outline, bitmap);
+    }
+    if (params.format == GlyphFormat::MSDF)
+    {
+        return RenderMSDF(&((FT_OutlineGlyph)glyph)->outline, MSDFSpread, bitmap);
+    }
+
+    if (params.strokeWidth > 0 && glyph->format == FT_GLYPH_FORMAT_OUTLINE)
+    {
+        FT_Stroker stroker;
+        if (FT_Stroker_New(glyph->library, &stroker))
+        {
+            return false;
+        }
+        auto stroker_guard = scopeGuard([&stroker]{ FT_Stroker_Done(stroker); });
+        FT_Stroker_Set(stroker, params.strokeWidth, FT_STROKER_LINECAP_ROUND, FT_STROKER_LINEJOIN_ROUND, 0);
+        // the outside border encloses the glyph with the stroke around it
+        if (FT_Glyph_StrokeBorder(&glyph, stroker, 0, 1))
+        {
+            return false;
+        }
+    }
+
+    if (FT_Glyph_To_Bitmap(&glyph, FT_RENDER_MODE_NORMAL, NULL, 1))
+    {
+        return false;
+    }
+
+    FT_BitmapGlyph bitmap_glyph = (FT_BitmapGlyph)glyph;
+    const FT_Bitmap &src = bitmap_glyph->bitmap;
+    bitmap.Width = src.width;
+    bitmap.Rows = src.rows;
+    bitmap.Left = bitmap_glyph->left;
+    bitmap.Top = bitmap_glyph->top;
+    bitmap.Pixels.resize(src.width * src.rows);
+    BlitRows(bitmap.Pixels.data(), src.width, src.buffer, src.pitch, src.width, src.rows);
+    if (params.coverageLUT)
+    {
+        ApplyLUT(bitmap.Pixels.data(), bitmap.Pixels.size(), params.coverageLUT);
+    }
+    if (params.blurRadius > 0 && bitmap.Width > 0 && bitmap.Rows > 0)
+    {
+        blurBitmap(params.blurRadius, bitmap);
+    }
+    return true;
+}
+
+bool RasterizeColorGlyph(FT_Face face, unsigned int glyph_index, FT_F26Dot6 charHeight, GlyphBitmap &bitmap,
+                         int blurRadius)
+{
+    if (FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT | FT_LOAD_COLOR))
+    {
+        return false;
+    }
+    // COLR layers are blended by FT_Render_Glyph, CBDT / sbix load as bitmaps
+    FT_GlyphSlot slot = face->glyph;
+    if (slot->format != FT_GLYPH_FORMAT_BITMAP && FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL))
+    {
+        return false;
+    }
+
+    const FT_Bitmap &src = slot->bitmap;
+    bitmap.Width = src.width;
+    bitmap.Rows = src.rows;
+    bitmap.Left = slot->bitmap_left;
+    bitmap.Top = slot->bitmap_top;
+    bitmap.Format = GlyphFormat::Bitmap;
+    bitmap.Scale = 1.0f;
+    if (!FT_IS_SCALABLE(face) && face->size->metrics.y_ppem > 0)
+    {
+        bitmap.Scale = charHeight * Font::getResolution() / 72.0f / 64.0f / face->size->metrics.y_ppem;
+    }
+
+    switch (src.pixel_mode)
+    {
+    case FT_PIXEL_MODE_BGRA:
+        bitmap.Channels = 4;
+        bitmap.Pixels.resize(src.width * src.rows * 4);
+        for (unsigned int i = 0; i < src.rows; i++)
+        {
+            const uint8_t *s = src.buffer + i * src.pitch;
+            uint8_t *d = bitmap.Pixels.data() + i * src.width * 4;
+            for (unsigned int j = 0; j < src.width; j++, s += 4, d += 4)
+            {
+                d[0] = s[2];
+                d[1] = s[1];
+                d[2] = s[0];
+                d[3] = s[3];
+            }
+        }
+        break;
+    case FT_PIXEL_MODE_GRAY:
+        bitmap.Channels = 1;
+        bitmap.Pixels.resize(src.width * src.rows);
+        BlitRows(bitmap.Pixels.data(), src.width, src.buffer, src.pitch, src.width, src.rows);
+        break;
+    case FT_PIXEL_MODE_MONO:
+        bitmap.Channels = 1;
+        bitmap.Pixels.resize(src.width * src.rows);
+        for (unsigned int i = 0; i < src.rows; i++)
+        {
+            for (unsigned int j = 0; j < src.width; j++)
+            {
+                bool set = (src.buffer[i * src.pitch + j / 8] >> (7 - j % 8)) & 1;
+                bitmap.Pixels[i * src.width + j] = set ? 255 : 0;
+            }
+        }
+        break;
+    default:
+        return false;
+    }
+
+    if (blurRadius > 0 && bitmap.Width > 0 && bitmap.Rows > 0)
+    {
+        if (bitmap.Channels == 4)
+        {
+            // the shadow is cast by the alpha, whatever the colours
+            for (int i = 0; i < bitmap.Width * bitmap.Rows; i++)
+                bitmap.Pixels[i] = bitmap.Pixels[i * 4 + 3];
+            bitmap.Pixels.resize(bitmap.Width * bitmap.Rows);
+            bitmap.Channels = 1;
+        }
+        blurBitmap(blurRadius, bitmap);
+    }
+    return true;
+}
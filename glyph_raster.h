@@ -0,0 +1,80 @@
+#ifndef __GLYPH_RASTER_H__
+#define __GLYPH_RASTER_H__
+
+#include "font.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_GLYPH_H
+
+#include <cstdint>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+// Signed distance fields are generated at this em size, in pixels, and
+// encode distances up to SDFSpread pixels on both sides of the outline.
+const int SDFPixelSize = 48;
+const int SDFSpread = 6;
+// Same for multi-channel fields, which stay sharp from a smaller em size.
+const int MSDFPixelSize = 32;
+const int MSDFSpread = 4;
+
+// Everything needed to rasterize a glyph of a font, captured on the render
+// thread so rasterization can run on any thread. Synthetic styles are not
+// part of it, they are applied when drawing.
+struct RasterParams {
+    GlyphFormat format;
+    int unitsPerEM;
+    bool color;         // Colour font, see RasterizeColorGlyph
+    FT_F26Dot6 strokeWidth; // Rasterize the glyph grown by this stroke (26.6 pixels), bitmaps only
+    int blurRadius;     // Blur the coverage by this radius (pixels), bitmaps only; for colour
+                        // fonts the blurred alpha, as the shadow of the glyph
+    const uint8_t *coverageLUT; // Adjusts bitmap coverage, see BuildCoverageLUT; null for none
+    FT_F26Dot6 bucketCharHeight; // Rasterize bitmaps unhinted at this size instead of the font's, 0 for none
+
+    static RasterParams FromFont(const Font& font, FT_F26Dot6 strokeWidth = 0, int blurRadius = 0)
+    {
+        FT_Face face = font.getFTFont();
+        return RasterParams{ font.getGlyphFormat(), face->units_per_EM,
+                             font.getGlyphFormat() == GlyphFormat::Bitmap && FT_HAS_COLOR(face),
+                             strokeWidth, blurRadius, nullptr, 0 };
+    }
+};
+
+// A rasterized glyph, 8-bit coverage (or distance) per channel, tightly
+// packed rows.
+struct GlyphBitmap {
+    int Width;
+    int Rows;
+    int Left;           // Offset from horizontal layout origin to left of bitmap
+    int Top;            // Offset from horizontal layout origin to top of bitmap
+    int Channels;       // 1, 3 for MSDF, or 4 for colour glyphs (premultiplied RGBA)
+    float Scale;        // To draw the bitmap at, see Font::getStrikeScale
+    GlyphFormat Format;
+    std::vector<uint8_t> Pixels;
+};
+
+// FT_Load_Glyph flags for the glyph to pass to RasterizeGlyph.
+FT_Int32 RasterLoadFlags(const RasterParams &params);
+
+// The char height (as in Font::getCharHeight) that glyphs of params are
+// rasterized at, for a font of charHeight.
+FT_F26Dot6 RasterCharHeight(const RasterParams &params, FT_F26Dot6 charHeight);
+
+// Renders glyph into bitmap. Takes ownership of glyph. With a stroke width
+// the outline is first grown by it through FT_Stroker, giving the stroke
+// layer to draw below the unstroked glyph. With a blur radius the coverage
+// is blurred (after stroking) into a soft shadow, padded to fit the blur.
+bool RasterizeGlyph(FT_Glyph glyph, const RasterParams &params, GlyphBitmap &bitmap);
+
+// Loads and renders a glyph of a colour font (CBDT, sbix or COLR layers) from
+// face, which must be set to charHeight. Glyphs without colour come out as
+// plain coverage. With a blur radius the glyph's alpha comes out as coverage,
+// blurred like RasterizeGlyph's, for its shadow.
+bool RasterizeColorGlyph(FT_Face face, unsigned int glyph_index, FT_F26Dot6 charHeight, GlyphBitmap &bitmap,
+                         int blurRadius = 0);
+
+//------------------------------------------------------------------------------
+
+#endif // !__GLYPH_RASTER_H__
@@ -0,0 +1,195 @@
+#include "kernel_bench.h"
+#include "pixel_kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Atlas row pitch the glyphs are blitted into.
+static const size_t BenchAtlasPitch = 1024;
+// Glyphs of a bulk prewarm, e.g. a CJK font's common set.
+static const int BenchPrewarmGlyphs = 4096;
+
+struct BenchSize {
+    const char *name;
+    int width;
+    int rows;
+    int count;       // Glyphs per timed iteration
+};
+
+static const BenchSize BenchSizes[] = {
+    { "glyph 10x14",   10, 14, 1 },
+    { "glyph 24x32",   24, 32, 1 },
+    { "glyph 48x64",   48, 64, 1 },
+    { "prewarm 24x32", 24, 32, BenchPrewarmGlyphs },
+};
+
+//------------------------------------------------------------------------------
+
+// Runs fn until at least 50ms passed, returns nanoseconds per call.
+template <typename Fn>
+static double timeIt(Fn fn)
+{
+    typedef std::chrono::steady_clock Clock;
+    long long calls = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    do
+    {
+        for (int i = 0; i < 16; i++)
+            fn();
+        calls += 16;
+        elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    } while (elapsed < 50e6);
+    return elapsed / calls;
+}
+
+static void printResult(const char *kernel, const BenchSize &size, double baseNs, double ns)
+{
+    double bytes = (double)size.width * size.rows * size.count;
+    fprintf(stdout, "%-8s %-14s %10.1f ns %10.1f ns  %5.2fx  %6.2f GB/s\n",
+            kernel, size.name, baseNs, ns, baseNs / ns, bytes / ns);
+}
+
+void RunKernelBenchmarks()
+{
+    fprintf(stdout, "----pixel kernel benchmark (%s)----\n", PixelKernelsISA());
+    fprintf(stdout, "%-8s %-14s %13s %13s %7s %11s\n", "kernel", "size", "baseline", "kernel", "speedup", "throughput");
+
+    std::vector<uint8_t> atlas(BenchAtlasPitch * BenchAtlasPitch);
+    uint8_t lut[256];
+    BuildCoverageLUT(1.4f, 1.2f, lut);
+
+    for (size_t s = 0; s < sizeof(BenchSizes) / sizeof(BenchSizes[0]); s++)
+    {
+        const BenchSize &size = BenchSizes[s];
+        size_t glyphBytes = (size_t)size.width * size.rows;
+        std::vector<uint8_t> glyphs(glyphBytes * size.count);
+        for (size_t i = 0; i < glyphs.size(); i++)
+        {
+            glyphs[i] = (uint8_t)(i * 37 + (i >> 5));
+        }
+        // glyph i goes to a shelf position of the atlas
+        auto target = [&](int i) -> uint8_t* {
+            size_t perRow = BenchAtlasPitch / (size.width + 2);
+            size_t x = (i % perRow) * (size.width + 2);
+            size_t y = (i / perRow % (BenchAtlasPitch / (size.rows + 2))) * (size.rows + 2);
+            return atlas.data() + y * BenchAtlasPitch + x;
+        };
+
+        double base = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+            {
+                uint8_t *dst = target(i);
+                const uint8_t *src = glyphs.data() + i * glyphBytes;
+                for (int y = 0; y < size.rows; y++)
+                    memcpy(dst + y * BenchAtlasPitch, src + y * size.width, size.width);
+            }
+        });
+        double kernel = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+                BlitRows(target(i), BenchAtlasPitch, glyphs.data() + i * glyphBytes, size.width,
+                         size.width, size.rows);
+        });
+        printResult("blit", size, base, kernel);
+
+        base = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+            {
+                uint8_t *dst = target(i);
+                for (int y = 0; y < size.rows; y++)
+                    memset(dst + y * BenchAtlasPitch, 0, size.width);
+            }
+        });
+        kernel = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+                FillRows(target(i), BenchAtlasPitch, 0, size.width, size.rows);
+        });
+        printResult("fill", size, base, kernel);
+
+        base = timeIt([&]{
+            uint8_t *p = glyphs.data();
+            for (size_t i = 0; i < glyphs.size(); i++)
+                p[i] = lut[p[i]];
+        });
+        kernel = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+                ApplyLUT(glyphs.data() + i * glyphBytes, glyphBytes, lut);
+        });
+        printResult("lut", size, base, kernel);
+
+        // the region of four channel-packed pages, uploaded together
+        std::vector<uint8_t> rgba(glyphBytes * 4);
+        const uint8_t *planes[4] = { glyphs.data(), glyphs.data(), glyphs.data(), glyphs.data() };
+        const ptrdiff_t pitches[4] = { size.width, size.width, size.width, size.width };
+        base = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+            {
+                uint8_t *dst = rgba.data();
+                for (size_t p = 0; p < glyphBytes; p++)
+                {
+                    for (int c = 0; c < 4; c++)
+                        dst[p * 4 + c] = planes[c][p];
+                }
+            }
+        });
+        kernel = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+                InterleaveRows(rgba.data(), size.width * 4, planes, pitches, size.width, size.rows);
+        });
+        printResult("pack", size, base, kernel);
+
+        // a shadow blur of radius 4, boxes of radii 1, 1, 2 both ways
+        const int radii[3] = { 1, 1, 2 };
+        std::vector<uint8_t> blurred(glyphBytes);
+        std::vector<uint8_t> temp(glyphBytes);
+        base = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+            {
+                memcpy(blurred.data(), glyphs.data() + i * glyphBytes, glyphBytes);
+                for (int dir = 0; dir < 2; dir++)
+                {
+                    // strides of a step along and across the blurred direction
+                    size_t along = dir == 0 ? 1 : size.width;
+                    size_t across = dir == 0 ? size.width : 1;
+                    int n = dir == 0 ? size.width : size.rows;
+                    int lines = dir == 0 ? size.rows : size.width;
+                    for (int p = 0; p < 3; p++)
+                    {
+                        // a sliding sum along each line
+                        int r = radii[p];
+                        uint32_t scale = 65536 / (2 * r + 1);
+                        for (int l = 0; l < lines; l++)
+                        {
+                            const uint8_t *src = blurred.data() + l * across;
+                            uint8_t *dst = temp.data() + l * across;
+                            uint32_t sum = 0;
+                            for (int x = 0; x < std::min(r, n); x++)
+                                sum += src[x * along];
+                            for (int x = 0; x < n; x++)
+                            {
+                                if (x + r < n)
+                                    sum += src[(x + r) * along];
+                                dst[x * along] = (uint8_t)((sum * scale + 32768) >> 16);
+                                if (x - r >= 0)
+                                    sum -= src[(x - r) * along];
+                            }
+                        }
+                        blurred.swap(temp);
+                    }
+                }
+            }
+        });
+        kernel = timeIt([&]{
+            for (int i = 0; i < size.count; i++)
+            {
+                memcpy(blurred.data(), glyphs.data() + i * glyphBytes, glyphBytes);
+                BoxBlur(blurred.data(), size.width, size.rows, radii, 3);
+            }
+        });
+        printResult("blur", size, base, kernel);
+    }
+    fprintf(stdout, "\n");
+}
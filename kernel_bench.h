@@ -0,0 +1,13 @@
+#ifndef __KERNEL_BENCH_H__
+#define __KERNEL_BENCH_H__
+
+//------------------------------------------------------------------------------
+
+// Times the pixel kernels (see pixel_kernels.h) against plain per-row
+// memcpy / memset / table loops, on single glyphs of typical sizes and on
+// the volume of a bulk prewarm, and prints the results to stdout.
+void RunKernelBenchmarks();
+
+//------------------------------------------------------------------------------
+
+#endif // !__KERNEL_BENCH_H__
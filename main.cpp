@@ -1,4 +1,8 @@
 #include "text_render.h"
+#include "kernel_bench.h"
+#include "churn_bench.h"
+#include "prewarm_bench.h"
+#include "zoom_bench.h"
 #include "scope_guard.h"
 
 #include <glad/glad.h>
@@ -13,10 +17,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <string>
 #include <functional>
+#include <thread>
+#include <vector>
+#include <algorithm>
 
-static void error_callback(int error, const char* description)
+static void error_callback(int, const char* description)
 {
     fprintf(stderr, "Error: %s\n", description);
 }
@@ -36,6 +45,7 @@ static const char* freetype_version_string(FT_Library library, char* buf, size_t
 }
 
 std::function<void(GLFWwindow*)> draw;
+std::function<void(GLFWwindow*, float)> rescale;
 
 static void window_refresh_callback(GLFWwindow* window)
 {
@@ -43,10 +53,72 @@ static void window_refresh_callback(GLFWwindow* window)
     glfwSwapBuffers(window);
 }
 
+static void window_content_scale_callback(GLFWwindow* window, float, float yscale)
+{
+    rescale(window, yscale);
+}
+
 int main(int argc, char* agrv[])
 {
     char version[100] = { 0 };
 
+    // --sdf / --msdf: store glyphs as (multi-channel) signed distance fields
+    // --zoom: animate the size of the first font, redrawing continuously
+    // --packed-atlas: pack four coverage atlas pages into each RGBA layer
+    // --compressed-shadow / --no-shadow: keep the CPU copy of the atlases RLE
+    //   compressed, or drop it
+    // --shelf-atlas: pack the atlases in shelves of height classes, evicting
+    //   glyphs one by one rather than whole pages
+    // --atlas-snapshot <file>: start with the atlases saved in file, if the
+    //   fonts are the same, and save them there on exit
+    // --bench-kernels: time the pixel kernels and exit
+    // --bench-churn: compare atlas eviction policies and exit
+    // --bench-prewarm: time prewarming a CJK font with 0 to 8 raster threads
+    //   and exit
+    // --bench-zoom: compare bitmap and distance field atlases while zooming
+    //   and exit
+    GlyphFormat format = GlyphFormat::Bitmap;
+    bool zoom = false;
+    bool packed_atlas = false;
+    AtlasShadow shadow = AtlasShadow::Full;
+    AtlasPacker packer = AtlasPacker::Skyline;
+    bool bench_prewarm = false;
+    bool bench_zoom = false;
+    const char *snapshot_path = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(agrv[i], "--sdf") == 0)
+            format = GlyphFormat::SDF;
+        else if (strcmp(agrv[i], "--msdf") == 0)
+            format = GlyphFormat::MSDF;
+        else if (strcmp(agrv[i], "--zoom") == 0)
+            zoom = true;
+        else if (strcmp(agrv[i], "--packed-atlas") == 0)
+            packed_atlas = true;
+        else if (strcmp(agrv[i], "--compressed-shadow") == 0)
+            shadow = AtlasShadow::Compressed;
+        else if (strcmp(agrv[i], "--no-shadow") == 0)
+            shadow = AtlasShadow::None;
+        else if (strcmp(agrv[i], "--shelf-atlas") == 0)
+            packer = AtlasPacker::Shelf;
+        else if (strcmp(agrv[i], "--atlas-snapshot") == 0 && i + 1 < argc)
+            snapshot_path = agrv[++i];
+        else if (strcmp(agrv[i], "--bench-kernels") == 0)
+        {
+            RunKernelBenchmarks();
+            return 0;
+        }
+        else if (strcmp(agrv[i], "--bench-churn") == 0)
+        {
+            RunChurnBenchmark();
+            return 0;
+        }
+        else if (strcmp(agrv[i], "--bench-prewarm") == 0)
+            bench_prewarm = true;
+        else if (strcmp(agrv[i], "--bench-zoom") == 0)
+            bench_zoom = true;
+    }
+
     fprintf(stdout, "GLFW Version: %s\n", glfwGetVersionString());
 
     // Initialize GLFW
@@ -101,9 +173,26 @@ int main(int argc, char* agrv[])
 
     fprintf(stdout, "HarfBuzz Version: %s\n", hb_version_string());
 
+    // benchmarks drawing through TextRender need the GL context
+    if (bench_prewarm)
+    {
+        RunPrewarmBenchmark(ft, "../fonts/NotoSerifSC-Regular.otf");
+        return 0;
+    }
+    if (bench_zoom)
+    {
+        int fb_width, fb_height;
+        glfwGetFramebufferSize(window, &fb_width, &fb_height);
+        RunZoomBenchmark(ft, "../fonts/NotoSans-Regular.ttf", fb_width, fb_height);
+        return 0;
+    }
+
     // Create TextRender
     TextRender render;
-    if (!render.Init(4, 256))
+    int raster_threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    render.SetAtlasShadow(shadow);
+    render.SetAtlasPacker(packer);
+    if (!render.Init(4, 256, 4 * 1024 * 1024, raster_threads, packed_atlas))
     {
         fprintf(stderr, "TextRender Init failed\n");
         return 1;
@@ -129,17 +218,53 @@ int main(int argc, char* agrv[])
         return 1;
     }
 
+    font0.SetGlyphFormat(format);
+    font1.SetGlyphFormat(format);
+    font2.SetGlyphFormat(format);
+
+    // Build glyph metrics tables in the background
+    font0.BuildMetrics(true);
+    font1.BuildMetrics(true);
+    font2.BuildMetrics(true);
+
     // Create TextRuns
     TextRun text0(font0, u8"This is a test.", HB_DIRECTION_LTR, HB_SCRIPT_LATIN, hb_language_from_string("en", -1), true);
     TextRun text1(font1, u8"天地玄黄，宇宙洪荒。", HB_DIRECTION_TTB, HB_SCRIPT_HAN, hb_language_from_string("zh", -1), false);
     TextRun text2(font2, u8"أسئلة و أجوبة", HB_DIRECTION_RTL, HB_SCRIPT_ARABIC, hb_language_from_string("ar", -1), false);
 
+    // Moving the window to a monitor with another DPI only resizes the fonts,
+    // glyphs are re-rasterized lazily and drawn scaled until then.
+    rescale = [&](GLFWwindow*, float scale)
+    {
+        content_scale = scale;
+        font0.SetContentScale(scale);
+        font1.SetContentScale(scale);
+        font2.SetContentScale(scale);
+    };
+    glfwSetWindowContentScaleCallback(window, window_content_scale_callback);
+    // glyphs finished by the raster threads need another frame
+    render.SetWakeCallback([]{ glfwPostEmptyEvent(); });
+    render.SetZooming(zoom);
+
+    // atlases of the last run, while the fonts are the same
+    std::vector<Font*> fonts = { &font0, &font1, &font2 };
+    if (snapshot_path && render.LoadAtlasSnapshot(snapshot_path, fonts))
+    {
+        fprintf(stdout, "atlas snapshot loaded\n");
+    }
+
     unsigned int drawCount = 0;
     double drawTime = 0.0;
+    double firstCompleteTime = 0.0;
     draw = [&](GLFWwindow* window)
     {
         double startTime = glfwGetTime();
 
+        if (zoom)
+        {
+            font0.SetSize(56.0f + 40.0f * sinf(drawCount * 0.02f));
+        }
+
         int width, height;
         glfwGetFramebufferSize(window, &width, &height);
         glViewport(0, 0, width, height);
@@ -149,6 +274,12 @@ int main(int argc, char* agrv[])
         auto DP_X = [](float x) -> float { return x; };
         auto DP_Y = [&height](float y) -> float { return height - y; };
 
+        TextEffects effects2 = TextEffects();
+        effects2.StrokeWidth = 1.5f*content_scale;
+        effects2.ShadowColor = glm::vec4(0.f, 0.f, 0.f, 0.5f);
+        effects2.ShadowOffset = glm::vec2(3.0f*content_scale, -3.0f*content_scale);
+        effects2.ShadowBlur = 4.0f*content_scale;
+
         render.Begin(width, height);
         render.DrawText(
             text0, 
@@ -163,13 +294,18 @@ int main(int argc, char* agrv[])
         render.DrawText(
             text2, 
             DP_X(450.0f*content_scale), DP_Y(575.0f*content_scale), 
-            glm::vec3(0.f, 1.f, 0.f)
+            glm::vec3(0.f, 1.f, 0.f),
+            effects2
         );
         render.End();
 
         double duration = glfwGetTime() - startTime;
         drawTime += duration;
         drawCount++;
+        if (firstCompleteTime == 0.0 && !render.HasPendingWork())
+        {
+            firstCompleteTime = glfwGetTime();
+        }
     };
 
     // Event loop
@@ -178,13 +314,23 @@ int main(int argc, char* agrv[])
         draw(window);
         glfwSwapBuffers(window);
 
-        glfwWaitEvents();
+        // keep drawing while resized glyphs are being re-rasterized
+        if (zoom || render.HasPendingWork())
+            glfwPollEvents();
+        else
+            glfwWaitEvents();
     }
 
+    render.WaitIdle();
+    if (snapshot_path && !zoom)
+    {
+        render.SaveAtlasSnapshot(snapshot_path, fonts);
+    }
     render.PrintStats();
     fprintf(stdout, "----draw time stats----\n");
     fprintf(stdout, "draw count   : %u\n", drawCount);
     fprintf(stdout, "avg draw time: %f ms\n", drawTime / drawCount * 1000.0);
+    fprintf(stdout, "first complete frame: %f ms after start\n", firstCompleteTime * 1000.0);
     fprintf(stdout, "\n");
 
     return 0;
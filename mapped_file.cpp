@@ -0,0 +1,121 @@
+#include "mapped_file.h"
+#include "scope_guard.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+: file_(nullptr), mapping_(nullptr), data_(nullptr), size_(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#if defined(_WIN32)
+
+bool MappedFile::Open(const char* path)
+{
+    Close();
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    auto file_guard = scopeGuard([&file]{ CloseHandle(file); });
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        return false;
+    }
+    auto mapping_guard = scopeGuard([&mapping]{ CloseHandle(mapping); });
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL)
+    {
+        return false;
+    }
+
+    file_guard.dismiss();
+    mapping_guard.dismiss();
+    file_ = file;
+    mapping_ = mapping;
+    data_ = (const uint8_t*)data;
+    size_ = (size_t)size.QuadPart;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data_)
+    {
+        UnmapViewOfFile(data_);
+        CloseHandle((HANDLE)mapping_);
+        CloseHandle((HANDLE)file_);
+    }
+    file_ = nullptr;
+    mapping_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+#else
+
+bool MappedFile::Open(const char* path)
+{
+    Close();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // the mapping stays valid after the descriptor is closed
+    auto fd_guard = scopeGuard([&fd]{ close(fd); });
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    data_ = (const uint8_t*)data;
+    size_ = (size_t)st.st_size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data_)
+    {
+        munmap((void*)data_, size_);
+    }
+    file_ = nullptr;
+    mapping_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <cstdint>
+#include <cstddef>
+
+//------------------------------------------------------------------------------
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+    void* file_;
+    void* mapping_;
+    const uint8_t* data_;
+    size_t size_;
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool Open(const char* path);
+    void Close();
+
+    bool IsOpen() const { return data_ != nullptr; }
+    const uint8_t* Data() const { return data_; }
+    size_t Size() const { return size_; }
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+//------------------------------------------------------------------------------
+
+#endif // !__MAPPED_FILE_H__
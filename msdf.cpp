@@ -0,0 +1,639 @@
+#include "msdf.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+const double Pi = 3.14159265358979323846;
+
+// Two edges meet at a corner if their directions differ by more than ~8 deg,
+// msdfgen's default of sin(3 rad) = sin(pi - 3 rad) on the cross product.
+const double CornerCrossThreshold = 0.14112000805986721;  // sin(3.0)
+
+// Neighbouring texels whose channels differ by more than this (in pixels)
+// in a way no outline can produce are flattened to their median.
+const double ClashThreshold = 1.001;
+
+enum EdgeColor {
+    Black   = 0,
+    Red     = 1,
+    Green   = 2,
+    Yellow  = 3,
+    Blue    = 4,
+    Magenta = 5,
+    Cyan    = 6,
+    White   = 7,
+};
+
+struct Vec2 {
+    double x, y;
+
+    Vec2() : x(0), y(0) {}
+    Vec2(double x_, double y_) : x(x_), y(y_) {}
+
+    Vec2 operator+(const Vec2 &o) const { return Vec2(x + o.x, y + o.y); }
+    Vec2 operator-(const Vec2 &o) const { return Vec2(x - o.x, y - o.y); }
+    Vec2 operator*(double s) const { return Vec2(x * s, y * s); }
+    bool operator==(const Vec2 &o) const { return x == o.x && y == o.y; }
+
+    double length() const { return std::sqrt(x * x + y * y); }
+    Vec2 normalize() const
+    {
+        double len = length();
+        return (len == 0) ? Vec2(0, 1) : Vec2(x / len, y / len);
+    }
+};
+
+double dot(const Vec2 &a, const Vec2 &b) { return a.x * b.x + a.y * b.y; }
+double cross(const Vec2 &a, const Vec2 &b) { return a.x * b.y - a.y * b.x; }
+Vec2 mix(const Vec2 &a, const Vec2 &b, double t) { return a + (b - a) * t; }
+double nonZeroSign(double v) { return (v > 0) ? 1.0 : -1.0; }
+
+// Distance to an edge; ties are broken by how orthogonally the edge is hit.
+struct SignedDistance {
+    double distance;
+    double dot;
+
+    SignedDistance() : distance(-std::numeric_limits<double>::max()), dot(1) {}
+    SignedDistance(double d, double o) : distance(d), dot(o) {}
+
+    bool operator<(const SignedDistance &o) const
+    {
+        return std::fabs(distance) < std::fabs(o.distance) ||
+               (std::fabs(distance) == std::fabs(o.distance) && dot < o.dot);
+    }
+};
+
+int solveQuadratic(double x[2], double a, double b, double c)
+{
+    if (a == 0 || std::fabs(b) > 1e12 * std::fabs(a))
+    {
+        if (b == 0)
+            return 0;
+        x[0] = -c / b;
+        return 1;
+    }
+    double dscr = b * b - 4 * a * c;
+    if (dscr > 0)
+    {
+        dscr = std::sqrt(dscr);
+        x[0] = (-b + dscr) / (2 * a);
+        x[1] = (-b - dscr) / (2 * a);
+        return 2;
+    }
+    if (dscr == 0)
+    {
+        x[0] = -b / (2 * a);
+        return 1;
+    }
+    return 0;
+}
+
+// x^3 + a x^2 + b x + c = 0
+int solveCubicNormed(double x[3], double a, double b, double c)
+{
+    double a2 = a * a;
+    double q = (a2 - 3 * b) / 9;
+    double r = (a * (2 * a2 - 9 * b) + 27 * c) / 54;
+    double r2 = r * r;
+    double q3 = q * q * q;
+    a /= 3;
+    if (r2 < q3)
+    {
+        double t = std::acos(std::max(-1.0, std::min(1.0, r / std::sqrt(q3))));
+        q = -2 * std::sqrt(q);
+        x[0] = q * std::cos(t / 3) - a;
+        x[1] = q * std::cos((t + 2 * Pi) / 3) - a;
+        x[2] = q * std::cos((t - 2 * Pi) / 3) - a;
+        return 3;
+    }
+    double u = (r < 0 ? 1 : -1) * std::pow(std::fabs(r) + std::sqrt(r2 - q3), 1 / 3.0);
+    double v = (u == 0) ? 0 : q / u;
+    x[0] = (u + v) - a;
+    if (u == v || std::fabs(u - v) < 1e-12 * std::fabs(u + v))
+    {
+        x[1] = -0.5 * (u + v) - a;
+        return 2;
+    }
+    return 1;
+}
+
+int solveCubic(double x[3], double a, double b, double c, double d)
+{
+    if (a != 0)
+    {
+        double bn = b / a;
+        if (std::fabs(bn) < 1e6)
+            return solveCubicNormed(x, bn, c / a, d / a);
+    }
+    return solveQuadratic(x, b, c, d);
+}
+
+// A linear, quadratic or cubic Bezier segment of a contour.
+struct Edge {
+    int degree;
+    Vec2 p[4];
+    int color;
+
+    Vec2 point(double t) const
+    {
+        Vec2 q[4];
+        for (int i = 0; i <= degree; i++)
+            q[i] = p[i];
+        for (int k = degree; k > 0; k--)
+            for (int i = 0; i < k; i++)
+                q[i] = mix(q[i], q[i + 1], t);
+        return q[0];
+    }
+
+    Vec2 direction(double t) const
+    {
+        if (degree == 1)
+            return p[1] - p[0];
+        if (degree == 2)
+        {
+            Vec2 d = mix(p[1] - p[0], p[2] - p[1], t);
+            return (d.x == 0 && d.y == 0) ? p[2] - p[0] : d;
+        }
+        Vec2 d = mix(mix(p[1] - p[0], p[2] - p[1], t), mix(p[2] - p[1], p[3] - p[2], t), t);
+        if (d.x == 0 && d.y == 0)
+        {
+            if (t == 0)
+                return p[2] - p[0];
+            if (t == 1)
+                return p[3] - p[1];
+        }
+        return d;
+    }
+
+    // de Casteljau subdivision at t
+    void split(double t, Edge &a, Edge &b) const
+    {
+        Vec2 q[4][4];
+        for (int i = 0; i <= degree; i++)
+            q[0][i] = p[i];
+        for (int k = 1; k <= degree; k++)
+            for (int i = 0; i <= degree - k; i++)
+                q[k][i] = mix(q[k - 1][i], q[k - 1][i + 1], t);
+        a.degree = b.degree = degree;
+        a.color = b.color = color;
+        for (int i = 0; i <= degree; i++)
+        {
+            a.p[i] = q[i][0];
+            b.p[i] = q[degree - i][i];
+        }
+    }
+
+    void splitInThirds(Edge parts[3]) const
+    {
+        Edge rest;
+        split(1 / 3.0, parts[0], rest);
+        rest.split(0.5, parts[1], parts[2]);
+    }
+
+    // Signed distance from origin to the edge, param receives the position of
+    // the closest point along the edge (outside [0, 1] past its ends).
+    SignedDistance distance(const Vec2 &origin, double &param) const
+    {
+        if (degree == 1)
+        {
+            Vec2 aq = origin - p[0];
+            Vec2 ab = p[1] - p[0];
+            param = dot(aq, ab) / dot(ab, ab);
+            Vec2 eq = ((param > 0.5) ? p[1] : p[0]) - origin;
+            double endpointDistance = eq.length();
+            if (param > 0 && param < 1)
+            {
+                double orthoDistance = cross(aq, ab) / ab.length();
+                if (std::fabs(orthoDistance) < endpointDistance)
+                    return SignedDistance(orthoDistance, 0);
+            }
+            return SignedDistance(nonZeroSign(cross(aq, ab)) * endpointDistance,
+                                  std::fabs(dot(ab.normalize(), eq.normalize())));
+        }
+
+        Vec2 end = p[degree];
+        Vec2 qa = p[0] - origin;
+        Vec2 epDir = direction(0);
+        double minDistance = nonZeroSign(cross(epDir, qa)) * qa.length();
+        param = -dot(qa, epDir) / dot(epDir, epDir);
+        {
+            epDir = direction(1);
+            double distance = (end - origin).length();
+            if (distance < std::fabs(minDistance))
+            {
+                minDistance = nonZeroSign(cross(epDir, end - origin)) * distance;
+                param = dot(origin - end, epDir) / dot(epDir, epDir) + 1;
+            }
+        }
+
+        Vec2 ab = p[1] - p[0];
+        Vec2 br = p[2] - p[1] - ab;
+        if (degree == 2)
+        {
+            double t[3];
+            int solutions = solveCubic(t, dot(br, br), 3 * dot(ab, br), 2 * dot(ab, ab) + dot(qa, br), dot(qa, ab));
+            for (int i = 0; i < solutions; i++)
+            {
+                if (t[i] > 0 && t[i] < 1)
+                {
+                    Vec2 qe = qa + ab * (2 * t[i]) + br * (t[i] * t[i]);
+                    double distance = qe.length();
+                    if (distance <= std::fabs(minDistance))
+                    {
+                        minDistance = nonZeroSign(cross(ab + br * t[i], qe)) * distance;
+                        param = t[i];
+                    }
+                }
+            }
+        }
+        else
+        {
+            // no closed form for cubics, refine a few starting points instead
+            Vec2 as = (p[3] - p[2]) - (p[2] - p[1]) - br;
+            const int SearchStarts = 4;
+            const int SearchSteps = 4;
+            for (int i = 0; i <= SearchStarts; i++)
+            {
+                double t = (double)i / SearchStarts;
+                Vec2 qe = qa + ab * (3 * t) + br * (3 * t * t) + as * (t * t * t);
+                for (int step = 0; step < SearchSteps; step++)
+                {
+                    Vec2 d1 = ab * 3 + br * (6 * t) + as * (3 * t * t);
+                    Vec2 d2 = br * 6 + as * (6 * t);
+                    t -= dot(qe, d1) / (dot(d1, d1) + dot(qe, d2));
+                    if (t <= 0 || t >= 1)
+                        break;
+                    qe = qa + ab * (3 * t) + br * (3 * t * t) + as * (t * t * t);
+                    double distance = qe.length();
+                    if (distance < std::fabs(minDistance))
+                    {
+                        minDistance = nonZeroSign(cross(direction(t), qe)) * distance;
+                        param = t;
+                    }
+                }
+            }
+        }
+
+        if (param >= 0 && param <= 1)
+            return SignedDistance(minDistance, 0);
+        if (param < 0.5)
+            return SignedDistance(minDistance, std::fabs(dot(direction(0).normalize(), qa.normalize())));
+        return SignedDistance(minDistance, std::fabs(dot(direction(1).normalize(), (end - origin).normalize())));
+    }
+
+    // Past the ends of the edge, measures the distance to its extension
+    // along the end tangent, which keeps corners sharp.
+    void toPseudoDistance(SignedDistance &distance, const Vec2 &origin, double param) const
+    {
+        if (param < 0)
+        {
+            Vec2 dir = direction(0).normalize();
+            Vec2 aq = origin - p[0];
+            if (dot(aq, dir) < 0)
+            {
+                double pseudo = cross(aq, dir);
+                if (std::fabs(pseudo) <= std::fabs(distance.distance))
+                    distance = SignedDistance(pseudo, 0);
+            }
+        }
+        else if (param > 1)
+        {
+            Vec2 dir = direction(1).normalize();
+            Vec2 bq = origin - p[degree];
+            if (dot(bq, dir) > 0)
+            {
+                double pseudo = cross(bq, dir);
+                if (std::fabs(pseudo) <= std::fabs(distance.distance))
+                    distance = SignedDistance(pseudo, 0);
+            }
+        }
+    }
+};
+
+typedef std::vector<Edge> Contour;
+
+//------------------------------------------------------------------------------
+
+struct Decomposer {
+    std::vector<Contour> contours;
+    Vec2 last;
+
+    static Vec2 toVec2(const FT_Vector *v) { return Vec2(v->x / 64.0, v->y / 64.0); }
+
+    static int moveTo(const FT_Vector *to, void *user)
+    {
+        Decomposer *self = (Decomposer*)user;
+        self->contours.push_back(Contour());
+        self->last = toVec2(to);
+        return 0;
+    }
+
+    static int lineTo(const FT_Vector *to, void *user)
+    {
+        Decomposer *self = (Decomposer*)user;
+        Vec2 p = toVec2(to);
+        if (!(p == self->last))
+        {
+            Edge e = { 1, { self->last, p }, White };
+            self->contours.back().push_back(e);
+        }
+        self->last = p;
+        return 0;
+    }
+
+    static int conicTo(const FT_Vector *control, const FT_Vector *to, void *user)
+    {
+        Decomposer *self = (Decomposer*)user;
+        Edge e = { 2, { self->last, toVec2(control), toVec2(to) }, White };
+        self->contours.back().push_back(e);
+        self->last = e.p[2];
+        return 0;
+    }
+
+    static int cubicTo(const FT_Vector *control1, const FT_Vector *control2, const FT_Vector *to, void *user)
+    {
+        Decomposer *self = (Decomposer*)user;
+        Edge e = { 3, { self->last, toVec2(control1), toVec2(control2), toVec2(to) }, White };
+        self->contours.back().push_back(e);
+        self->last = e.p[3];
+        return 0;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+bool isCorner(const Vec2 &a, const Vec2 &b)
+{
+    return dot(a, b) <= 0 || std::fabs(cross(a, b)) > CornerCrossThreshold;
+}
+
+void switchColor(int &color, unsigned long long &seed, int banned = Black)
+{
+    int combined = color & banned;
+    if (combined == Red || combined == Green || combined == Blue)
+    {
+        color = combined ^ White;
+        return;
+    }
+    if (color == Black || color == White)
+    {
+        static const int start[3] = { Cyan, Magenta, Yellow };
+        color = start[seed % 3];
+        seed /= 3;
+        return;
+    }
+    int shifted = color << (1 + (seed & 1));
+    color = (shifted | shifted >> 3) & White;
+    seed >>= 1;
+}
+
+int symmetricalTrichotomy(int position, int n)
+{
+    return int(3 + 2.875 * position / (n - 1) - 1.4375 + 0.5) - 3;
+}
+
+// Colours the edges so that every corner is shared by two edges with only
+// one channel in common.
+void colorContour(Contour &edges, unsigned long long &seed)
+{
+    int m = (int)edges.size();
+    if (m == 0)
+        return;
+
+    std::vector<int> corners;
+    Vec2 prevDirection = edges.back().direction(1);
+    for (int i = 0; i < m; i++)
+    {
+        if (isCorner(prevDirection.normalize(), edges[i].direction(0).normalize()))
+            corners.push_back(i);
+        prevDirection = edges[i].direction(1);
+    }
+
+    if (corners.empty())
+    {
+        // smooth contour
+        for (int i = 0; i < m; i++)
+            edges[i].color = White;
+    }
+    else if (corners.size() == 1)
+    {
+        // teardrop, spread three colours around the contour
+        int colors[3] = { White, White, White };
+        switchColor(colors[0], seed);
+        colors[2] = colors[0];
+        switchColor(colors[2], seed);
+
+        int corner = corners[0];
+        if (m >= 3)
+        {
+            for (int i = 0; i < m; i++)
+                edges[(corner + i) % m].color = colors[1 + symmetricalTrichotomy(i, m)];
+        }
+        else
+        {
+            // too few edges to colour, split them up
+            Contour parts(3 * m);
+            edges[corner].splitInThirds(&parts[0]);
+            if (m == 2)
+            {
+                edges[1 - corner].splitInThirds(&parts[3]);
+                parts[0].color = parts[1].color = colors[0];
+                parts[2].color = parts[3].color = colors[1];
+                parts[4].color = parts[5].color = colors[2];
+            }
+            else
+            {
+                parts[0].color = colors[0];
+                parts[1].color = colors[1];
+                parts[2].color = colors[2];
+            }
+            edges.swap(parts);
+        }
+    }
+    else
+    {
+        int cornerCount = (int)corners.size();
+        int spline = 0;
+        int start = corners[0];
+        int color = White;
+        switchColor(color, seed);
+        int initialColor = color;
+        for (int i = 0; i < m; i++)
+        {
+            int index = (start + i) % m;
+            if (spline + 1 < cornerCount && corners[spline + 1] == index)
+            {
+                spline++;
+                switchColor(color, seed, (spline == cornerCount - 1) ? initialColor : Black);
+            }
+            edges[index].color = color;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+float median(float a, float b, float c)
+{
+    return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+// True if interpolating between texels a and b would produce an artifact.
+bool detectClash(const float *a, const float *b, float threshold)
+{
+    float a0 = a[0], a1 = a[1], a2 = a[2];
+    float b0 = b[0], b1 = b[1], b2 = b[2];
+    // sort channel pairs by decreasing difference
+    if (std::fabs(b0 - a0) < std::fabs(b1 - a1))
+    {
+        std::swap(a0, a1);
+        std::swap(b0, b1);
+    }
+    if (std::fabs(b1 - a1) < std::fabs(b2 - a2))
+    {
+        std::swap(a1, a2);
+        std::swap(b1, b2);
+        if (std::fabs(b0 - a0) < std::fabs(b1 - a1))
+        {
+            std::swap(a0, a1);
+            std::swap(b0, b1);
+        }
+    }
+    return std::fabs(b1 - a1) >= threshold &&
+           !(b0 == b1 && b0 == b2) &&
+           std::fabs(a2 - 0.5f) >= std::fabs(b2 - 0.5f);
+}
+
+void correctClashes(std::vector<float> &field, int width, int rows, float threshold)
+{
+    std::vector<int> clashes;
+    for (int y = 0; y < rows; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const float *px = &field[(y * width + x) * 3];
+            if ((x > 0 && detectClash(px, px - 3, threshold)) ||
+                (x < width - 1 && detectClash(px, px + 3, threshold)) ||
+                (y > 0 && detectClash(px, px - width * 3, threshold)) ||
+                (y < rows - 1 && detectClash(px, px + width * 3, threshold)))
+            {
+                clashes.push_back(y * width + x);
+            }
+        }
+    }
+    for (size_t i = 0; i < clashes.size(); i++)
+    {
+        float *px = &field[clashes[i] * 3];
+        float med = median(px[0], px[1], px[2]);
+        px[0] = px[1] = px[2] = med;
+    }
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+
+bool RenderMSDF(const FT_Outline *outline, int spread, GlyphBitmap &bitmap)
+{
+    bitmap.Channels = 3;
+    if (outline->n_points == 0)
+    {
+        bitmap.Width = bitmap.Rows = bitmap.Left = bitmap.Top = 0;
+        bitmap.Pixels.clear();
+        return true;
+    }
+
+    FT_Outline_Funcs funcs;
+    funcs.move_to = Decomposer::moveTo;
+    funcs.line_to = Decomposer::lineTo;
+    funcs.conic_to = Decomposer::conicTo;
+    funcs.cubic_to = Decomposer::cubicTo;
+    funcs.shift = 0;
+    funcs.delta = 0;
+    Decomposer decomposer;
+    if (FT_Outline_Decompose(const_cast<FT_Outline*>(outline), &funcs, &decomposer))
+    {
+        return false;
+    }
+
+    unsigned long long seed = 0;
+    std::vector<Edge> edges;
+    for (size_t i = 0; i < decomposer.contours.size(); i++)
+    {
+        colorContour(decomposer.contours[i], seed);
+        edges.insert(edges.end(), decomposer.contours[i].begin(), decomposer.contours[i].end());
+    }
+
+    // distances are positive on the right of the edges, flip them for
+    // outlines filled on the left
+    double orientation =
+        (FT_Outline_Get_Orientation(const_cast<FT_Outline*>(outline)) == FT_ORIENTATION_FILL_LEFT) ? -1.0 : 1.0;
+
+    FT_BBox cbox;
+    FT_Outline_Get_CBox(outline, &cbox);
+    int x0 = (int)(cbox.xMin >> 6) - spread;
+    int y0 = (int)(cbox.yMin >> 6) - spread;
+    int x1 = (int)((cbox.xMax + 63) >> 6) + spread;
+    int y1 = (int)((cbox.yMax + 63) >> 6) + spread;
+    int width = x1 - x0;
+    int rows = y1 - y0;
+
+    std::vector<float> field(width * rows * 3);
+    for (int y = 0; y < rows; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            // rows go top down, the outline y axis up
+            Vec2 origin(x0 + x + 0.5, y1 - y - 0.5);
+
+            SignedDistance minDistance[3];
+            const Edge *nearEdge[3] = { NULL, NULL, NULL };
+            double nearParam[3] = { 0, 0, 0 };
+            for (size_t i = 0; i < edges.size(); i++)
+            {
+                double param;
+                SignedDistance distance = edges[i].distance(origin, param);
+                for (int c = 0; c < 3; c++)
+                {
+                    if ((edges[i].color & (1 << c)) && distance < minDistance[c])
+                    {
+                        minDistance[c] = distance;
+                        nearEdge[c] = &edges[i];
+                        nearParam[c] = param;
+                    }
+                }
+            }
+
+            float *px = &field[(y * width + x) * 3];
+            for (int c = 0; c < 3; c++)
+            {
+                double d = -spread;
+                if (nearEdge[c])
+                {
+                    nearEdge[c]->toPseudoDistance(minDistance[c], origin, nearParam[c]);
+                    d = orientation * minDistance[c].distance;
+                }
+                px[c] = (float)(0.5 + d / (2.0 * spread));
+            }
+        }
+    }
+
+    correctClashes(field, width, rows, (float)(ClashThreshold / (2.0 * spread)));
+
+    bitmap.Width = width;
+    bitmap.Rows = rows;
+    bitmap.Left = x0;
+    bitmap.Top = y1;
+    bitmap.Pixels.resize(field.size());
+    for (size_t i = 0; i < field.size(); i++)
+    {
+        bitmap.Pixels[i] = (uint8_t)(std::max(0.0f, std::min(1.0f, field[i])) * 255.0f + 0.5f);
+    }
+    return true;
+}
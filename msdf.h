@@ -0,0 +1,20 @@
+#ifndef __MSDF_H__
+#define __MSDF_H__
+
+#include "glyph_raster.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+
+//------------------------------------------------------------------------------
+
+// Renders outline (in 26.6 pixels) as a multi-channel signed distance field,
+// RGB with distances up to spread pixels on both sides of the outline. The
+// edges of the outline are coloured so that the median of the three channels
+// keeps corners sharp at any magnification (Chlumsky's msdfgen technique).
+bool RenderMSDF(const FT_Outline *outline, int spread, GlyphBitmap &bitmap);
+
+//------------------------------------------------------------------------------
+
+#endif // !__MSDF_H__
@@ -0,0 +1,564 @@
+#include "pixel_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__)
+#define PIXEL_KERNELS_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PIXEL_KERNELS_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define PIXEL_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+//------------------------------------------------------------------------------
+
+// Copies n < 16 bytes with at most two overlapping moves. Glyph rows are
+// short, a memcpy call per row costs more than the copy.
+static inline void copySmall(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    if (n >= 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, src, 8);
+        memcpy(&b, src + n - 8, 8);
+        memcpy(dst, &a, 8);
+        memcpy(dst + n - 8, &b, 8);
+    }
+    else if (n >= 4)
+    {
+        uint32_t a, b;
+        memcpy(&a, src, 4);
+        memcpy(&b, src + n - 4, 4);
+        memcpy(dst, &a, 4);
+        memcpy(dst + n - 4, &b, 4);
+    }
+    else
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = src[i];
+    }
+}
+
+static inline void fillSmall(uint8_t *dst, uint8_t value, size_t n)
+{
+    if (n >= 8)
+    {
+        uint64_t v = 0x0101010101010101ULL * value;
+        memcpy(dst, &v, 8);
+        memcpy(dst + n - 8, &v, 8);
+    }
+    else
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = value;
+    }
+}
+
+// Interleaves the bytes from..n of the four planes.
+static inline void interleaveSmall(uint8_t *dst, const uint8_t *const src[4], size_t from, size_t n)
+{
+    for (size_t i = from; i < n; i++)
+    {
+        dst[i * 4] = src[0][i];
+        dst[i * 4 + 1] = src[1][i];
+        dst[i * 4 + 2] = src[2][i];
+        dst[i * 4 + 3] = src[3][i];
+    }
+}
+
+#if defined(PIXEL_KERNELS_AVX2) || defined(PIXEL_KERNELS_SSE2)
+
+// Rows of 16 bytes or more are copied in vectors, the last one overlapping
+// the previous one rather than finishing byte by byte.
+static inline void copyRow(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    if (n < 16)
+    {
+        copySmall(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+#if defined(PIXEL_KERNELS_AVX2)
+    if (n >= 32)
+    {
+        for (; i + 32 <= n; i += 32)
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+        if (i < n)
+            _mm256_storeu_si256((__m256i*)(dst + n - 32), _mm256_loadu_si256((const __m256i*)(src + n - 32)));
+        return;
+    }
+#endif
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+    if (i < n)
+        _mm_storeu_si128((__m128i*)(dst + n - 16), _mm_loadu_si128((const __m128i*)(src + n - 16)));
+}
+
+static inline void fillRow(uint8_t *dst, uint8_t value, size_t n)
+{
+    if (n < 16)
+    {
+        fillSmall(dst, value, n);
+        return;
+    }
+    __m128i v = _mm_set1_epi8((char)value);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    if (i < n)
+        _mm_storeu_si128((__m128i*)(dst + n - 16), v);
+}
+
+// 16 pixels from i on, R and G and B and A bytes are paired first, then the
+// pairs.
+static inline void interleave16(uint8_t *dst, const uint8_t *const src[4], size_t i)
+{
+    __m128i r = _mm_loadu_si128((const __m128i*)(src[0] + i));
+    __m128i g = _mm_loadu_si128((const __m128i*)(src[1] + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src[2] + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(src[3] + i));
+    __m128i rgLo = _mm_unpacklo_epi8(r, g);
+    __m128i rgHi = _mm_unpackhi_epi8(r, g);
+    __m128i baLo = _mm_unpacklo_epi8(b, a);
+    __m128i baHi = _mm_unpackhi_epi8(b, a);
+    _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_unpacklo_epi16(rgLo, baLo));
+    _mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_unpackhi_epi16(rgLo, baLo));
+    _mm_storeu_si128((__m128i*)(dst + i * 4 + 32), _mm_unpacklo_epi16(rgHi, baHi));
+    _mm_storeu_si128((__m128i*)(dst + i * 4 + 48), _mm_unpackhi_epi16(rgHi, baHi));
+}
+
+// Rows of 16 pixels or more end with a block overlapping the previous one.
+static inline void interleaveRow(uint8_t *dst, const uint8_t *const src[4], size_t n)
+{
+    if (n < 16)
+    {
+        interleaveSmall(dst, src, 0, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        interleave16(dst, src, i);
+    if (i < n)
+        interleave16(dst, src, n - 16);
+}
+
+#elif defined(PIXEL_KERNELS_NEON)
+
+static inline void copyRow(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    if (n < 16)
+    {
+        copySmall(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        vst1q_u8(dst + i, vld1q_u8(src + i));
+    if (i < n)
+        vst1q_u8(dst + n - 16, vld1q_u8(src + n - 16));
+}
+
+static inline void fillRow(uint8_t *dst, uint8_t value, size_t n)
+{
+    if (n < 16)
+    {
+        fillSmall(dst, value, n);
+        return;
+    }
+    uint8x16_t v = vdupq_n_u8(value);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        vst1q_u8(dst + i, v);
+    if (i < n)
+        vst1q_u8(dst + n - 16, v);
+}
+
+static inline void interleave16(uint8_t *dst, const uint8_t *const src[4], size_t i)
+{
+    uint8x16x4_t v;
+    v.val[0] = vld1q_u8(src[0] + i);
+    v.val[1] = vld1q_u8(src[1] + i);
+    v.val[2] = vld1q_u8(src[2] + i);
+    v.val[3] = vld1q_u8(src[3] + i);
+    vst4q_u8(dst + i * 4, v);
+}
+
+static inline void interleaveRow(uint8_t *dst, const uint8_t *const src[4], size_t n)
+{
+    if (n < 16)
+    {
+        interleaveSmall(dst, src, 0, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        interleave16(dst, src, i);
+    if (i < n)
+        interleave16(dst, src, n - 16);
+}
+
+#else
+
+static inline void copyRow(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    if (n < 16)
+        copySmall(dst, src, n);
+    else
+        memcpy(dst, src, n);
+}
+
+static inline void fillRow(uint8_t *dst, uint8_t value, size_t n)
+{
+    if (n < 16)
+        fillSmall(dst, value, n);
+    else
+        memset(dst, value, n);
+}
+
+static inline void interleaveRow(uint8_t *dst, const uint8_t *const src[4], size_t n)
+{
+    interleaveSmall(dst, src, 0, n);
+}
+
+#endif
+
+void BlitRows(uint8_t *dst, ptrdiff_t dstPitch, const uint8_t *src, ptrdiff_t srcPitch, size_t rowBytes,
+              size_t rows)
+{
+    if (dstPitch == (ptrdiff_t)rowBytes && srcPitch == (ptrdiff_t)rowBytes)
+    {
+        // contiguous, a single copy
+        memcpy(dst, src, rowBytes * rows);
+        return;
+    }
+    for (size_t i = 0; i < rows; i++)
+    {
+        copyRow(dst + (ptrdiff_t)i * dstPitch, src + (ptrdiff_t)i * srcPitch, rowBytes);
+    }
+}
+
+void FillRows(uint8_t *dst, ptrdiff_t dstPitch, uint8_t value, size_t rowBytes, size_t rows)
+{
+    if (dstPitch == (ptrdiff_t)rowBytes)
+    {
+        memset(dst, value, rowBytes * rows);
+        return;
+    }
+    for (size_t i = 0; i < rows; i++)
+    {
+        fillRow(dst + (ptrdiff_t)i * dstPitch, value, rowBytes);
+    }
+}
+
+void InterleaveRows(uint8_t *dst, ptrdiff_t dstPitch, const uint8_t *const planes[4],
+                    const ptrdiff_t planePitches[4], size_t width, size_t rows)
+{
+    for (size_t i = 0; i < rows; i++)
+    {
+        const uint8_t *src[4];
+        for (int c = 0; c < 4; c++)
+        {
+            src[c] = planes[c] + (ptrdiff_t)i * planePitches[c];
+        }
+        interleaveRow(dst + (ptrdiff_t)i * dstPitch, src, width);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+static void applyLUTScalar(uint8_t *pixels, size_t count, const uint8_t lut[256])
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint8_t a = lut[pixels[i]];
+        uint8_t b = lut[pixels[i + 1]];
+        uint8_t c = lut[pixels[i + 2]];
+        uint8_t d = lut[pixels[i + 3]];
+        pixels[i] = a;
+        pixels[i + 1] = b;
+        pixels[i + 2] = c;
+        pixels[i + 3] = d;
+    }
+    for (; i < count; i++)
+    {
+        pixels[i] = lut[pixels[i]];
+    }
+}
+
+#if defined(PIXEL_KERNELS_AVX2)
+
+// The table is split in 16 rows of 16 entries, each looked up with a byte
+// shuffle. Row j sees the pixels minus 16 * j, saturated so that only values
+// 0-15 keep the shuffle's high bit clear; all other lanes come out 0.
+void ApplyLUT(uint8_t *pixels, size_t count, const uint8_t lut[256])
+{
+    __m256i rows[16];
+    for (int j = 0; j < 16; j++)
+    {
+        rows[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + 16 * j)));
+    }
+    const __m256i step = _mm256_set1_epi8(16);
+    const __m256i bias = _mm256_set1_epi8(0x70);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(pixels + i));
+        __m256i result = _mm256_shuffle_epi8(rows[0], _mm256_adds_epu8(v, bias));
+        for (int j = 1; j < 16; j++)
+        {
+            v = _mm256_sub_epi8(v, step);
+            result = _mm256_or_si256(result, _mm256_shuffle_epi8(rows[j], _mm256_adds_epu8(v, bias)));
+        }
+        _mm256_storeu_si256((__m256i*)(pixels + i), result);
+    }
+    applyLUTScalar(pixels + i, count - i, lut);
+}
+
+#elif defined(PIXEL_KERNELS_NEON)
+
+// Four 64 entry table lookups, vqtbx leaves lanes out of its range alone.
+void ApplyLUT(uint8_t *pixels, size_t count, const uint8_t lut[256])
+{
+    uint8x16x4_t t0, t1, t2, t3;
+    for (int j = 0; j < 4; j++)
+    {
+        t0.val[j] = vld1q_u8(lut + 16 * j);
+        t1.val[j] = vld1q_u8(lut + 64 + 16 * j);
+        t2.val[j] = vld1q_u8(lut + 128 + 16 * j);
+        t3.val[j] = vld1q_u8(lut + 192 + 16 * j);
+    }
+    const uint8x16_t step = vdupq_n_u8(64);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(pixels + i);
+        uint8x16_t result = vqtbl4q_u8(t0, v);
+        v = vsubq_u8(v, step);
+        result = vqtbx4q_u8(result, t1, v);
+        v = vsubq_u8(v, step);
+        result = vqtbx4q_u8(result, t2, v);
+        v = vsubq_u8(v, step);
+        result = vqtbx4q_u8(result, t3, v);
+        vst1q_u8(pixels + i, result);
+    }
+    applyLUTScalar(pixels + i, count - i, lut);
+}
+
+#else
+
+// SSE2 has no byte shuffle, and 128-bit shuffles (SSSE3) measured slower
+// than scalar lookups, which stay in use
+void ApplyLUT(uint8_t *pixels, size_t count, const uint8_t lut[256])
+{
+    applyLUTScalar(pixels, count, lut);
+}
+
+#endif
+
+void BuildCoverageLUT(float gamma, float contrast, uint8_t lut[256])
+{
+    for (int i = 0; i < 256; i++)
+    {
+        float c = std::pow(i / 255.0f, 1.0f / gamma);
+        c = (c - 0.5f) * contrast + 0.5f;
+        lut[i] = (uint8_t)(std::max(0.0f, std::min(1.0f, c)) * 255.0f + 0.5f);
+    }
+    // no coverage stays no coverage, full stays full
+    lut[0] = 0;
+    lut[255] = 255;
+}
+
+//------------------------------------------------------------------------------
+
+// One output row of a box filter down the columns: the column sums get the
+// row entering the window, the output is the sums times scale (65536 over
+// the window) rounded, then the row leaving the window is taken off. Windows
+// of up to 257 bytes sum to 16 bits.
+static inline void boxStepScalar(uint8_t *dst, uint16_t *sums, const uint8_t *add, const uint8_t *sub,
+                                 size_t from, size_t n, uint32_t scale)
+{
+    for (size_t x = from; x < n; x++)
+    {
+        uint32_t sum = sums[x] + add[x];
+        dst[x] = (uint8_t)((sum * scale + 32768) >> 16);
+        sums[x] = (uint16_t)(sum - sub[x]);
+    }
+}
+
+#if defined(PIXEL_KERNELS_AVX2)
+
+// The high half of the 32-bit product plus the top bit of the low half is
+// the rounded shift. Unpacking and packing work within 128-bit lanes, so the
+// bytes are permuted around them to keep the sums in memory order.
+static inline void boxStep(uint8_t *dst, uint16_t *sums, const uint8_t *add, const uint8_t *sub, size_t n,
+                           uint32_t scale)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i factor = _mm256_set1_epi16((short)scale);
+    size_t x = 0;
+    for (; x + 32 <= n; x += 32)
+    {
+        __m256i a = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i*)(add + x)), 0xd8);
+        __m256i b = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i*)(sub + x)), 0xd8);
+        __m256i lo = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(sums + x)), _mm256_unpacklo_epi8(a, zero));
+        __m256i hi = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(sums + x + 16)), _mm256_unpackhi_epi8(a, zero));
+        __m256i qlo = _mm256_add_epi16(_mm256_mulhi_epu16(lo, factor), _mm256_srli_epi16(_mm256_mullo_epi16(lo, factor), 15));
+        __m256i qhi = _mm256_add_epi16(_mm256_mulhi_epu16(hi, factor), _mm256_srli_epi16(_mm256_mullo_epi16(hi, factor), 15));
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(qlo, qhi), 0xd8));
+        _mm256_storeu_si256((__m256i*)(sums + x), _mm256_sub_epi16(lo, _mm256_unpacklo_epi8(b, zero)));
+        _mm256_storeu_si256((__m256i*)(sums + x + 16), _mm256_sub_epi16(hi, _mm256_unpackhi_epi8(b, zero)));
+    }
+    boxStepScalar(dst, sums, add, sub, x, n, scale);
+}
+
+#elif defined(PIXEL_KERNELS_SSE2)
+
+// The high half of the 32-bit product plus the top bit of the low half is
+// the rounded shift.
+static inline void boxStep(uint8_t *dst, uint16_t *sums, const uint8_t *add, const uint8_t *sub, size_t n,
+                           uint32_t scale)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i factor = _mm_set1_epi16((short)scale);
+    size_t x = 0;
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(add + x));
+        __m128i b = _mm_loadu_si128((const __m128i*)(sub + x));
+        __m128i lo = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(sums + x)), _mm_unpacklo_epi8(a, zero));
+        __m128i hi = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(sums + x + 8)), _mm_unpackhi_epi8(a, zero));
+        __m128i qlo = _mm_add_epi16(_mm_mulhi_epu16(lo, factor), _mm_srli_epi16(_mm_mullo_epi16(lo, factor), 15));
+        __m128i qhi = _mm_add_epi16(_mm_mulhi_epu16(hi, factor), _mm_srli_epi16(_mm_mullo_epi16(hi, factor), 15));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(qlo, qhi));
+        _mm_storeu_si128((__m128i*)(sums + x), _mm_sub_epi16(lo, _mm_unpacklo_epi8(b, zero)));
+        _mm_storeu_si128((__m128i*)(sums + x + 8), _mm_sub_epi16(hi, _mm_unpackhi_epi8(b, zero)));
+    }
+    boxStepScalar(dst, sums, add, sub, x, n, scale);
+}
+
+#elif defined(PIXEL_KERNELS_NEON)
+
+// The rounding narrowing shift does the rounded shift.
+static inline void boxStep(uint8_t *dst, uint16_t *sums, const uint8_t *add, const uint8_t *sub, size_t n,
+                           uint32_t scale)
+{
+    const uint16x4_t factor = vdup_n_u16((uint16_t)scale);
+    size_t x = 0;
+    for (; x + 16 <= n; x += 16)
+    {
+        uint8x16_t a = vld1q_u8(add + x);
+        uint8x16_t b = vld1q_u8(sub + x);
+        uint16x8_t lo = vaddw_u8(vld1q_u16(sums + x), vget_low_u8(a));
+        uint16x8_t hi = vaddw_u8(vld1q_u16(sums + x + 8), vget_high_u8(a));
+        uint16x8_t qlo = vcombine_u16(vrshrn_n_u32(vmull_u16(vget_low_u16(lo), factor), 16),
+                                      vrshrn_n_u32(vmull_u16(vget_high_u16(lo), factor), 16));
+        uint16x8_t qhi = vcombine_u16(vrshrn_n_u32(vmull_u16(vget_low_u16(hi), factor), 16),
+                                      vrshrn_n_u32(vmull_u16(vget_high_u16(hi), factor), 16));
+        vst1q_u8(dst + x, vcombine_u8(vqmovn_u16(qlo), vqmovn_u16(qhi)));
+        vst1q_u16(sums + x, vsubw_u8(lo, vget_low_u8(b)));
+        vst1q_u16(sums + x + 8, vsubw_u8(hi, vget_high_u8(b)));
+    }
+    boxStepScalar(dst, sums, add, sub, x, n, scale);
+}
+
+#else
+
+static inline void boxStep(uint8_t *dst, uint16_t *sums, const uint8_t *add, const uint8_t *sub, size_t n,
+                           uint32_t scale)
+{
+    boxStepScalar(dst, sums, add, sub, 0, n, scale);
+}
+
+#endif
+
+// Box filters of the radii down the columns of pixels, temp is scratch of
+// the same size. Works on whole rows, a sliding sum per column.
+static void boxBlurColumns(uint8_t *pixels, uint8_t *temp, size_t width, size_t rows, const int *radii,
+                           int passes)
+{
+    std::vector<uint16_t> sums(width);
+    std::vector<uint8_t> zeros(width, 0);
+    uint8_t *src = pixels;
+    uint8_t *dst = temp;
+    for (int p = 0; p < passes; p++)
+    {
+        size_t r = (size_t)radii[p];
+        if (r == 0)
+        {
+            continue;
+        }
+        const uint32_t scale = 65536 / (2 * (uint32_t)r + 1);
+        std::fill(sums.begin(), sums.end(), 0);
+        for (size_t y = 0; y < std::min(r, rows); y++)
+        {
+            const uint8_t *s = src + y * width;
+            for (size_t x = 0; x < width; x++)
+                sums[x] += s[x];
+        }
+        for (size_t y = 0; y < rows; y++)
+        {
+            const uint8_t *add = (y + r < rows) ? src + (y + r) * width : zeros.data();
+            const uint8_t *sub = (y >= r) ? src + (y - r) * width : zeros.data();
+            boxStep(dst + y * width, sums.data(), add, sub, width, scale);
+        }
+        std::swap(src, dst);
+    }
+    if (src != pixels)
+    {
+        memcpy(pixels, src, width * rows);
+    }
+}
+
+// dst (rows x width) is src (width x rows) transposed, in blocks that stay
+// in the cache on both sides.
+static void transposeBytes(uint8_t *dst, const uint8_t *src, size_t width, size_t rows)
+{
+    const size_t block = 16;
+    for (size_t y0 = 0; y0 < rows; y0 += block)
+    {
+        for (size_t x0 = 0; x0 < width; x0 += block)
+        {
+            size_t y1 = std::min(y0 + block, rows);
+            size_t x1 = std::min(x0 + block, width);
+            for (size_t y = y0; y < y1; y++)
+            {
+                for (size_t x = x0; x < x1; x++)
+                    dst[x * rows + y] = src[y * width + x];
+            }
+        }
+    }
+}
+
+// The row passes run down the columns of the transposed bitmap, so both
+// directions use the vector kernel.
+void BoxBlur(uint8_t *pixels, size_t width, size_t rows, const int *radii, int passes)
+{
+    std::vector<uint8_t> transposed(width * rows);
+    std::vector<uint8_t> temp(width * rows);
+    boxBlurColumns(pixels, temp.data(), width, rows, radii, passes);
+    transposeBytes(transposed.data(), pixels, width, rows);
+    boxBlurColumns(transposed.data(), temp.data(), rows, width, radii, passes);
+    transposeBytes(pixels, transposed.data(), rows, width);
+}
+
+//------------------------------------------------------------------------------
+
+const char *PixelKernelsISA()
+{
+#if defined(PIXEL_KERNELS_AVX2)
+    return "AVX2";
+#elif defined(PIXEL_KERNELS_SSE2)
+    return "SSE2";
+#elif defined(PIXEL_KERNELS_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
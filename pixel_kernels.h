@@ -0,0 +1,45 @@
+#ifndef __PIXEL_KERNELS_H__
+#define __PIXEL_KERNELS_H__
+
+#include <cstddef>
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+
+// Byte kernels for glyph bitmaps and the atlas CPU copy. They are built for
+// the best instruction set the compiler targets (AVX2 with the DRAWTEXT_AVX2
+// build option, else SSE2 on x86-64 and NEON on AArch64), with a scalar
+// fallback elsewhere.
+
+// Copies rows rows of rowBytes bytes between buffers of any pitch (negative
+// for bottom-up buffers, as FreeType bitmaps may be).
+void BlitRows(uint8_t *dst, ptrdiff_t dstPitch, const uint8_t *src, ptrdiff_t srcPitch, size_t rowBytes,
+              size_t rows);
+
+// Sets rows rows of rowBytes bytes to value.
+void FillRows(uint8_t *dst, ptrdiff_t dstPitch, uint8_t value, size_t rowBytes, size_t rows);
+
+// Interleaves rows rows of width bytes of four planes into rows of width
+// RGBA pixels, plane i into channel i. A plane pitch of 0 repeats its first
+// row, e.g. a row of zeros for a missing plane.
+void InterleaveRows(uint8_t *dst, ptrdiff_t dstPitch, const uint8_t *const planes[4],
+                    const ptrdiff_t planePitches[4], size_t width, size_t rows);
+
+// Box filters a single channel bitmap of width x rows bytes in place, once
+// per pass with radius radii[i] (0 to 128) along the columns and then the
+// rows. Texels outside the bitmap are 0.
+void BoxBlur(uint8_t *pixels, size_t width, size_t rows, const int *radii, int passes);
+
+// Replaces each of count bytes by its entry in lut.
+void ApplyLUT(uint8_t *pixels, size_t count, const uint8_t lut[256]);
+
+// Fills lut with a coverage adjustment: gamma > 1 thickens antialiased
+// edges, contrast > 1 sharpens them around half coverage. 1, 1 is identity.
+void BuildCoverageLUT(float gamma, float contrast, uint8_t lut[256]);
+
+// Instruction set the kernels were built for, e.g. "AVX2".
+const char *PixelKernelsISA();
+
+//------------------------------------------------------------------------------
+
+#endif // !__PIXEL_KERNELS_H__
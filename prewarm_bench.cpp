@@ -0,0 +1,106 @@
+#include "prewarm_bench.h"
+#include "text_render.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+// Glyphs of a bulk prewarm, e.g. a CJK font's common set.
+static const unsigned int PrewarmGlyphs = 5000;
+static const float PrewarmSizes[] = { 24.0f, 48.0f };
+static const int PrewarmThreads[] = { 0, 1, 2, 4, 8 };
+static const int PrewarmRuns = 3;
+// Framebuffer the atlases are added in.
+static const int PrewarmWidth = 800;
+static const int PrewarmHeight = 600;
+
+struct PrewarmTimes {
+    double submit;     // PrewarmGlyphs returned
+    double raster;     // The workers are done
+    double total;      // The bitmaps are in the atlases
+};
+
+//------------------------------------------------------------------------------
+
+static bool runPrewarm(FT_Library ftLib, const char *fontFile, float size, int threads, PrewarmTimes &times)
+{
+    typedef std::chrono::steady_clock Clock;
+    TextRender render;
+    if (!render.Init(4, 256, 16 * 1024 * 1024, threads))
+    {
+        return false;
+    }
+    Font font(ftLib, fontFile, size, 1.0f, false, false);
+    if (!font.Ok())
+    {
+        return false;
+    }
+    std::vector<unsigned int> glyphs;
+    for (unsigned int i = 1; i <= PrewarmGlyphs && i < (unsigned int)font.getFTFont()->num_glyphs; i++)
+    {
+        glyphs.push_back(i);
+    }
+    // the hash keys the glyphs, computed on load
+    font.getHash();
+    render.SetRasterBudget((int)glyphs.size());
+
+    Clock::time_point start = Clock::now();
+    render.PrewarmGlyphs(font, glyphs);
+    Clock::time_point submitted = Clock::now();
+    render.WaitIdle();
+    Clock::time_point rasterized = Clock::now();
+    render.Begin(PrewarmWidth, PrewarmHeight);
+    render.End();
+    glFinish();
+    Clock::time_point added = Clock::now();
+
+    times.submit = std::chrono::duration<double, std::milli>(submitted - start).count();
+    times.raster = std::chrono::duration<double, std::milli>(rasterized - start).count();
+    times.total = std::chrono::duration<double, std::milli>(added - start).count();
+    return true;
+}
+
+void RunPrewarmBenchmark(FT_Library ftLib, const char *fontFile)
+{
+    fprintf(stdout, "----prewarm benchmark (%u glyphs, %u hardware threads, median of %d)----\n",
+            PrewarmGlyphs, std::thread::hardware_concurrency(), PrewarmRuns);
+    fprintf(stdout, "%-6s %-8s %10s %12s %10s %10s %8s\n", "size", "threads", "submit", "raster done", "upload",
+            "total", "speedup");
+
+    for (size_t s = 0; s < sizeof(PrewarmSizes) / sizeof(PrewarmSizes[0]); s++)
+    {
+        double baseline = 0.0;
+        for (size_t t = 0; t < sizeof(PrewarmThreads) / sizeof(PrewarmThreads[0]); t++)
+        {
+            // the run with the median total
+            std::vector<PrewarmTimes> runs;
+            for (int r = 0; r < PrewarmRuns; r++)
+            {
+                PrewarmTimes times;
+                if (!runPrewarm(ftLib, fontFile, PrewarmSizes[s], PrewarmThreads[t], times))
+                {
+                    fprintf(stderr, "prewarm benchmark: can't load %s\n", fontFile);
+                    return;
+                }
+                runs.push_back(times);
+            }
+            std::sort(runs.begin(), runs.end(), [](const PrewarmTimes &a, const PrewarmTimes &b)
+                      {
+                          return a.total < b.total;
+                      });
+            const PrewarmTimes &m = runs[runs.size() / 2];
+            if (t == 0)
+            {
+                baseline = m.total;
+            }
+            fprintf(stdout, "%-6.0f %-8d %7.1f ms %9.1f ms %7.1f ms %7.1f ms %7.2fx\n",
+                    PrewarmSizes[s], PrewarmThreads[t], m.submit, m.raster, m.total - m.raster, m.total,
+                    baseline / m.total);
+        }
+    }
+    fprintf(stdout, "\n");
+}
@@ -0,0 +1,17 @@
+#ifndef __PREWARM_BENCH_H__
+#define __PREWARM_BENCH_H__
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+//------------------------------------------------------------------------------
+
+// Prewarms the first glyphs of fontFile with 0 (rasterizing on the calling
+// thread) to 8 raster threads, at a Latin and a CJK-like size, and prints the
+// time to submit them, until the workers are done and to add the bitmaps to
+// the atlases, to stdout. Needs a current GL context.
+void RunPrewarmBenchmark(FT_Library ftLib, const char *fontFile);
+
+//------------------------------------------------------------------------------
+
+#endif // !__PREWARM_BENCH_H__
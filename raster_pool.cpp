@@ -0,0 +1,170 @@
+#include "raster_pool.h"
+#include <cassert>
+#include <algorithm>
+
+// Glyphs per batch, small enough to balance the load between workers.
+static const size_t RasterBatchSize = 32;
+
+RasterPool::RasterPool()
+: fontCache_(NULL), pending_(0), quit_(false)
+{
+}
+
+RasterPool::~RasterPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    cond_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+        threads_[i].join();
+    }
+}
+
+bool RasterPool::Init(int numThreads, FontCache *fontCache)
+{
+    assert(threads_.empty());
+    assert(numThreads >= 0);
+
+    fontCache_ = fontCache;
+    for (int i = 0; i < numThreads; i++)
+    {
+        threads_.push_back(std::thread([this]{ workerMain(); }));
+    }
+    return true;
+}
+
+void RasterPool::Submit(const std::vector<Request> &requests)
+{
+    if (requests.empty())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < requests.size(); i += RasterBatchSize)
+        {
+            size_t end = std::min(i + RasterBatchSize, requests.size());
+            requests_.push_back(RequestBatch(requests.begin() + i, requests.begin() + end));
+        }
+        pending_ += requests.size();
+    }
+    cond_.notify_all();
+}
+
+void RasterPool::Collect(std::vector<Result> &results)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ -= results_.size();
+    for (size_t i = 0; i < results_.size(); i++)
+    {
+        results.push_back(std::move(results_[i]));
+    }
+    results_.clear();
+}
+
+size_t RasterPool::Pending()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_;
+}
+
+void RasterPool::WaitIdle()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    idleCond_.wait(lock, [this]{ return pending_ == results_.size(); });
+}
+
+void RasterPool::SetNotify(std::function<void()> notify)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    notify_ = notify;
+}
+
+void RasterPool::workerMain()
+{
+    for (;;)
+    {
+        RequestBatch batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]{ return quit_ || !requests_.empty(); });
+            if (quit_)
+            {
+                return;
+            }
+            batch.swap(requests_.front());
+            requests_.pop_front();
+        }
+
+        std::vector<Result> results(batch.size());
+        std::vector<Font*> fonts;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            const Request &req = batch[i];
+            Result &r = results[i];
+            Font::Instance inst = req.font->ForThread();
+            if (std::find(fonts.begin(), fonts.end(), req.font) == fonts.end())
+            {
+                fonts.push_back(req.font);
+            }
+            r.faceID = req.faceID;
+            r.glyphIndex = req.glyphIndex;
+            r.requestVarKey = req.varKey;
+            r.requestCharHeight = req.charHeight;
+            r.varKey = inst.varKey;
+            r.format = req.params.format;
+            r.strokeWidth = req.params.strokeWidth;
+            r.blurRadius = req.params.blurRadius;
+            r.charHeight = RasterCharHeight(req.params, inst.charHeight);
+            r.ok = false;
+
+            FT_Glyph glyph;
+            if (inst.ftFont && req.params.color)
+            {
+                r.ok = RasterizeColorGlyph(inst.ftFont, req.glyphIndex, inst.charHeight, r.bitmap,
+                                           req.params.blurRadius);
+            }
+            else if (inst.ftFont && inst.varKey == 0)
+            {
+                // from the bounded cache, at the size of the instance
+                r.ok = fontCache_->LoadGlyph(*req.font, inst.charHeight, req.glyphIndex,
+                                             RasterLoadFlags(req.params), glyph) &&
+                       RasterizeGlyph(glyph, req.params, r.bitmap);
+            }
+            else if (inst.ftFont &&
+                     FT_Load_Glyph(inst.ftFont, req.glyphIndex, RasterLoadFlags(req.params)) == 0 &&
+                     FT_Get_Glyph(inst.ftFont->glyph, &glyph) == 0)
+            {
+                // other instances aren't in the image cache, the thread's
+                // instance is set to them already
+                r.ok = RasterizeGlyph(glyph, req.params, r.bitmap);
+            }
+        }
+
+        // hand the instances back before publishing, once the results are
+        // collected the fonts of this batch may be destroyed
+        for (size_t i = 0; i < fonts.size(); i++)
+        {
+            fonts[i]->ReleaseThread();
+        }
+
+        std::function<void()> notify;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < results.size(); i++)
+            {
+                results_.push_back(std::move(results[i]));
+            }
+            notify = notify_;
+        }
+        idleCond_.notify_all();
+        if (notify)
+        {
+            notify();
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef __RASTER_POOL_H__
+#define __RASTER_POOL_H__
+
+#include "font.h"
+#include "font_cache.h"
+#include "glyph_raster.h"
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+//------------------------------------------------------------------------------
+
+// Worker threads rasterizing glyphs with per-thread font instances (see
+// Font::ForThread), so they never touch the render thread's FreeType state.
+// Outlines of the default instances come from the shared FontCache, like on
+// the render thread. Finished bitmaps are handed back to the render thread,
+// which owns the texture atlases.
+class RasterPool
+{
+public:
+    struct Request {
+        Font* font;            // Must outlive the request
+        unsigned int glyphIndex;
+        uint64_t faceID;       // Font::getHash, shared by all styles of the face
+        uint64_t varKey;       // Variation instance at request time
+        FT_F26Dot6 charHeight; // Raster size at request time, see RasterCharHeight
+        RasterParams params;
+    };
+
+    struct Result {
+        uint64_t faceID;
+        unsigned int glyphIndex;
+        uint64_t requestVarKey;
+        FT_F26Dot6 requestCharHeight;
+        uint64_t varKey;       // Variation instance the glyph was rasterized with
+        GlyphFormat format;
+        FT_F26Dot6 strokeWidth;
+        int blurRadius;
+        FT_F26Dot6 charHeight; // Font size the glyph was rasterized at
+        bool ok;
+        GlyphBitmap bitmap;
+    };
+
+private:
+    typedef std::vector<Request> RequestBatch;
+
+    std::vector<std::thread> threads_;
+    FontCache *fontCache_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable idleCond_;
+    std::deque<RequestBatch> requests_;
+    std::vector<Result> results_;
+    size_t pending_;
+    bool quit_;
+    std::function<void()> notify_;
+
+public:
+    RasterPool();
+    ~RasterPool();
+
+    // fontCache must outlive the pool.
+    bool Init(int numThreads, FontCache *fontCache);
+
+    int NumThreads() const { return (int)threads_.size(); }
+
+    // Queues requests, split into batches the workers pick up one at a time.
+    void Submit(const std::vector<Request> &requests);
+
+    // Moves the finished results into results.
+    void Collect(std::vector<Result> &results);
+
+    // Number of requests not collected yet.
+    size_t Pending();
+
+    // Blocks until all submitted requests are finished.
+    void WaitIdle();
+
+    // Called on a worker thread whenever results become available.
+    void SetNotify(std::function<void()> notify);
+
+private:
+    void workerMain();
+};
+
+//------------------------------------------------------------------------------
+
+#endif // !__RASTER_POOL_H__
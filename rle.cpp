@@ -0,0 +1,77 @@
+#include "rle.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Runs shorter than this are cheaper as literals.
+static const size_t RleMinRun = 3;
+static const size_t RleMaxCount = 128;
+
+//------------------------------------------------------------------------------
+
+// Tokens are a count byte c followed by either c + 1 literal bytes (c < 128)
+// or a single byte repeated c - 127 times (c >= 128).
+void RleEncode(const uint8_t *data, size_t size, std::vector<uint8_t> &out)
+{
+    out.clear();
+    out.reserve(size / 4 + 16);
+    size_t i = 0;
+    size_t literal = 0;   // Start of pending literals
+    while (i < size)
+    {
+        size_t run = 1;
+        while (i + run < size && run < RleMaxCount && data[i + run] == data[i])
+            run++;
+        if (run < RleMinRun)
+        {
+            i += run;
+            continue;
+        }
+        while (literal < i)
+        {
+            size_t n = std::min(i - literal, RleMaxCount);
+            out.push_back((uint8_t)(n - 1));
+            out.insert(out.end(), data + literal, data + literal + n);
+            literal += n;
+        }
+        out.push_back((uint8_t)(run + 127));
+        out.push_back(data[i]);
+        i += run;
+        literal = i;
+    }
+    while (literal < size)
+    {
+        size_t n = std::min(size - literal, RleMaxCount);
+        out.push_back((uint8_t)(n - 1));
+        out.insert(out.end(), data + literal, data + literal + n);
+        literal += n;
+    }
+}
+
+bool RleDecode(const uint8_t *data, size_t size, uint8_t *out, size_t outSize)
+{
+    size_t i = 0;
+    size_t o = 0;
+    while (i < size)
+    {
+        uint8_t c = data[i++];
+        if (c < 128)
+        {
+            size_t n = (size_t)c + 1;
+            if (i + n > size || o + n > outSize)
+                return false;
+            memcpy(out + o, data + i, n);
+            i += n;
+            o += n;
+        }
+        else
+        {
+            size_t n = (size_t)c - 127;
+            if (i >= size || o + n > outSize)
+                return false;
+            memset(out + o, data[i++], n);
+            o += n;
+        }
+    }
+    return o == outSize;
+}
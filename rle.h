@@ -0,0 +1,17 @@
+#ifndef __RLE_H__
+#define __RLE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+// Run-length coding of bitmap bytes. Glyph coverage is mostly runs of 0 and
+// 255, distance fields saturate the same way away from the outline.
+void RleEncode(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+bool RleDecode(const uint8_t *data, size_t size, uint8_t *out, size_t outSize);
+
+//------------------------------------------------------------------------------
+
+#endif // !__RLE_H__
@@ -0,0 +1,393 @@
+#include "shelf_packer.h"
+
+#include <algorithm>
+#include <cassert>
+
+//------------------------------------------------------------------------------
+
+int ShelfClassHeight(int height)
+{
+    if (height <= ShelfFineHeight)
+    {
+        return (height + ShelfHeightStep - 1) / ShelfHeightStep * ShelfHeightStep;
+    }
+    int power = ShelfFineHeight;
+    while (power * 2 <= height)
+    {
+        power *= 2;
+    }
+    int step = power / 4;
+    return (height + step - 1) / step * step;
+}
+
+ShelfPacker::ShelfPacker()
+: width_(0), height_(0), usedArea_(0), liveShelves_(0)
+{
+}
+
+void ShelfPacker::Init(int width, int height)
+{
+    width_ = width;
+    height_ = height;
+    shelves_.clear();
+    freeShelves_.clear();
+    slots_.clear();
+    freeSlots_.clear();
+    classShelves_.assign(height / ShelfHeightStep + 1, -1);
+    spans_.assign(1, Span{ 0, height });
+    used_.clear();
+    usedArea_ = 0;
+    liveShelves_ = 0;
+}
+
+void ShelfPacker::Grow(int width, int height)
+{
+    assert(width >= width_ && height >= height_);
+
+    // shelves span the bin, they widen along
+    if (height > height_)
+    {
+        if (!spans_.empty() && spans_.back().Y + spans_.back().Height == height_)
+            spans_.back().Height += height - height_;
+        else
+            spans_.push_back(Span{ height_, height - height_ });
+        classShelves_.resize(height / ShelfHeightStep + 1, -1);
+    }
+    width_ = width;
+    height_ = height;
+}
+
+binpack::Rect ShelfPacker::Insert(int width, int height)
+{
+    binpack::Rect none = binpack::Rect{ 0, 0, 0, 0 };
+    if (width <= 0 || height <= 0 || width > width_ || height > height_)
+    {
+        return none;
+    }
+
+    // first fit among the freed slots of a shelf, then its untouched end
+    int classHeight = std::min(ShelfClassHeight(height), height_);
+    for (int s = classShelves_[classIndex(classHeight)]; s >= 0; s = shelves_[s].NextInClass)
+    {
+        for (int f = shelves_[s].FirstFree; f >= 0; f = slots_[f].NextFree)
+        {
+            if (slots_[f].Width >= width)
+            {
+                popFree(f);
+                useSlot(f, width, height);
+                return binpack::Rect{ slots_[f].X, shelves_[s].Y, width, height };
+            }
+        }
+        if (width_ - shelves_[s].Tail >= width)
+        {
+            int slot = newSlot(s, shelves_[s].Tail, width);
+            linkSlot(slot, shelves_[s].Last);
+            shelves_[s].Tail += width;
+            useSlot(slot, width, height);
+            return binpack::Rect{ slots_[slot].X, shelves_[s].Y, width, height };
+        }
+    }
+
+    // another shelf in the first free rows tall enough
+    for (size_t i = 0; i < spans_.size(); i++)
+    {
+        if (spans_[i].Height < classHeight)
+        {
+            continue;
+        }
+        int s = newShelf(classHeight, spans_[i].Y);
+        spans_[i].Y += classHeight;
+        spans_[i].Height -= classHeight;
+        if (spans_[i].Height == 0)
+        {
+            spans_.erase(spans_.begin() + i);
+        }
+        int slot = newSlot(s, 0, width);
+        linkSlot(slot, -1);
+        shelves_[s].Tail = width;
+        useSlot(slot, width, height);
+        return binpack::Rect{ 0, shelves_[s].Y, width, height };
+    }
+    return none;
+}
+
+bool ShelfPacker::Free(int x, int y)
+{
+    std::unordered_map<uint32_t, int>::iterator entry = used_.find(position(x, y));
+    if (entry == used_.end())
+    {
+        return false;
+    }
+    int slot = entry->second;
+    used_.erase(entry);
+    int s = slots_[slot].Shelf;
+    usedArea_ -= (unsigned long)slots_[slot].Width * slots_[slot].Height;
+    slots_[slot].Height = 0;
+    shelves_[s].Used--;
+
+    // merge with free neighbours
+    int next = slots_[slot].Next;
+    if (next >= 0 && slots_[next].Height == 0)
+    {
+        popFree(next);
+        slots_[slot].Width += slots_[next].Width;
+        unlinkSlot(next);
+        freeSlots_.push_back(next);
+    }
+    int prev = slots_[slot].Prev;
+    if (prev >= 0 && slots_[prev].Height == 0)
+    {
+        popFree(prev);
+        slots_[prev].Width += slots_[slot].Width;
+        unlinkSlot(slot);
+        freeSlots_.push_back(slot);
+        slot = prev;
+    }
+
+    if (slots_[slot].Next < 0)
+    {
+        // back to the untouched end
+        shelves_[s].Tail = slots_[slot].X;
+        unlinkSlot(slot);
+        freeSlots_.push_back(slot);
+    }
+    else
+    {
+        pushFree(slot);
+    }
+    if (shelves_[s].Used == 0)
+    {
+        freeShelf(s);
+    }
+    return true;
+}
+
+bool ShelfPacker::Place(const binpack::Rect &rect)
+{
+    if (rect.width <= 0 || rect.height <= 0 || rect.x < 0 || rect.y < 0 ||
+        rect.x + rect.width > width_ || rect.y + rect.height > height_)
+    {
+        return false;
+    }
+
+    // the shelf at the position, or a new one in the free rows there
+    int classHeight = std::min(ShelfClassHeight(rect.height), height_);
+    int s = classShelves_[classIndex(classHeight)];
+    while (s >= 0 && shelves_[s].Y != rect.y)
+    {
+        s = shelves_[s].NextInClass;
+    }
+    if (s < 0)
+    {
+        size_t i = 0;
+        while (i < spans_.size() &&
+               !(spans_[i].Y <= rect.y && rect.y + classHeight <= spans_[i].Y + spans_[i].Height))
+        {
+            i++;
+        }
+        if (i == spans_.size())
+        {
+            return false;
+        }
+        Span above = Span{ spans_[i].Y, rect.y - spans_[i].Y };
+        Span below = Span{ rect.y + classHeight, spans_[i].Y + spans_[i].Height - rect.y - classHeight };
+        spans_.erase(spans_.begin() + i);
+        if (below.Height > 0)
+            spans_.insert(spans_.begin() + i, below);
+        if (above.Height > 0)
+            spans_.insert(spans_.begin() + i, above);
+        s = newShelf(classHeight, rect.y);
+    }
+
+    if (rect.x >= shelves_[s].Tail)
+    {
+        if (rect.x > shelves_[s].Tail)
+        {
+            int gap = newSlot(s, shelves_[s].Tail, rect.x - shelves_[s].Tail);
+            linkSlot(gap, shelves_[s].Last);
+            pushFree(gap);
+        }
+        int slot = newSlot(s, rect.x, rect.width);
+        linkSlot(slot, shelves_[s].Last);
+        shelves_[s].Tail = rect.x + rect.width;
+        useSlot(slot, rect.width, rect.height);
+        return true;
+    }
+
+    // within a free slot, split off its left part
+    int f = shelves_[s].FirstFree;
+    while (f >= 0 && !(slots_[f].X <= rect.x && rect.x + rect.width <= slots_[f].X + slots_[f].Width))
+    {
+        f = slots_[f].NextFree;
+    }
+    if (f < 0)
+    {
+        return false;
+    }
+    popFree(f);
+    if (rect.x > slots_[f].X)
+    {
+        int slot = newSlot(s, rect.x, slots_[f].X + slots_[f].Width - rect.x);
+        slots_[f].Width = rect.x - slots_[f].X;
+        linkSlot(slot, f);
+        pushFree(f);
+        f = slot;
+    }
+    useSlot(f, rect.width, rect.height);
+    return true;
+}
+
+float ShelfPacker::Occupancy() const
+{
+    return (float)usedArea_ / ((float)width_ * height_);
+}
+
+int ShelfPacker::newShelf(int height, int y)
+{
+    int s;
+    if (!freeShelves_.empty())
+    {
+        s = freeShelves_.back();
+        freeShelves_.pop_back();
+    }
+    else
+    {
+        s = (int)shelves_.size();
+        shelves_.push_back(Shelf());
+    }
+    int head = classShelves_[classIndex(height)];
+    shelves_[s] = Shelf{ y, height, 0, -1, -1, -1, 0, -1, head };
+    if (head >= 0)
+    {
+        shelves_[head].PrevInClass = s;
+    }
+    classShelves_[classIndex(height)] = s;
+    liveShelves_++;
+    return s;
+}
+
+void ShelfPacker::freeShelf(int s)
+{
+    Shelf &shelf = shelves_[s];
+    if (shelf.PrevInClass >= 0)
+        shelves_[shelf.PrevInClass].NextInClass = shelf.NextInClass;
+    else
+        classShelves_[classIndex(shelf.Height)] = shelf.NextInClass;
+    if (shelf.NextInClass >= 0)
+        shelves_[shelf.NextInClass].PrevInClass = shelf.PrevInClass;
+    for (int slot = shelf.First; slot >= 0; slot = slots_[slot].Next)
+    {
+        freeSlots_.push_back(slot);
+    }
+
+    // the rows go back to the bin, merged with free ones around
+    std::vector<Span>::iterator next = std::upper_bound(spans_.begin(), spans_.end(), shelf.Y,
+                                                        [](int y, const Span &span) { return y < span.Y; });
+    next = spans_.insert(next, Span{ shelf.Y, shelf.Height });
+    if (next + 1 != spans_.end() && next->Y + next->Height == (next + 1)->Y)
+    {
+        next->Height += (next + 1)->Height;
+        spans_.erase(next + 1);
+    }
+    if (next != spans_.begin() && (next - 1)->Y + (next - 1)->Height == next->Y)
+    {
+        (next - 1)->Height += next->Height;
+        spans_.erase(next);
+    }
+
+    shelf.Height = 0;
+    freeShelves_.push_back(s);
+    liveShelves_--;
+}
+
+int ShelfPacker::newSlot(int shelf, int x, int width)
+{
+    int slot;
+    if (!freeSlots_.empty())
+    {
+        slot = freeSlots_.back();
+        freeSlots_.pop_back();
+    }
+    else
+    {
+        slot = (int)slots_.size();
+        slots_.push_back(Slot());
+    }
+    slots_[slot] = Slot{ x, width, 0, shelf, -1, -1, -1, -1 };
+    return slot;
+}
+
+void ShelfPacker::linkSlot(int slot, int prev)
+{
+    Shelf &shelf = shelves_[slots_[slot].Shelf];
+    int next = (prev >= 0) ? slots_[prev].Next : shelf.First;
+    slots_[slot].Prev = prev;
+    slots_[slot].Next = next;
+    if (prev >= 0)
+        slots_[prev].Next = slot;
+    else
+        shelf.First = slot;
+    if (next >= 0)
+        slots_[next].Prev = slot;
+    else
+        shelf.Last = slot;
+}
+
+void ShelfPacker::unlinkSlot(int slot)
+{
+    Shelf &shelf = shelves_[slots_[slot].Shelf];
+    int prev = slots_[slot].Prev;
+    int next = slots_[slot].Next;
+    if (prev >= 0)
+        slots_[prev].Next = next;
+    else
+        shelf.First = next;
+    if (next >= 0)
+        slots_[next].Prev = prev;
+    else
+        shelf.Last = prev;
+}
+
+void ShelfPacker::pushFree(int slot)
+{
+    Shelf &shelf = shelves_[slots_[slot].Shelf];
+    slots_[slot].PrevFree = -1;
+    slots_[slot].NextFree = shelf.FirstFree;
+    if (shelf.FirstFree >= 0)
+    {
+        slots_[shelf.FirstFree].PrevFree = slot;
+    }
+    shelf.FirstFree = slot;
+}
+
+void ShelfPacker::popFree(int slot)
+{
+    Shelf &shelf = shelves_[slots_[slot].Shelf];
+    int prev = slots_[slot].PrevFree;
+    int next = slots_[slot].NextFree;
+    if (prev >= 0)
+        slots_[prev].NextFree = next;
+    else
+        shelf.FirstFree = next;
+    if (next >= 0)
+        slots_[next].PrevFree = prev;
+    slots_[slot].PrevFree = -1;
+    slots_[slot].NextFree = -1;
+}
+
+void ShelfPacker::useSlot(int slot, int width, int height)
+{
+    // the rest of a wider slot stays free
+    if (slots_[slot].Width > width)
+    {
+        int s = slots_[slot].Shelf;
+        int rest = newSlot(s, slots_[slot].X + width, slots_[slot].Width - width);
+        slots_[slot].Width = width;
+        linkSlot(rest, slot);
+        pushFree(rest);
+    }
+    slots_[slot].Height = height;
+    shelves_[slots_[slot].Shelf].Used++;
+    used_[position(slots_[slot].X, shelves_[slots_[slot].Shelf].Y)] = slot;
+    usedArea_ += (unsigned long)width * height;
+}
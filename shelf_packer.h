@@ -0,0 +1,103 @@
+#ifndef __SHELF_PACKER_H__
+#define __SHELF_PACKER_H__
+
+#include "skyline_binpack.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+// Heights are rounded up to multiples of this up to ShelfFineHeight, then to
+// a quarter of their power of two, so taller glyphs leave less than a fifth
+// of the height of their shelf unused.
+const int ShelfHeightStep = 4;
+const int ShelfFineHeight = 32;
+
+// Height class of rectangles of height, the height of their shelves.
+int ShelfClassHeight(int height);
+
+// Alternative to binpack::SkylineBinPack that can free rectangles. The bin is
+// cut into shelves across its width, one height class each, stacked where
+// there is vertical room. A shelf hands out slots left to right; freed slots
+// go on its free list, merged with free neighbours, and a shelf whose slots
+// are all free returns its rows to the bin. Insert looks at the shelves of
+// one height class only, Free is a hash lookup and constant time merging.
+class ShelfPacker
+{
+    struct Shelf {
+        int Y;
+        int Height;
+        int Tail;           // Start of the untouched right end
+        int First;          // Slots by x, -1 if none
+        int Last;
+        int FirstFree;      // Free slots, -1 if none
+        int Used;           // Slots in use
+        int PrevInClass;    // Shelves of the height class, -1 at the ends
+        int NextInClass;
+    };
+    struct Slot {
+        int X;
+        int Width;
+        int Height;         // Of the rectangle, 0 if free
+        int Shelf;
+        int Prev;           // Neighbours by x within the shelf, -1 at the ends
+        int Next;
+        int PrevFree;       // Free list of the shelf, if free
+        int NextFree;
+    };
+    // Free rows between the shelves.
+    struct Span {
+        int Y;
+        int Height;
+    };
+
+public:
+    ShelfPacker();
+
+    // (Re)initializes the packer to an empty bin of width x height.
+    void Init(int width, int height);
+    // Enlarges the bin, keeping the rectangles in place.
+    void Grow(int width, int height);
+
+    // Returns a rectangle of height 0 if there is no room.
+    binpack::Rect Insert(int width, int height);
+    // Frees the rectangle Insert returned at x, y. False if there is none.
+    bool Free(int x, int y);
+    // Takes rect, as Insert returned it into a packer of the same size
+    // before, when restoring its rectangles in any order. False if it
+    // overlaps others or doesn't fit the shelf at its position.
+    bool Place(const binpack::Rect &rect);
+
+    float Occupancy() const;
+    int Shelves() const { return liveShelves_; }
+
+private:
+    int newShelf(int height, int y);
+    void freeShelf(int shelf);
+    int newSlot(int shelf, int x, int width);
+    void linkSlot(int slot, int prev);
+    void unlinkSlot(int slot);
+    void pushFree(int slot);
+    void popFree(int slot);
+    void useSlot(int slot, int width, int height);
+    int classIndex(int classHeight) const { return classHeight / ShelfHeightStep; }
+    static uint32_t position(int x, int y) { return (uint32_t)y << 16 | (uint32_t)x; }
+
+    int width_;
+    int height_;
+    std::vector<Shelf> shelves_;
+    std::vector<int> freeShelves_;      // Recycled entries of shelves_
+    std::vector<Slot> slots_;
+    std::vector<int> freeSlots_;        // Recycled entries of slots_
+    std::vector<int> classShelves_;     // First shelf per height class, -1 if none
+    std::vector<Span> spans_;           // By y, merged
+    std::unordered_map<uint32_t, int> used_;  // Slots in use by position
+    unsigned long usedArea_;
+    int liveShelves_;
+};
+
+//------------------------------------------------------------------------------
+
+#endif // !__SHELF_PACKER_H__
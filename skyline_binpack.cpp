@@ -40,11 +40,46 @@ void SkylineBinPack::Init(int width, int height)
 	skyLine.push_back(node);
 }
 
+void SkylineBinPack::Grow(int width, int height)
+{
+	assert(width >= binWidth);
+	assert(height >= binHeight);
+
+	if (width > binWidth)
+	{
+		SkylineNode node;
+		node.x = binWidth;
+		node.y = 0;
+		node.width = width - binWidth;
+		skyLine.push_back(node);
+	}
+	binWidth = width;
+	binHeight = height;
+	MergeSkylines();
+}
+
 Rect SkylineBinPack::Insert(int width, int height)
 {
 	return InsertBottomLeft(width, height);
 }
 
+bool SkylineBinPack::Restore(const std::vector<SkylineNode> &skyline, unsigned long usedArea)
+{
+	int x = 0;
+	for (size_t i = 0; i < skyline.size(); ++i)
+	{
+		if (skyline[i].x != x || skyline[i].width <= 0 || skyline[i].y < 0 || skyline[i].y > binHeight)
+			return false;
+		x += skyline[i].width;
+	}
+	if (x != binWidth || usedArea > (unsigned long)binWidth * binHeight)
+		return false;
+
+	skyLine = skyline;
+	usedSurfaceArea = usedArea;
+	return true;
+}
+
 float SkylineBinPack::Occupancy() const
 {
 	return (float)usedSurfaceArea / (binWidth * binHeight);
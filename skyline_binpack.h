@@ -33,16 +33,15 @@ public:
 	/// you need to restart with a new bin.
 	void Init(int binWidth, int binHeight);
 
+	/// Enlarges the bin to width x height units, keeping the rectangles inserted so far in place.
+	void Grow(int binWidth, int binHeight);
+
 	/// Inserts a single rectangle into the bin.
 	Rect Insert(int width, int height);
 
 	/// Computes the ratio of used surface area to the total bin area.
 	float Occupancy() const;
 
-private:
-	int binWidth;
-	int binHeight;
-
 	/// Represents a single level (a horizontal line) of the skyline/horizon/envelope.
 	struct SkylineNode
 	{
@@ -56,6 +55,18 @@ private:
 		int width;
 	};
 
+	/// The packer state, to restore it into a bin of the same size later.
+	const std::vector<SkylineNode> &Skyline() const { return skyLine; }
+	unsigned long UsedSurfaceArea() const { return usedSurfaceArea; }
+
+	/// Restores a saved state. Returns false, leaving the bin as it is, if the
+	/// levels don't span the bin from left to right within its height.
+	bool Restore(const std::vector<SkylineNode> &skyline, unsigned long usedArea);
+
+private:
+	int binWidth;
+	int binHeight;
+
 	std::vector<SkylineNode> skyLine;
 
 	unsigned long usedSurfaceArea;
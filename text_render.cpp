@@ -1,21 +1,35 @@
 #include "text_render.h"
-#include "scope_guard.h"
+#include "pixel_kernels.h"
 
 #include <glad/glad.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
-#include FT_OUTLINE_H
+#include FT_GLYPH_H
 
 #include <algorithm>
 #include <cstdlib>
 #include <cstdio>
+#include <cstddef>
+#include <cmath>
 
 //------------------------------------------------------------------------------
 
 static const char* vertex_shader_string = R"(
 #version 330 core
 layout (location = 0) in vec4 vertex; // <vec2 pos, vec2 tex>
+layout (location = 1) in float format;
+layout (location = 2) in float bold;
+layout (location = 3) in float soft;
+layout (location = 4) in vec4 color;
+layout (location = 5) in float layer;
+layout (location = 6) in float channel;
 out vec2 TexCoords;
+flat out float Layer;
+flat out int Channel;
+flat out float Format;
+flat out float Bold;
+flat out float Soft;
+flat out vec4 TextColor;
 
 uniform mat4 projection;
 
@@ -23,33 +37,234 @@ void main()
 {
     gl_Position = projection * vec4(vertex.xy, 0.0, 1.0);
     TexCoords = vertex.zw;
+    Layer = layer;
+    Channel = int(channel);
+    Format = format;
+    Bold = bold;
+    Soft = soft;
+    TextColor = color;
 }
 )";
 
 static const char* fragment_shader_string = R"(
 #version 330 core
 in vec2 TexCoords;
+flat in float Layer;
+flat in int Channel;
+flat in float Format;
+flat in float Bold;
+flat in float Soft;
+flat in vec4 TextColor;
 out vec4 color;
 
-uniform sampler2D text;
-uniform vec3 textColor;
+uniform sampler2DArray text;
+uniform sampler2DArray colorText;
+uniform sampler2DArray msdfText;
+
+// erf(x), within 5e-4 (Abramowitz & Stegun 7.1.27)
+vec2 erf2(vec2 x)
+{
+    vec2 a = abs(x);
+    vec2 t = 1.0 + (0.278393 + (0.230389 + (0.000972 + 0.078108 * a) * a) * a) * a;
+    t *= t;
+    return sign(x) * (1.0 - 1.0 / (t * t));
+}
 
 void main()
 {
-    vec4 sampled = vec4(1.0, 1.0, 1.0, texture(text, TexCoords).r);
-    color = vec4(textColor, 1.0) * sampled;
+    vec3 coords = vec3(TexCoords, Layer);
+    if (Format > 4.5)
+    {
+        // blurred underline shadow, a box convolved with a Gaussian of
+        // deviation Soft: TexCoords is the offset from the box centre, Layer
+        // and Bold the half size of the box
+        vec2 extent = vec2(Layer, Bold);
+        vec2 scale = vec2(1.0 / (Soft * 1.414214));
+        vec2 a = 0.5 * (erf2((extent + TexCoords) * scale) + erf2((extent - TexCoords) * scale));
+        color = vec4(TextColor.rgb, TextColor.a * a.x * a.y);
+        return;
+    }
+    if (Format > 3.5)
+    {
+        // shadow of a colour glyph, cast by its alpha
+        color = vec4(TextColor.rgb, TextColor.a * texture(colorText, coords).a);
+        return;
+    }
+    if (Format > 2.5)
+    {
+        // colour glyph, premultiplied RGBA from the colour atlas
+        vec4 c = texture(colorText, coords);
+        color = vec4(c.rgb / max(c.a, 1.0 / 255.0), c.a);
+        return;
+    }
+
+    float alpha;
+    if (Format > 1.5)
+    {
+        // multi-channel distance field, the median rebuilds sharp corners,
+        // bold moves the outline outwards
+        vec3 texel = texture(msdfText, coords).rgb;
+        float d = max(min(texel.r, texel.g), min(max(texel.r, texel.g), texel.b));
+        float w = max(max(fwidth(d), 1.0 / 255.0), Soft);
+        alpha = smoothstep(0.5 - Bold - w, 0.5 - Bold + w, d);
+    }
+    else if (Format > 0.5)
+    {
+        // signed distance field, the outline is at 0.5, shadows soften it
+        float d = texture(text, coords)[Channel];
+        float w = max(max(fwidth(d), 1.0 / 255.0), Soft);
+        alpha = smoothstep(0.5 - Bold - w, 0.5 - Bold + w, d);
+    }
+    else
+    {
+        alpha = texture(text, coords)[Channel];
+        if (Bold > 0.0)
+        {
+            // bold coverage is dilated by Bold texels, with a ring of eight
+            // taps per texel of radius (at least two)
+            vec2 radius = Bold / vec2(textureSize(text, 0).xy);
+            int rings = max(int(ceil(Bold)), 2);
+            for (int k = 1; k <= rings; k++)
+            {
+                for (int i = 0; i < 8; i++)
+                {
+                    vec2 offset = vec2(cos(i * 0.785398), sin(i * 0.785398)) * radius * (float(k) / float(rings));
+                    alpha = max(alpha, texture(text, vec3(TexCoords + offset, Layer))[Channel]);
+                }
+            }
+        }
+    }
+    vec4 sampled = vec4(1.0, 1.0, 1.0, alpha);
+    color = TextColor * sampled;
 }
 )";
 
-const int TextureAtlasWidth  = 1024;
-const int TextureAtlasHeight = 1024;
+// Value of Vertex::format for colour glyphs, next to the GlyphFormat values.
+const float ColorVertexFormat = 3.0f;
+// Values of Vertex::format for unblurred colour glyph shadows and blurred
+// underline shadows.
+const float ColorShadowVertexFormat = 4.0f;
+const float LineShadowVertexFormat = 5.0f;
+
+// Budget of the L2 bitmap cache, a few thousand compressed glyphs.
+const size_t DefaultBitmapCacheBytes = 4 * 1024 * 1024;
+
+// Time per idle frame spent on atlas compaction.
+const float DefaultCompactionBudgetMs = 1.0f;
+
+// Zoom mode rasterizes bitmap glyphs at sizes this many steps per doubling.
+const int ZoomBucketsPerOctave = 4;
+
+const unsigned int GlyphCacheMaxFaces = 8;
+const unsigned int GlyphCacheMaxSizes = 16;
+
+// Empty texels around the glyphs in the atlas, the texel bilinear filtering
+// reads beyond the quad edge of scaled glyphs. With every glyph padded,
+// texels between the regions are never sampled and atlases are cleared
+// without an upload. Bitmap glyphs of synthetic bold fonts get more, see
+// atlasPadding.
+const int GlyphPadding = 1;
+
+// Synthetic bold grows outlines by this fraction of the em on each side,
+// synthetic italic shears them by this factor.
+const float SyntheticBoldWeight = 0.015f;
+const float SyntheticItalicShear = 0.3f;
+// The fragment shader dilates bold bitmap glyphs with a ring of taps per
+// texel of radius, up to this many.
+const float MaxBoldRadius = 8.0f;
+
+// Whether the glyphs of font are dilated for synthetic bold, colour glyphs
+// and their shadows never are.
+static bool boldGlyphs(const Font& font)
+{
+    return font.synthesisBold() && !RasterParams::FromFont(font).color;
+}
+
+// Dilation of bitmap glyphs rasterized at charHeight for synthetic bold, in
+// texels.
+static float boldRadius(bool bold, FT_F26Dot6 charHeight)
+{
+    if (!bold)
+    {
+        return 0.0f;
+    }
+    float radius = SyntheticBoldWeight * charHeight / 64.0f * Font::getResolution() / 72.0f;
+    return std::min(radius, MaxBoldRadius);
+}
+
+static uint16_t atlasPadding(GlyphFormat format, float boldRadius)
+{
+    // the quad grows by the bold radius and the dilation samples as far
+    // again beyond it
+    if (format != GlyphFormat::Bitmap || boldRadius <= 0.0f)
+    {
+        return GlyphPadding;
+    }
+    return (uint16_t)std::max(GlyphPadding, (int)std::ceil(2 * boldRadius + 0.5f));
+}
 
 //------------------------------------------------------------------------------
 
 TextRender::TextRender()
-: vao_(0), vbo_(0), texReq_(0), texHit_(0), texEvict_(0), line_(Glyph{}),
-  maxQuadBatch_(0), curQuadBatch_(0), vertices_(nullptr), lastColor_(glm::vec3()), lastTexID_(0)
+: vao_(0),
+  vbo_(0),
+  texPageLimit_(),
+  maxTexSize_(0),
+  maxTexLayers_(0),
+  packChannels_(false),
+  atlasShadow_(AtlasShadow::Full),
+  atlasPacker_(AtlasPacker::Skyline),
+  texReq_(0),
+  texHit_(0),
+  texEvict_(0),
+  texEvictOnScreen_(0),
+  texKept_(0),
+  texCompactions_(0),
+  texGrows_(0),
+  texPagesAdded_(0),
+  texFreed_(0),
+  texDropped_(0),
+  snapshotGlyphs_(0),
+  classReq_(),
+  classHit_(),
+  classDropped_(),
+  pinOverflow_(0),
+  compactBudgetMs_(DefaultCompactionBudgetMs),
+  l2Hit_(0),
+  rasterized_(0),
+  texRescaled_(0),
+  frameRescaled_(0),
+  rasterBudget_(0),
+  asyncRaster_(false),
+  frames_(0),
+  frameBase_(0),
+  frameUploads_(0),
+  frameDrawCalls_(0),
+  maxFrameDrawCalls_(0),
+  totalDrawCalls_(0),
+  frameUploadCalls_(0),
+  maxFrameUploadCalls_(0),
+  totalUploadCalls_(0),
+  frameUploadBytes_(0),
+  maxFrameUploads_(0),
+  maxFrameUploadBytes_(0),
+  totalUploadBytes_(0),
+  maxRasterPerFrame_(32),
+  line_(Glyph{}),
+  coverageAdjust_(false),
+  zooming_(false),
+  maxQuadBatch_(0),
+  curQuadBatch_(0),
+  vertices_(nullptr),
+  baseLayer_(FillLayer),
+  curTexUnit_(0),
+  batchTexUnits_(0)
 {
+    bitmapCache_.SetMaxBytes(DefaultBitmapCacheBytes);
+    compaction_.TexIdx = -1;
+    compaction_.StartFrame = 0;
+    compaction_.Next = 0;
+    compaction_.NextStale = 0;
 }
 
 TextRender::~TextRender()
@@ -59,11 +274,25 @@ TextRender::~TextRender()
     free(vertices_);
 }
 
-bool TextRender::Init(int numTextureAtlas, int maxQuadBatch)
+bool TextRender::Init(int numTextureAtlas, int maxQuadBatch, unsigned long glyphCacheBytes,
+                      int numRasterThreads, bool packChannels)
 {
-    assert(numTextureAtlas > 0 && numTextureAtlas <= 16);
+    assert(numTextureAtlas > 0 && numTextureAtlas <= TextureAtlasMaxPages);
     assert(maxQuadBatch > 0 && maxQuadBatch <= 1024);
 
+    if (!fontCache_.Init(GlyphCacheMaxFaces, GlyphCacheMaxSizes, glyphCacheBytes))
+    {
+        return false;
+    }
+    // without raster threads new glyphs are rasterized on the render thread,
+    // but one worker still replaces the glyphs of resized fonts and
+    // regenerates evicted MSDF glyphs
+    asyncRaster_ = numRasterThreads > 0;
+    if (!rasterPool_.Init(std::max(1, numRasterThreads), &fontCache_))
+    {
+        return false;
+    }
+
     std::string errorLog;
     if (!shader_.Init(vertex_shader_string, fragment_shader_string, errorLog))
     {
@@ -74,30 +303,47 @@ bool TextRender::Init(int numTextureAtlas, int maxQuadBatch)
     glGenBuffers(1, &vbo_);
     glBindVertexArray(vao_);
     glBindBuffer(GL_ARRAY_BUFFER, vbo_);
-    glBufferData(GL_ARRAY_BUFFER, maxQuadBatch * sizeof(float) * 6 * 4, NULL, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, maxQuadBatch * sizeof(Vertex) * 6, NULL, GL_DYNAMIC_DRAW);
     glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), 0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, format));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, bold));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, soft));
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, r));
+    glEnableVertexAttribArray(5);
+    glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, layer));
+    glEnableVertexAttribArray(6);
+    glVertexAttribPointer(6, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, channel));
     glBindVertexArray(0);
 
-    for (int i = 0; i < numTextureAtlas; i++)
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize_);
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxTexLayers_);
+    packChannels_ = packChannels;
+    if (!uploadBuffer_.Init())
     {
-        std::unique_ptr<TextureAtlas> t(new TextureAtlas);
-        if (!t->Init(TextureAtlasWidth, TextureAtlasHeight))
-        {
-            return false;
-        }
-        tex_.push_back(std::move(t));
-        texGen_.push_back(0);
+        return false;
+    }
+    for (int unit = 0; unit < NumTexUnits; unit++)
+    {
+        texPageLimit_[unit] = std::min(numTextureAtlas, maxTexLayers_);
+    }
+    if (newTextureAtlas(1) < 0)
+    {
+        return false;
     }
-
     line_.TexIdx = -1;
 
     maxQuadBatch_ = maxQuadBatch;
-    vertices_ = (float*)malloc(maxQuadBatch_ * sizeof(float) * 6 * 4);
+    vertices_ = (Vertex*)malloc(maxQuadBatch_ * sizeof(Vertex) * 6);
     if (vertices_ == nullptr)
     {
         return false;
     }
+    batchSources_.resize(maxQuadBatch_);
 
     return true;
 }
@@ -115,96 +361,215 @@ void TextRender::Begin(int fbWidth, int fbHeight)
 
     glBindVertexArray(vao_);
 
+    glUniform1i(shader_.GetUniformLocation("text"), 0);
+    glUniform1i(shader_.GetUniformLocation("colorText"), 1);
+    glUniform1i(shader_.GetUniformLocation("msdfText"), 2);
     glActiveTexture(GL_TEXTURE0);
+
+    rasterBudget_ = maxRasterPerFrame_;
+    frameRescaled_ = 0;
+    frameUploads_ = 0;
+    frameUploadBytes_ = 0;
+    frameDrawCalls_ = 0;
+    frameUploadCalls_ = 0;
+    collectRasterResults();
 }
 
 void TextRender::DrawText(TextRun &text, 
                           float x, 
                           float y, 
-                          glm::vec3 color)
+                          glm::vec3 color,
+                          const TextEffects &effects)
 {
-    setTextColor(color);
+    Font &font = text.GetFont();
+    bool stroked = effects.StrokeWidth > 0.0f;
+    bool shadowed = effects.ShadowColor.a > 0.0f;
+    // bitmap glyphs get stroke and blur variants rasterized at the font size
+    FT_F26Dot6 bitmapStroke = stroked ? (FT_F26Dot6)(effects.StrokeWidth * 64.0f + 0.5f) : 0;
+    int bitmapBlur = shadowed ? (int)(effects.ShadowBlur + 0.5f) : 0;
+    float fieldStroke = stroked ? effects.StrokeWidth : 0.0f;
+    glm::vec4 fillColor(color, 1.0f);
+    glm::vec4 strokeColor(effects.StrokeColor, 1.0f);
+
+    // One pass over the run. Quads of the lowest layer go straight into the
+    // batch, the upper layers follow once the run is done, so strokes and
+    // shadows never cover the neighbouring glyphs.
+    baseLayer_ = shadowed ? ShadowLayer : stroked ? StrokeLayer : FillLayer;
+
+    // the underline shadow is one quad under the whole run, so the blur is
+    // continuous
+    float line_x = x;
+    float line_y = y + font.getUnderlinePos();
 
-    // Iterate over each glyph.
     size_t glyph_count = text.GetGlyphCount();
     for (size_t i = 0; i < glyph_count; i++)
     {
         TextRun::GlyphInfo info;
         text.GetGlyph(i, info);
 
-        Glyph g;
-        if (!getGlyph(text.GetFont(), info.glyphid, g))
+        // glyphs without ink (e.g. spaces) need no atlas lookup at all
+        Font::GlyphMetrics metrics;
+        bool blank = font.MetricsReady() &&
+                     font.GetGlyphMetrics(info.glyphid, metrics) &&
+                     (metrics.xMin >= metrics.xMax || metrics.yMin >= metrics.yMax);
+
+        Glyph g = Glyph{};
+        if (!blank && !getGlyph(font, info.glyphid, 0, 0, g))
         {
-            // TODO: error log
-            break;
+            // no image or no atlas room: leave a gap and go on with the run
+            texDropped_++;
+            g = Glyph{};
         }
 
         if (g.Size.x > 0 && g.Size.y > 0)
         {
             TextureAtlas *t = tex_[g.TexIdx].get();
-            setTexID(t->TextureID());
-
-            float glyph_x = x + g.Bearing.x + info.x_offset;
-            float glyph_y = y - (g.Size.y - g.Bearing.y) + info.y_offset;
-            float glyph_w = (float)g.Size.x;
-            float glyph_h = (float)g.Size.y;
-
-            float tex_x = g.TexOffset.x / (float)t->Width();
-            float tex_y = g.TexOffset.y / (float)t->Height();
-            float tex_w = glyph_w / (float)t->Width();
-            float tex_h = glyph_h / (float)t->Height();
-
-            // update VBO for each glyph
-            float vertices[6][4] = {
-                { glyph_x,           glyph_y + glyph_h, tex_x,         tex_y         },
-                { glyph_x,           glyph_y,           tex_x,         tex_y + tex_h },
-                { glyph_x + glyph_w, glyph_y,           tex_x + tex_w, tex_y + tex_h },
-
-                { glyph_x,           glyph_y + glyph_h, tex_x,         tex_y         },
-                { glyph_x + glyph_w, glyph_y,           tex_x + tex_w, tex_y + tex_h },
-                { glyph_x + glyph_w, glyph_y + glyph_h, tex_x + tex_w, tex_y         }
-            };
-            appendQuad(vertices);
-        }
-
-        if (text.Underline())
-        {
-            setupLineGlyph();
-            
-            TextureAtlas *t = tex_[line_.TexIdx].get();
-            setTexID(t->TextureID());
-            float tex_x = (line_.TexOffset.x+1) / (float)t->Width();
-            float tex_y = (line_.TexOffset.y+1) / (float)t->Height();
-            float tex_w = (line_.Size.x-2) / (float)t->Width();
-            float tex_h = (line_.Size.y-2) / (float)t->Height();
+            bool color_glyph = (t->Channels() == 4);
+            float glyph_x = x + info.x_offset;
+            float glyph_y = y + info.y_offset;
+            Vertex vertices[6];
+
+            // distance fields are stroked and blurred by the fragment shader,
+            // bitmaps by drawing their stroke and blur variants
+            if (shadowed && color_glyph)
+            {
+                // cast by the alpha of the glyph: unblurred by the shader, else
+                // by its blurred variant, a coverage glyph
+                Glyph sg = g;
+                if (bitmapBlur == 0 || getGlyph(font, info.glyphid, 0, bitmapBlur, sg))
+                {
+                    if (sg.Size.x > 0 && sg.Size.y > 0)
+                    {
+                        glyphQuad(font, sg, glyph_x + effects.ShadowOffset.x, glyph_y + effects.ShadowOffset.y,
+                                  0.0f, 0.0f, effects.ShadowColor, vertices);
+                        if (bitmapBlur == 0)
+                        {
+                            for (int k = 0; k < 6; k++)
+                                vertices[k].format = ColorShadowVertexFormat;
+                        }
+                        pushQuad(ShadowLayer, sg, vertices);
+                    }
+                }
+            }
+            else if (shadowed)
+            {
+                Glyph sg = g;
+                if (g.Format != GlyphFormat::Bitmap ||
+                    getGlyph(font, info.glyphid, bitmapStroke, bitmapBlur, sg))
+                {
+                    if (sg.Size.x > 0 && sg.Size.y > 0)
+                    {
+                        bool field = (sg.Format != GlyphFormat::Bitmap);
+                        glyphQuad(font, sg, glyph_x + effects.ShadowOffset.x, glyph_y + effects.ShadowOffset.y,
+                                  field ? fieldStroke : 0.0f, field ? effects.ShadowBlur : 0.0f,
+                                  effects.ShadowColor, vertices);
+                        pushQuad(ShadowLayer, sg, vertices);
+                    }
+                }
+            }
+            if (stroked && !color_glyph)
+            {
+                Glyph sg = g;
+                if (g.Format != GlyphFormat::Bitmap ||
+                    getGlyph(font, info.glyphid, bitmapStroke, 0, sg))
+                {
+                    if (sg.Size.x > 0 && sg.Size.y > 0)
+                    {
+                        glyphQuad(font, sg, glyph_x, glyph_y,
+                                  (sg.Format == GlyphFormat::Bitmap) ? 0.0f : fieldStroke, 0.0f,
+                                  strokeColor, vertices);
+                        pushQuad(StrokeLayer, sg, vertices);
+                    }
+                }
+            }
+
+            // adding the variants may have evicted the atlas of the glyph
+            if (!isResident(g) && !getGlyph(font, info.glyphid, 0, 0, g))
+            {
+                g = Glyph{};
+            }
+            if (g.Size.x > 0 && g.Size.y > 0)
+            {
+                glyphQuad(font, g, glyph_x, glyph_y, 0.0f, 0.0f, fillColor, vertices);
+                pushQuad(FillLayer, g, vertices);
+            }
+        }
+
+        if (text.Underline() && setupLineGlyph())
+        {
 
             float x0 = x;
-            float y0 = y + text.GetFont().getUnderlinePos();
+            float y0 = y + font.getUnderlinePos();
             float w0 = info.x_advance;
-            float h0 = text.GetFont().getUnderlineThickness();
-
-            float vertices[6][4] = {
-                { x0,      y0 + h0, tex_x,         tex_y         },
-                { x0,      y0,      tex_x,         tex_y + tex_h },
-                { x0 + w0, y0,      tex_x + tex_w, tex_y + tex_h },
-
-                { x0,      y0 + h0, tex_x,         tex_y         },
-                { x0 + w0, y0,      tex_x + tex_w, tex_y + tex_h },
-                { x0 + w0, y0 + h0, tex_x + tex_w, tex_y         }
-            };
-            appendQuad(vertices);
+            float h0 = font.getUnderlineThickness();
+            float s = effects.StrokeWidth;
+
+            Vertex vertices[6];
+            if (stroked)
+            {
+                lineQuad(x0 - s, y0 - s, w0 + 2 * s, h0 + 2 * s, strokeColor, vertices);
+                pushQuad(StrokeLayer, line_, vertices);
+            }
+            lineQuad(x0, y0, w0, h0, fillColor, vertices);
+            pushQuad(FillLayer, line_, vertices);
         }
 
         // advance cursors for next glyph
         x += info.x_advance;
         y += info.y_advance;
     }
+
+    if (text.Underline() && shadowed && x > line_x && setupLineGlyph())
+    {
+        float s = effects.StrokeWidth;
+        Vertex vertices[6];
+        lineShadowQuad(line_x - s + effects.ShadowOffset.x, line_y - s + effects.ShadowOffset.y,
+                       x - line_x + 2 * s, font.getUnderlineThickness() + 2 * s, effects.ShadowBlur * 0.5f,
+                       effects.ShadowColor, vertices);
+        pushQuad(ShadowLayer, line_, vertices);
+    }
+
+    flushLayers();
+}
+
+void TextRender::flushLayers()
+{
+    for (int layer = baseLayer_ + 1; layer < NumLayers; layer++)
+    {
+        std::vector<LayerQuad> &quads = layerQuads_[layer];
+        for (size_t i = 0; i < quads.size(); i++)
+        {
+            const LayerQuad &q = quads[i];
+            if (q.Source.TexGen != texGen_[q.Source.TexIdx])
+            {
+                // the page was released since, see releasePinnedAtlas
+                continue;
+            }
+            setTexture(tex_[q.Source.TexIdx].get());
+            appendQuad(q.Source, q.Vertices);
+        }
+        quads.clear();
+    }
 }
 
 void TextRender::End()
 {
     commitDraw();
 
+    // frames adding nothing to the atlases have time to compact them
+    if (frameUploads_ == 0)
+    {
+        compact();
+    }
+    // glyphs added after the last draw and compacted pages
+    flushUploads();
+
+    frames_++;
+    maxFrameUploads_ = std::max(maxFrameUploads_, frameUploads_);
+    maxFrameUploadBytes_ = std::max(maxFrameUploadBytes_, frameUploadBytes_);
+    maxFrameDrawCalls_ = std::max(maxFrameDrawCalls_, frameDrawCalls_);
+    maxFrameUploadCalls_ = std::max(maxFrameUploadCalls_, frameUploadCalls_);
+
     glBindVertexArray(0);
 
     shader_.Use(false);
@@ -214,73 +579,481 @@ void TextRender::PrintStats()
 {
     fprintf(stdout, "\n");
     fprintf(stdout, "----glyph texture cache stats----\n");
-    fprintf(stdout, "texture atlas size: %d %d\n", TextureAtlasWidth, TextureAtlasHeight);
-    fprintf(stdout, "texture atlas count: %d\n", (int)tex_.size());
+    int arrays = 0;
+    size_t texBytes = 0;
+    fprintf(stdout, "texture atlas size:");
+    for (int unit = 0; unit < NumTexUnits; unit++)
+    {
+        const TextureArray *a = texArrays_[unit].get();
+        if (a != nullptr)
+        {
+            const char *format = (unit == texUnit(4)) ? " %d(rgba)" : (unit == texUnit(3)) ? " %d(rgb)" :
+                                 packChannels_ ? " %d(packed)" : " %d";
+            fprintf(stdout, format, a->Width());
+            arrays++;
+            texBytes += (size_t)a->Width() * a->Height() * a->Layers() * a->Channels();
+        }
+    }
+    fprintf(stdout, "\n");
+    fprintf(stdout, "texture atlas count: %d (layers of %d texture arrays, %zu bytes)\n", (int)tex_.size(), arrays,
+            texBytes);
+    size_t shadowBytes = 0, fullShadowBytes = 0;
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        shadowBytes += tex_[i]->ShadowBytes();
+        fullShadowBytes += tex_[i]->FullShadowBytes();
+    }
+    const char *shadows[] = { "full", "compressed", "none" };
+    fprintf(stdout, "texture atlas shadow: %s, %zu bytes (full %zu bytes, saved %.1f%%)\n",
+            shadows[(int)atlasShadow_], shadowBytes, fullShadowBytes,
+            fullShadowBytes ? 100.0 - 100.0 * shadowBytes / fullShadowBytes : 0.0);
+    if (snapshotGlyphs_ > 0)
+    {
+        fprintf(stdout, "texture atlas snapshot: %zu glyphs loaded\n", snapshotGlyphs_);
+    }
+    if (atlasPacker_ == AtlasPacker::Shelf)
+    {
+        int shelves = 0;
+        for (size_t i = 0; i < tex_.size(); i++)
+        {
+            shelves += tex_[i]->Shelves();
+        }
+        fprintf(stdout, "texture atlas packer: shelf, %d shelves\n", shelves);
+    }
+    fprintf(stdout, "texture atlas grow: %llu (pages added on thrashing %llu)\n", (unsigned long long)texGrows_,
+            (unsigned long long)texPagesAdded_);
     fprintf(stdout, "texture atlas occupancy:");
     for (size_t i = 0; i < tex_.size(); i++)
     {
         float rate = tex_[i].get()->Occupancy() * 100.f;
-        fprintf(stdout, " %.1f%%", rate);
+        int channels = tex_[i]->Channels();
+        if (tex_[i]->Packed())
+            fprintf(stdout, " %.1f%%(%d.%c)", rate, tex_[i]->Layer(), "rgba"[tex_[i]->Plane()]);
+        else
+            fprintf(stdout, (channels == 4) ? " %.1f%%(rgba)" : (channels == 3) ? " %.1f%%(rgb)" : " %.1f%%", rate);
     }
     fprintf(stdout, "\n");
-    fprintf(stdout, "texture atlas evict: %llu\n", texEvict_);
-    fprintf(stdout, "request: %llu\n", texReq_);
-    fprintf(stdout, "hit    : %llu (%.2f%%)\n", texHit_, (double)texHit_ / texReq_ * 100);
+    fprintf(stdout, "texture atlas evict: %llu (on screen %llu, glyphs kept %llu, glyphs freed %llu)\n",
+            (unsigned long long)texEvict_, (unsigned long long)texEvictOnScreen_, (unsigned long long)texKept_,
+            (unsigned long long)texFreed_);
+    fprintf(stdout, "texture atlas compaction: %llu\n", (unsigned long long)texCompactions_);
+    int pinnedPages = (int)std::count(texPinned_.begin(), texPinned_.end(), true);
+    int sparePages = (int)std::count(texSpare_.begin(), texSpare_.end(), true);
+    fprintf(stdout, "texture atlas pinned pages: %d, given back %d (pinned glyphs without reserved room %llu)\n",
+            pinnedPages, sparePages, (unsigned long long)pinOverflow_);
+    size_t resident[NumGlyphPriorities] = {};
+    for (GlyphCache::iterator iter = glyphs_.begin(); iter != glyphs_.end(); ++iter)
+    {
+        if (iter->second.TexIdx >= 0 && isResident(iter->second))
+            resident[(int)iter->second.Priority]++;
+    }
+    const char *priorities[] = { "normal", "pinned", "transient" };
+    for (int p = 0; p < NumGlyphPriorities; p++)
+    {
+        fprintf(stdout, "glyph priority %s: %zu resident, %llu requests (%.2f%% hit), %llu evicted\n",
+                priorities[p], resident[p], (unsigned long long)classReq_[p],
+                classReq_[p] ? (double)classHit_[p] / classReq_[p] * 100 : 0.0,
+                (unsigned long long)classDropped_[p]);
+    }
+    fprintf(stdout, "request: %llu\n", (unsigned long long)texReq_);
+    fprintf(stdout, "hit    : %llu (%.2f%%)\n", (unsigned long long)texHit_, (double)texHit_ / texReq_ * 100);
+    fprintf(stdout, "L1 (atlas) hit / L2 (bitmap) hit / rasterized: %llu / %llu / %llu\n",
+            (unsigned long long)texHit_, (unsigned long long)l2Hit_, (unsigned long long)rasterized_);
+    fprintf(stdout, "L2 bitmap cache: %zu glyphs, %zu / %zu bytes\n",
+            bitmapCache_.Count(), bitmapCache_.Bytes(), bitmapCache_.MaxBytes());
+    uint64_t frames = frames_ - frameBase_;
+    fprintf(stdout, "atlas upload per frame: avg %.1f bytes, max %d glyphs / %zu bytes\n",
+            frames > 0 ? (double)totalUploadBytes_ / frames : 0.0, maxFrameUploads_, maxFrameUploadBytes_);
+    fprintf(stdout, "draw calls per frame: avg %.1f, max %d\n",
+            frames > 0 ? (double)totalDrawCalls_ / frames : 0.0, maxFrameDrawCalls_);
+    fprintf(stdout, "atlas upload calls per frame: avg %.1f, max %d\n",
+            frames > 0 ? (double)totalUploadCalls_ / frames : 0.0, maxFrameUploadCalls_);
+    fprintf(stdout, "rescaled draw: %llu\n", (unsigned long long)texRescaled_);
+    fprintf(stdout, "dropped glyphs: %llu\n", (unsigned long long)texDropped_);
+    size_t sdfGlyphs = 0, msdfGlyphs = 0, strokeGlyphs = 0, blurGlyphs = 0;
+    for (GlyphCache::iterator iter = glyphs_.begin(); iter != glyphs_.end(); ++iter)
+    {
+        if (iter->first.StrokeWidth > 0)
+            strokeGlyphs++;
+        if (iter->first.BlurRadius > 0)
+            blurGlyphs++;
+        if (iter->second.Format == GlyphFormat::SDF)
+            sdfGlyphs++;
+        else if (iter->second.Format == GlyphFormat::MSDF)
+            msdfGlyphs++;
+    }
+    fprintf(stdout, "glyph bitmap / sdf / msdf: %zu / %zu / %zu (stroked %zu, blurred %zu)\n",
+            glyphs_.size() - sdfGlyphs - msdfGlyphs, sdfGlyphs, msdfGlyphs, strokeGlyphs, blurGlyphs);
+    fprintf(stdout, "glyph image cache budget: %lu bytes\n", fontCache_.MaxBytes());
+    fprintf(stdout, "glyph image cache lookup: %llu\n", (unsigned long long)fontCache_.Lookups());
     fprintf(stdout, "\n");
 }
 
-bool TextRender::getGlyph(Font& font, unsigned int glyph_index, Glyph& x)
+void TextRender::Prewarm(Font& font, const std::vector<uint32_t>& codepoints)
 {
-    GlyphKey key = GlyphKey{ font.getID(), glyph_index };
-    GlyphCache::iterator iter = glyphs_.find(key);
-    if (iter != glyphs_.end())
+    std::vector<unsigned int> glyphs;
+    glyphs.reserve(codepoints.size());
+    for (size_t i = 0; i < codepoints.size(); i++)
     {
-        x = iter->second;
-        if (x.TexIdx < 0)
+        FT_UInt glyph_index = FT_Get_Char_Index(font.getFTFont(), codepoints[i]);
+        if (glyph_index)
         {
-            return true;
+            glyphs.push_back(glyph_index);
+        }
+    }
+    PrewarmGlyphs(font, glyphs);
+}
+
+void TextRender::PrewarmGlyphs(Font& font, const std::vector<unsigned int>& glyphs)
+{
+    std::vector<RasterPool::Request> requests;
+    for (size_t i = 0; i < glyphs.size(); i++)
+    {
+        GlyphKey key = glyphKey(font, glyphs[i], 0, 0);
+        if (isCached(key) || rasterPending_.count(key))
+        {
+            continue;
+        }
+        Glyph g;
+        if (readmitGlyph(key, boldGlyphs(font), g))
+        {
+            continue;
+        }
+        if (!asyncRaster_)
+        {
+            getGlyph(font, glyphs[i], 0, 0, g);
+            continue;
+        }
+        rasterPending_[key] = boldGlyphs(font);
+        requests.push_back(rasterRequest(font, glyphs[i], key));
+    }
+    rasterPool_.Submit(requests);
+}
+
+void TextRender::SetFontPriority(Font& font, GlyphPriority priority)
+{
+    fontPriority_[font.getHash()] = priority;
+    updatePriorities(font.getHash());
+}
+
+void TextRender::SetGlyphPriority(Font& font, const std::vector<unsigned int>& glyphs, GlyphPriority priority)
+{
+    for (size_t i = 0; i < glyphs.size(); i++)
+    {
+        glyphPriority_[std::make_pair(font.getHash(), glyphs[i])] = priority;
+    }
+    updatePriorities(font.getHash());
+}
+
+void TextRender::updatePriorities(uint64_t faceID)
+{
+    GlyphKey first = GlyphKey{};
+    first.FaceID = faceID;
+    GlyphCache::iterator iter = glyphs_.lower_bound(first);
+    while (iter != glyphs_.end() && iter->first.FaceID == faceID)
+    {
+        Glyph &g = iter->second;
+        GlyphPriority priority = glyphPriority(iter->first);
+        if (g.Priority != priority && g.TexIdx >= 0 &&
+            (g.Priority == GlyphPriority::Pinned || priority == GlyphPriority::Pinned))
+        {
+            // on the wrong pages, added again on next use. A region left
+            // behind on a reserved atlas is reclaimed by compacting it,
+            // nothing else does there
+            if (!freeGlyph(g) && texPinned_[g.TexIdx])
+            {
+                texStale_[g.TexIdx] = true;
+            }
+            iter = eraseGlyph(iter);
+            continue;
+        }
+        if (g.Priority != priority)
+        {
+            // into the eviction list of its priority
+            unlinkGlyph(g);
+            g.Priority = priority;
+            linkGlyph(iter);
+        }
+        ++iter;
+    }
+
+    // reserved pages left without glyphs are given back
+    std::vector<bool> used(tex_.size(), false);
+    for (iter = glyphs_.begin(); iter != glyphs_.end(); ++iter)
+    {
+        if (iter->second.TexIdx >= 0 && isResident(iter->second))
+        {
+            used[iter->second.TexIdx] = true;
+        }
+    }
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        if (texPinned_[i] && !used[i])
+        {
+            releasePinnedAtlas(i);
         }
-        else if (x.TexGen == texGen_[x.TexIdx])  // check texture atlas generation
+    }
+}
+
+void TextRender::effectiveCoverageLUT(uint8_t lut[256]) const
+{
+    for (int i = 0; i < 256; i++)
+    {
+        lut[i] = coverageAdjust_ ? coverageLUT_[i] : (uint8_t)i;
+    }
+}
+
+bool TextRender::getGlyph(Font& font, unsigned int glyph_index, FT_F26Dot6 strokeWidth, int blurRadius,
+                          Glyph& x)
+{
+    GlyphKey key = glyphKey(font, glyph_index, strokeWidth, blurRadius);
+    RasterParams params = rasterParams(font, key);
+    GlyphCache::iterator iter = glyphs_.find(key);
+    if (iter != glyphs_.end() && isCached(key) &&
+        iter->second.Pad < atlasPadding(iter->second.Format, boldRadius(boldGlyphs(font), key.CharHeight)))
+    {
+        // stored for a regular style of the face, without room for the bold
+        // dilation; stored again with more padding
+        freeGlyph(iter->second);
+        eraseGlyph(iter);
+        iter = glyphs_.end();
+    }
+    if (iter != glyphs_.end() && isCached(key))
+    {
+        touchGlyph(iter);
+        x = iter->second;
+        if (x.TexIdx >= 0)
         {
             texReq_++;
             texHit_++;
+            classReq_[(int)x.Priority]++;
+            classHit_[(int)x.Priority]++;
+        }
+        return true;
+    }
+    if (readmitGlyph(key, boldGlyphs(font), x))
+    {
+        return true;
+    }
+
+    if (params.format == GlyphFormat::Bitmap && font.getPrevCharHeight() != 0)
+    {
+        // the font was resized, keep using another size of the glyph until the
+        // worker threads delivered the new one, swapped in by
+        // collectRasterResults. Fonts never resized get the requested size
+        // right away rather than a blurry stand-in.
+        if (findOtherSize(key, x))
+        {
+            if (!rasterPending_.count(key) && rasterBudget_ > 0)
+            {
+                rasterBudget_--;
+                requestGlyph(font, glyph_index, key);
+            }
+            if (x.TexIdx >= 0)
+            {
+                texReq_++;
+                texHit_++;
+                classReq_[(int)x.Priority]++;
+                classHit_[(int)x.Priority]++;
+            }
             return true;
         }
     }
+    else if (params.format == GlyphFormat::MSDF && (asyncRaster_ || iter != glyphs_.end()))
+    {
+        // too slow to generate on the render thread, the glyph is left out
+        // until a worker thread delivered it. Without raster threads new
+        // glyphs are still generated here, so the first frame is complete.
+        requestGlyph(font, glyph_index, key);
+        x = Glyph{};
+        return true;
+    }
+
+    GlyphBitmap bitmap;
+    if (params.color)
+    {
+        // colour layers and bitmaps are not in the FreeType cache, render them
+        // from the font's own face
+        if (!RasterizeColorGlyph(font.getFTFont(), glyph_index, font.getCharHeight(), bitmap, params.blurRadius))
+        {
+            return false;
+        }
+        rasterized_++;
+        return storeGlyph(key, bitmap, false, x);
+    }
+
+    // load glyph, the outline comes from the FreeType cache
+    FT_Glyph glyph;
+    if (!fontCache_.LoadGlyph(font, glyph_index, RasterLoadFlags(params), glyph))
+    {
+        return false;
+    }
+    if (!RasterizeGlyph(glyph, params, bitmap))
+    {
+        return false;
+    }
+    rasterized_++;
+    return storeGlyph(key, bitmap, boldGlyphs(font), x);
+}
+
+TextRender::GlyphKey TextRender::glyphKey(Font& font, unsigned int glyph_index, FT_F26Dot6 strokeWidth,
+                                          int blurRadius)
+{
+    RasterParams params = RasterParams::FromFont(font);
+    // only outline bitmaps have stroke and blur variants, colour glyphs the
+    // blurred shadow
+    if (params.format != GlyphFormat::Bitmap)
+    {
+        blurRadius = 0;
+    }
+    if (params.format != GlyphFormat::Bitmap || params.color)
+    {
+        strokeWidth = 0;
+    }
+    FT_F26Dot6 charHeight = RasterCharHeight(params, font.getCharHeight());
+    if (params.format == GlyphFormat::Bitmap && !params.color)
+    {
+        charHeight = bitmapCharHeight(font);
+    }
+    return GlyphKey{ font.getHash(), glyph_index, font.getVarKey(), params.format, strokeWidth, blurRadius,
+                     charHeight };
+}
+
+FT_F26Dot6 TextRender::bitmapCharHeight(const Font& font) const
+{
+    FT_F26Dot6 charHeight = font.getCharHeight();
+    if (!zooming_ || charHeight <= 0)
+    {
+        return charHeight;
+    }
+    // the bucket at or above the size, so glyphs are only ever minified (by
+    // up to one bucket step), which bilinear filtering handles without mips
+    float steps = std::ceil(std::log2((float)charHeight) * ZoomBucketsPerOctave - 0.001f);
+    return (FT_F26Dot6)std::lround(std::exp2(steps / ZoomBucketsPerOctave));
+}
 
-    // load glyph
-    FT_Face face = font.getFTFont();
-    if (FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT))
+bool TextRender::isCached(const GlyphKey &key)
+{
+    GlyphCache::iterator iter = glyphs_.find(key);
+    if (iter == glyphs_.end())
     {
         return false;
     }
-    if (font.synthesisItalic())
+    return isResident(iter->second);
+}
+
+bool TextRender::isResident(const Glyph &g) const
+{
+    return g.TexIdx < 0 || g.TexGen == texGen_[g.TexIdx];  // check texture atlas generation
+}
+
+GlyphPriority TextRender::glyphPriority(const GlyphKey &key) const
+{
+    std::map<std::pair<uint64_t, unsigned int>, GlyphPriority>::const_iterator glyph =
+        glyphPriority_.find(std::make_pair(key.FaceID, key.GlyphIndex));
+    if (glyph != glyphPriority_.end())
+    {
+        return glyph->second;
+    }
+    std::map<uint64_t, GlyphPriority>::const_iterator font = fontPriority_.find(key.FaceID);
+    return (font != fontPriority_.end()) ? font->second : GlyphPriority::Normal;
+}
+
+bool TextRender::readmitGlyph(const GlyphKey &key, bool bold, Glyph& x)
+{
+    GlyphBitmap bitmap;
+    if (!bitmapCache_.Find(key, bitmap))
     {
-        // horizontal shear
-        FT_Matrix matrix;
-        matrix.xx = 0x10000L;
-        matrix.xy = (FT_Fixed)(0.3 * 0x10000L);
-        matrix.yx = 0;
-        matrix.yy = 0x10000L;
-        FT_Outline_Transform(&face->glyph->outline, &matrix);
+        return false;
     }
-    if (font.synthesisBold())
+    l2Hit_++;
+    return storeGlyph(key, bitmap, bold, x);
+}
+
+bool TextRender::findOtherSize(const GlyphKey &key, Glyph& x)
+{
+    GlyphKey first = key;
+    first.CharHeight = 0;
+    GlyphCache::iterator best = glyphs_.end();
+    FT_F26Dot6 bestDiff = 0;
+    GlyphCache::iterator iter = glyphs_.lower_bound(first);
+    while (iter != glyphs_.end() && iter->first.sameGlyph(key))
     {
-        FT_Outline_Embolden(&face->glyph->outline, (FT_Pos)(font.getSize() * 0.04 * 64));
+        const Glyph &g = iter->second;
+        if (!isResident(g))
+        {
+            // evicted from the atlas, drop it on the way
+            iter = eraseGlyph(iter);
+            continue;
+        }
+        FT_F26Dot6 diff = std::abs(g.CharHeight - key.CharHeight);
+        if (best == glyphs_.end() || diff < bestDiff)
+        {
+            best = iter;
+            bestDiff = diff;
+        }
+        ++iter;
     }
-    if (FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL))
+    if (best == glyphs_.end())
     {
         return false;
     }
+    touchGlyph(best);
+    x = best->second;
+    return true;
+}
+
+RasterParams TextRender::rasterParams(Font& font, const GlyphKey &key)
+{
+    RasterParams params = RasterParams::FromFont(font, key.StrokeWidth, key.BlurRadius);
+    params.coverageLUT = coverageAdjust_ ? coverageLUT_ : nullptr;
+    if (params.format == GlyphFormat::Bitmap && !params.color && key.CharHeight != font.getCharHeight())
+    {
+        // zoom bucket
+        params.bucketCharHeight = key.CharHeight;
+    }
+    return params;
+}
+
+RasterPool::Request TextRender::rasterRequest(Font& font, unsigned int glyph_index, const GlyphKey &key)
+{
+    return RasterPool::Request{ &font, glyph_index, key.FaceID, key.VarKey, key.CharHeight,
+                                rasterParams(font, key) };
+}
+
+void TextRender::SetCoverageAdjust(float gamma, float contrast)
+{
+    // the workers read the table
+    rasterPool_.WaitIdle();
+    coverageAdjust_ = (gamma != 1.0f || contrast != 1.0f);
+    BuildCoverageLUT(gamma, contrast, coverageLUT_);
+}
+
+void TextRender::requestGlyph(Font& font, unsigned int glyph_index, const GlyphKey &key)
+{
+    if (!rasterPending_.count(key))
+    {
+        rasterPending_[key] = boldGlyphs(font);
+        rasterPool_.Submit(std::vector<RasterPool::Request>(1, rasterRequest(font, glyph_index, key)));
+    }
+}
 
+bool TextRender::storeGlyph(const GlyphKey &key, const GlyphBitmap &bitmap, bool bold, Glyph& x)
+{
+    GlyphPriority priority = glyphPriority(key);
     int texIdx = -1;
     unsigned int texGen = 0;
     uint16_t texOffsetX = 0, texOffsetY = 0;
-    if (face->glyph->bitmap.width > 0 && face->glyph->bitmap.rows > 0)
+    // colour glyphs are never emboldened
+    uint16_t pad = atlasPadding(bitmap.Format, boldRadius(bold && bitmap.Channels != 4, key.CharHeight));
+    if (bitmap.Width > 0 && bitmap.Rows > 0)
     {
-        if (!addToTextureAtlas(face->glyph->bitmap.width, 
-                               face->glyph->bitmap.rows, 
-                               face->glyph->bitmap.buffer, 
+        if (!addToTextureAtlas(bitmap.Width, 
+                               bitmap.Rows, 
+                               bitmap.Channels,
+                               bitmap.Pixels.data(), 
+                               pad,
+                               priority,
                                texIdx,
                                texGen,
                                texOffsetX, 
@@ -290,24 +1063,67 @@ bool TextRender::getGlyph(Font& font, unsigned int glyph_index, Glyph& x)
         }
 
         texReq_++;
+        classReq_[(int)priority]++;
+        // transient glyphs are not worth the budget
+        if (priority != GlyphPriority::Transient)
+        {
+            bitmapCache_.Insert(key, bitmap);
+        }
     }
 
     // now store Glyph for later use
     x = Glyph {
-        glm::ivec2(face->glyph->bitmap.width, face->glyph->bitmap.rows),
-        glm::ivec2(face->glyph->bitmap_left, face->glyph->bitmap_top),
+        glm::ivec2(bitmap.Width, bitmap.Rows),
+        glm::ivec2(bitmap.Left, bitmap.Top),
         glm::ivec2(texOffsetX, texOffsetY),
         texIdx,
-        texGen
+        texGen,
+        key.CharHeight,
+        bitmap.Scale,
+        bitmap.Format,
+        frames_,
+        priority,
+        pad,
+        0
     };
-    glyphs_[key] = x;
+    GlyphCache::iterator iter = glyphs_.insert(std::make_pair(key, x)).first;
+    unlinkGlyph(iter->second);
+    iter->second = x;
+    linkGlyph(iter);
 
     return true;
 }
 
+void TextRender::collectRasterResults()
+{
+    std::vector<RasterPool::Result> results;
+    rasterPool_.Collect(results);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const RasterPool::Result &r = results[i];
+        bool bold = false;
+        std::map<GlyphKey, bool>::iterator pending = rasterPending_.find(
+            GlyphKey{ r.faceID, r.glyphIndex, r.requestVarKey, r.format, r.strokeWidth, r.blurRadius,
+                      r.requestCharHeight });
+        if (pending != rasterPending_.end())
+        {
+            bold = pending->second;
+            rasterPending_.erase(pending);
+        }
+        if (r.ok)
+        {
+            rasterized_++;
+            Glyph g;
+            storeGlyph(GlyphKey{ r.faceID, r.glyphIndex, r.varKey, r.format, r.strokeWidth, r.blurRadius,
+                                r.charHeight }, r.bitmap, bold, g);
+        }
+    }
+}
+
 bool TextRender::setupLineGlyph()
 {
-    if (line_.TexIdx >= 0 && line_.TexGen == texGen_[line_.TexIdx])
+    line_.LastUse = frames_;
+    if (line_.TexIdx >= 0 && isResident(line_))
     {
         return true;
     }
@@ -319,7 +1135,7 @@ bool TextRender::setupLineGlyph()
         255, 255, 255, 255,
     };
     uint16_t tex_x, tex_y;
-    if (addToTextureAtlas(4, 4, data, line_.TexIdx, line_.TexGen, tex_x, tex_y))
+    if (addToTextureAtlas(4, 4, 1, data, 0, GlyphPriority::Normal, line_.TexIdx, line_.TexGen, tex_x, tex_y))
     {
         line_.Size.x = 4;
         line_.Size.y = 4;
@@ -331,31 +1147,297 @@ bool TextRender::setupLineGlyph()
     return false;
 }
 
-bool TextRender::addToTextureAtlas(uint16_t width, uint16_t height, const uint8_t *data, 
-                                   int &tex_idx, unsigned int &tex_gen, uint16_t &tex_x, uint16_t &tex_y)
+int TextRender::texUnit(int channels)
+{
+    switch (channels)
+    {
+    case 3:
+        return 2;
+    case 4:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int TextRender::arrayChannels(int channels) const
+{
+    return (channels == 1 && packChannels_) ? 4 : channels;
+}
+
+int TextRender::arrayLayers(int channels, int pages) const
+{
+    int planes = arrayChannels(channels) / channels;
+    return (pages + planes - 1) / planes;
+}
+
+int TextRender::newTextureAtlas(int channels)
 {
     for (size_t i = 0; i < tex_.size(); i++)
     {
-        TextureAtlas *t = tex_[i].get();
-        if (t->AddRegion(width, height, data, tex_x, tex_y))
+        if (texSpare_[i] && tex_[i]->Channels() == channels)
         {
-            tex_idx = (unsigned int)i;
-            tex_gen = texGen_[i];
-            return true;
+            texSpare_[i] = false;
+            return (int)i;
         }
     }
 
-    // evict a random choosed one
-    size_t index = (size_t)rand() % tex_.size();
-    TextureAtlas *tex = tex_[index].get();
-    // clear contents
-    tex->Clear();
-    // increment generation
-    texGen_[index]++;
-    texEvict_++;
+    // the atlases of a channel count are the layers (or the channels of the
+    // layers) of one texture array, created along with the first of them
+    // with room for the pages up to the limit
+    std::unique_ptr<TextureArray> &array = texArrays_[texUnit(channels)];
+    if (!array)
+    {
+        int size = (channels == 4) ? ColorTextureAtlasInitialSize : TextureAtlasInitialSize;
+        std::unique_ptr<TextureArray> a(new TextureArray);
+        if (!a->Init(size, size, arrayLayers(channels, texPageLimit_[texUnit(channels)]), arrayChannels(channels)))
+        {
+            return -1;
+        }
+        array = std::move(a);
+    }
 
-    // retry
-    if (tex->AddRegion(width, height, data, tex_x, tex_y))
+    int page = 0;
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        page += (tex_[i]->Channels() == channels) ? 1 : 0;
+    }
+    int planes = arrayChannels(channels) / channels;
+    int layer = page / planes;
+    std::unique_ptr<TextureAtlas> t(new TextureAtlas);
+    if (layer >= array->Layers() ||
+        !(planes > 1 ? t->InitPlane(*array, layer, page % planes, atlasShadow_, atlasPacker_) :
+                       t->Init(*array, layer, atlasShadow_, atlasPacker_)))
+    {
+        return -1;
+    }
+    tex_.push_back(std::move(t));
+    texGen_.push_back(0);
+    texFull_.push_back(false);
+    texPinned_.push_back(false);
+    texStale_.push_back(false);
+    texSpare_.push_back(false);
+    return (int)(tex_.size() - 1);
+}
+
+bool TextRender::resizeTextureArray(int channels, int size, int layers)
+{
+    int unit = texUnit(channels);
+    int oldSize = texArrays_[unit]->Width();
+    std::unique_ptr<TextureArray> array(new TextureArray);
+    if (!array->Init(size, size, layers, arrayChannels(channels)))
+    {
+        return false;
+    }
+
+    // everything that can fail comes first, so the pages are either all
+    // moved or all left on the former array
+    bool reserved = true;
+    for (size_t i = 0; i < tex_.size() && reserved; i++)
+    {
+        if (tex_[i]->Channels() == channels)
+        {
+            reserved = tex_[i]->ReserveResize(array->Width(), array->Height());
+        }
+    }
+    if (!reserved)
+    {
+        for (size_t i = 0; i < tex_.size(); i++)
+        {
+            tex_[i]->CancelResize();
+        }
+        return false;
+    }
+
+    if (size != oldSize)
+    {
+        // quads drawn so far have texture coordinates of the former size:
+        // draw the batch, rescale those of upper layers
+        commitDraw();
+        float scale = (float)oldSize / size;
+        for (int layer = 0; layer < NumLayers; layer++)
+        {
+            for (size_t i = 0; i < layerQuads_[layer].size(); i++)
+            {
+                LayerQuad &q = layerQuads_[layer][i];
+                if (tex_[q.Source.TexIdx]->Channels() != channels)
+                    continue;
+                for (int v = 0; v < 6; v++)
+                {
+                    q.Vertices[v].u *= scale;
+                    q.Vertices[v].v *= scale;
+                }
+            }
+        }
+    }
+
+    // copy the texels on the GPU and move the pages over
+    array->CopyFrom(*texArrays_[unit]);
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        if (tex_[i]->Channels() != channels)
+        {
+            continue;
+        }
+        if ((int)i == compaction_.TexIdx)
+        {
+            cancelCompaction();
+        }
+        // reserved above, can't fail
+        tex_[i]->Resize(*array);
+        if (size != oldSize)
+        {
+            texFull_[i] = false;
+        }
+    }
+    texArrays_[unit] = std::move(array);
+    return true;
+}
+
+bool TextRender::raisePageLimit(int channels)
+{
+    int unit = texUnit(channels);
+    int layers = arrayLayers(channels, texPageLimit_[unit] + 1);
+    if (layers > maxTexLayers_ || texPageLimit_[unit] >= TextureAtlasMaxPages)
+    {
+        return false;
+    }
+    // a layer for the page unless channel-packed layers have room, an array
+    // not created yet gets it along
+    if (texArrays_[unit] && layers != texArrays_[unit]->Layers() &&
+        !resizeTextureArray(channels, texArrays_[unit]->Width(), layers))
+    {
+        return false;
+    }
+    texPageLimit_[unit]++;
+    return true;
+}
+
+bool TextRender::addToTextureAtlas(uint16_t width, uint16_t height, int channels, const uint8_t *data, 
+                                   uint16_t padding, GlyphPriority priority, int &tex_idx, unsigned int &tex_gen,
+                                   uint16_t &tex_x, uint16_t &tex_y)
+{
+    size_t bytes = (width + 2 * padding) * (height + 2 * padding) * arrayChannels(channels);
+    frameUploads_++;
+    frameUploadBytes_ += bytes;
+    totalUploadBytes_ += bytes;
+
+    if (priority == GlyphPriority::Pinned)
+    {
+        if (addPinnedGlyph(width, height, channels, data, padding, tex_idx, tex_gen, tex_x, tex_y))
+        {
+            return true;
+        }
+        // no room to reserve, placed among the others and kept through
+        // their evictions
+        pinOverflow_++;
+    }
+
+    std::vector<size_t> candidates;
+    int pinnedPages = 0;
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        TextureAtlas *t = tex_[i].get();
+        if (t->Channels() != channels || texSpare_[i])
+        {
+            continue;
+        }
+        if (texPinned_[i])
+        {
+            pinnedPages++;
+            continue;
+        }
+        if ((int)i != compaction_.TexIdx && t->AddRegion(width, height, data, tex_x, tex_y, padding))
+        {
+            tex_idx = (unsigned int)i;
+            tex_gen = texGen_[i];
+            return true;
+        }
+        if ((int)i != compaction_.TexIdx)
+        {
+            texFull_[i] = true;
+        }
+        candidates.push_back(i);
+    }
+
+    // create another atlas with these channels while below the limit, the
+    // reserved ones come on top of it
+    int unit = texUnit(channels);
+    if ((int)candidates.size() + pinnedPages < texPageLimit_[unit])
+    {
+        int index = newTextureAtlas(channels);
+        if (index >= 0 && tex_[index]->AddRegion(width, height, data, tex_x, tex_y, padding))
+        {
+            tex_idx = index;
+            tex_gen = texGen_[index];
+            return true;
+        }
+    }
+    if (candidates.empty())
+    {
+        return false;
+    }
+
+    // then double the size of the atlases, their glyphs stay in place
+    int size = texArrays_[unit]->Width();
+    int maxSize = std::min(maxTexSize_, (channels == 4) ? ColorTextureAtlasMaxSize : TextureAtlasMaxSize);
+    if (size * 2 <= maxSize && resizeTextureArray(channels, size * 2, texArrays_[unit]->Layers()))
+    {
+        texGrows_++;
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if (tex_[candidates[i]]->AddRegion(width, height, data, tex_x, tex_y, padding))
+            {
+                tex_idx = (int)candidates[i];
+                tex_gen = texGen_[candidates[i]];
+                return true;
+            }
+            texFull_[candidates[i]] = true;
+        }
+    }
+
+    // evictions thrash at full size: add a page
+    if (texEvictions_[unit].Thrashing(frames_) && raisePageLimit(channels))
+    {
+        texPagesAdded_++;
+        texEvictions_[unit] = EvictionHistory();
+        int index = newTextureAtlas(channels);
+        if (index >= 0 && tex_[index]->AddRegion(width, height, data, tex_x, tex_y, padding))
+        {
+            tex_idx = index;
+            tex_gen = texGen_[index];
+            return true;
+        }
+    }
+
+    // make room where cold glyphs were
+    if (atlasPacker_ == AtlasPacker::Shelf &&
+        evictGlyphs(candidates, width, height, channels, data, padding, tex_idx, tex_gen, tex_x, tex_y))
+    {
+        return true;
+    }
+
+    // the atlas being compacted may still have room
+    if (std::find(candidates.begin(), candidates.end(), (size_t)compaction_.TexIdx) != candidates.end())
+    {
+        size_t index = compaction_.TexIdx;
+        cancelCompaction();
+        if (tex_[index]->AddRegion(width, height, data, tex_x, tex_y, padding))
+        {
+            tex_idx = (int)index;
+            tex_gen = texGen_[index];
+            return true;
+        }
+        texFull_[index] = true;
+    }
+
+    // retry in the least recently used one, then put back its glyphs on
+    // screen
+    std::vector<KeptGlyph> kept;
+    size_t index = evictTextureAtlas(candidates, kept);
+    bool added = tex_[index]->AddRegion(width, height, data, tex_x, tex_y, padding);
+    restoreGlyphs(index, kept);
+    if (added)
     {
         tex_idx = index;
         tex_gen = texGen_[index];
@@ -365,32 +1447,646 @@ bool TextRender::addToTextureAtlas(uint16_t width, uint16_t height, const uint8_
     return false;
 }
 
-void TextRender::setTextColor(glm::vec3 color)
+bool TextRender::addPinnedGlyph(uint16_t width, uint16_t height, int channels, const uint8_t *data,
+                                uint16_t padding, int &tex_idx, unsigned int &tex_gen, uint16_t &tex_x, uint16_t &tex_y)
 {
-    if (lastColor_ != color)
-        commitDraw();
+    // no regions are added while compacting, the reserved atlas is
+    // compacted again later
+    if (compaction_.TexIdx >= 0 && texPinned_[compaction_.TexIdx])
+    {
+        cancelCompaction();
+    }
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        if (texPinned_[i] && tex_[i]->Channels() == channels &&
+            tex_[i]->AddRegion(width, height, data, tex_x, tex_y, padding))
+        {
+            tex_idx = (int)i;
+            tex_gen = texGen_[i];
+            return true;
+        }
+    }
+
+    // reserve another page beyond the limit, a layer is cheaper than
+    // doubling the size of all of them
+    if (raisePageLimit(channels))
+    {
+        int index = newTextureAtlas(channels);
+        if (index >= 0)
+        {
+            texPinned_[index] = true;
+            if (tex_[index]->AddRegion(width, height, data, tex_x, tex_y, padding))
+            {
+                tex_idx = index;
+                tex_gen = texGen_[index];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void TextRender::releasePinnedAtlas(size_t index)
+{
+    // quads of the dropped glyphs may still be in the batch
+    if (compaction_.TexIdx == (int)index)
+    {
+        cancelCompaction();
+    }
+    commitDraw();
+    tex_[index]->Clear();
+    texGen_[index]++;
+    texFull_[index] = false;
+    texPinned_[index] = false;
+    texStale_[index] = false;
+
+    // the next atlas of its channel count takes its layer, the limit goes
+    // back to where it was before it was reserved
+    texSpare_[index] = true;
+    texPageLimit_[texUnit(tex_[index]->Channels())]--;
+}
 
-    glUniform3f(shader_.GetUniformLocation("textColor"), color.x, color.y, color.z);
-    lastColor_ = color;
+bool TextRender::freeGlyph(const Glyph &g)
+{
+    // quads of glyphs on screen may still sample the region, it is
+    // reclaimed with the page then
+    if (atlasPacker_ != AtlasPacker::Shelf || g.TexIdx < 0 || g.Size.x <= 0 || g.Size.y <= 0 ||
+        g.TexIdx == compaction_.TexIdx || !isResident(g) || KeepOnEviction(g.LastUse, frames_))
+    {
+        return false;
+    }
+    return tex_[g.TexIdx]->FreeRegion(g.TexOffset.x, g.TexOffset.y, g.Pad);
 }
 
-void TextRender::setTexID(unsigned int texID)
+int TextRender::lruList(const Glyph &g) const
 {
-    if (texID != lastTexID_)
-        commitDraw();
+    // pinned glyphs are never freed, those of the skyline packer can't be
+    if (atlasPacker_ != AtlasPacker::Shelf || g.TexIdx < 0 || g.Size.x <= 0 || g.Size.y <= 0 ||
+        g.Priority == GlyphPriority::Pinned)
+    {
+        return -1;
+    }
+    int classIndex = ShelfClassHeight(g.Size.y + 2 * g.Pad) / ShelfHeightStep;
+    int unit = texUnit(tex_[g.TexIdx]->Channels());
+    return (classIndex * NumTexUnits + unit) * 2 + (g.Priority == GlyphPriority::Transient ? 1 : 0);
+}
+
+void TextRender::linkGlyph(GlyphCache::iterator iter)
+{
+    Glyph &g = iter->second;
+    int list = lruList(g);
+    if (g.Lru != 0 || list < 0)
+    {
+        return;
+    }
+    if ((size_t)list >= lruLists_.size())
+    {
+        lruLists_.resize(list + 1, LruList{ 0, 0 });
+    }
+    if (lruNodes_.empty())
+    {
+        lruNodes_.push_back(LruNode{ glyphs_.end(), -1, 0, 0 });
+    }
+    int node;
+    if (!freeLruNodes_.empty())
+    {
+        node = freeLruNodes_.back();
+        freeLruNodes_.pop_back();
+    }
+    else
+    {
+        node = (int)lruNodes_.size();
+        lruNodes_.push_back(LruNode{});
+    }
+
+    // after the glyphs drawn no later, at the end unless the priority of an
+    // older one changed
+    LruList &l = lruLists_[list];
+    int prev = l.Last;
+    while (prev != 0 && lruNodes_[prev].Entry->second.LastUse > g.LastUse)
+    {
+        prev = lruNodes_[prev].Prev;
+    }
+    int next = (prev != 0) ? lruNodes_[prev].Next : l.First;
+    lruNodes_[node] = LruNode{ iter, list, prev, next };
+    if (prev != 0)
+        lruNodes_[prev].Next = node;
+    else
+        l.First = node;
+    if (next != 0)
+        lruNodes_[next].Prev = node;
+    else
+        l.Last = node;
+    g.Lru = node;
+}
+
+void TextRender::unlinkGlyph(Glyph &g)
+{
+    if (g.Lru == 0)
+    {
+        return;
+    }
+    const LruNode &n = lruNodes_[g.Lru];
+    LruList &l = lruLists_[n.List];
+    if (n.Prev != 0)
+        lruNodes_[n.Prev].Next = n.Next;
+    else
+        l.First = n.Next;
+    if (n.Next != 0)
+        lruNodes_[n.Next].Prev = n.Prev;
+    else
+        l.Last = n.Prev;
+    freeLruNodes_.push_back(g.Lru);
+    g.Lru = 0;
+}
 
-    glBindTexture(GL_TEXTURE_2D, texID);
-    lastTexID_ = texID;
+void TextRender::touchGlyph(GlyphCache::iterator iter)
+{
+    Glyph &g = iter->second;
+    g.LastUse = frames_;
+    if (g.Lru != 0 && lruNodes_[g.Lru].Next != 0)
+    {
+        unlinkGlyph(g);
+        linkGlyph(iter);
+    }
 }
 
-void TextRender::appendQuad(float vertices[6][4])
+TextRender::GlyphCache::iterator TextRender::eraseGlyph(GlyphCache::iterator iter)
+{
+    unlinkGlyph(iter->second);
+    return glyphs_.erase(iter);
+}
+
+void TextRender::clearGlyphs()
+{
+    glyphs_.clear();
+    lruNodes_.clear();
+    freeLruNodes_.clear();
+    lruLists_.clear();
+}
+
+bool TextRender::evictGlyphs(const std::vector<size_t> &candidates, uint16_t width, uint16_t height, int channels,
+                             const uint8_t *data, uint16_t padding, int &tex_idx, unsigned int &tex_gen,
+                             uint16_t &tex_x, uint16_t &tex_y)
+{
+    // no freed slot gets wider than a page
+    if (width + 2 * padding > tex_[candidates[0]]->Width())
+    {
+        return false;
+    }
+
+    // only the shelves of its height class take the glyph. Their transient
+    // glyphs go first, then the least recently used; once the first left is
+    // on screen, or drawn recently and so churning rather than lying dead,
+    // so are all after it and the page eviction takes over
+    int classIndex = ShelfClassHeight(height + 2 * padding) / ShelfHeightStep;
+    int base = (classIndex * NumTexUnits + texUnit(channels)) * 2;
+    for (int transient = 1; transient >= 0; transient--)
+    {
+        int node = ((size_t)(base + transient) < lruLists_.size()) ? lruLists_[base + transient].First : 0;
+        while (node != 0)
+        {
+            GlyphCache::iterator iter = lruNodes_[node].Entry;
+            Glyph &g = iter->second;
+            node = lruNodes_[node].Next;
+            if (!isResident(g))
+            {
+                // evicted with its atlas, drop it on the way
+                eraseGlyph(iter);
+                continue;
+            }
+            bool recent = transient ? KeepOnEviction(g.LastUse, frames_) :
+                                      (g.LastUse + EvictionRecentFrames > frames_);
+            if (recent)
+            {
+                break;
+            }
+            // the atlas being compacted keeps its glyphs
+            int index = g.TexIdx;
+            if (!freeGlyph(g))
+            {
+                continue;
+            }
+            classDropped_[(int)g.Priority]++;
+            texFreed_++;
+            eraseGlyph(iter);
+            if (tex_[index]->AddRegion(width, height, data, tex_x, tex_y, padding))
+            {
+                tex_idx = index;
+                tex_gen = texGen_[index];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+size_t TextRender::evictTextureAtlas(const std::vector<size_t> &candidates, std::vector<KeptGlyph> &kept)
+{
+    std::vector<AtlasPageUse> pages(candidates.size(), AtlasPageUse{});
+    std::vector<int> position(tex_.size(), -1);
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        pages[i].Page = candidates[i];
+        position[candidates[i]] = (int)i;
+    }
+    auto count = [&](const Glyph &g)
+    {
+        if (g.TexIdx < 0 || position[g.TexIdx] < 0)
+        {
+            return;
+        }
+        AtlasPageUse &page = pages[position[g.TexIdx]];
+        page.LastUse = std::max(page.LastUse, g.LastUse);
+        if (g.LastUse + EvictionRecentFrames > frames_ && g.Priority != GlyphPriority::Transient)
+            page.RecentGlyphs++;
+        if (g.LastUse == frames_)
+            page.FrameGlyphs++;
+    };
+
+    // sum up the frame stamps of the glyphs per atlas, dropping the glyphs of
+    // atlases evicted before on the way
+    GlyphCache::iterator iter = glyphs_.begin();
+    while (iter != glyphs_.end())
+    {
+        if (!isResident(iter->second))
+        {
+            iter = eraseGlyph(iter);
+            continue;
+        }
+        count(iter->second);
+        ++iter;
+    }
+    if (isResident(line_))
+    {
+        count(line_);
+    }
+
+    const AtlasPageUse &victim = pages[ChooseEvictionPage(pages, frames_, EvictionPolicy::LeastRecentlyUsed)];
+    size_t index = victim.Page;
+    TextureAtlas *t = tex_[index].get();
+    if (victim.LastUse == frames_)
+    {
+        // every atlas is on screen: the glyphs drawn from it are kept and the
+        // quads not drawn yet follow them, see retargetQuads. The page is
+        // complete on the GPU until the batch is drawn, in case it must be
+        // drawn from the former layout.
+        int calls = t->Flush(uploadBuffer_);
+        frameUploadCalls_ += calls;
+        totalUploadCalls_ += calls;
+        texEvictOnScreen_++;
+    }
+    // without a shadow the kept glyphs are moved on the GPU, not read back
+    bool moved = t->BeginMove();
+    size_t pinnedArea = 0;
+    size_t maxPinnedArea = (size_t)(PinOverflowMaxKept * t->Width() * t->Height());
+    for (GlyphCache::iterator iter = glyphs_.begin(); iter != glyphs_.end(); ++iter)
+    {
+        const Glyph &g = iter->second;
+        if (g.TexIdx != (int)index || g.Size.x <= 0 || g.Size.y <= 0)
+        {
+            continue;
+        }
+        // pinned glyphs off screen only up to a share of the page, or they
+        // could fill it for good
+        size_t area = (size_t)(g.Size.x + 2 * g.Pad) * (g.Size.y + 2 * g.Pad);
+        bool pinnedOnly = !KeepOnEviction(g.LastUse, frames_);
+        if (!KeepOnEviction(g.LastUse, frames_, g.Priority) ||
+            (pinnedOnly && pinnedArea + area > maxPinnedArea))
+        {
+            classDropped_[(int)g.Priority]++;
+            continue;
+        }
+        if (pinnedOnly)
+        {
+            pinnedArea += area;
+        }
+        KeptGlyph k;
+        k.Entry = &iter->second;
+        if (!moved)
+        {
+            k.Pixels.resize((size_t)g.Size.x * g.Size.y * t->Channels());
+            t->ReadRegion(g.TexOffset.x, g.TexOffset.y, g.Size.x, g.Size.y, k.Pixels.data());
+        }
+        kept.push_back(std::move(k));
+    }
+    // so are underlines drawn in this frame
+    if (line_.TexIdx == (int)index && isResident(line_) && line_.LastUse == frames_)
+    {
+        KeptGlyph k;
+        k.Entry = &line_;
+        if (!moved)
+        {
+            k.Pixels.resize((size_t)line_.Size.x * line_.Size.y * t->Channels());
+            t->ReadRegion(line_.TexOffset.x, line_.TexOffset.y, line_.Size.x, line_.Size.y, k.Pixels.data());
+        }
+        kept.push_back(std::move(k));
+    }
+
+    t->Clear();
+    texGen_[index]++;
+    texFull_[index] = false;
+    texEvict_++;
+    texEvictions_[texUnit(t->Channels())].Add(frames_);
+    return index;
+}
+
+void TextRender::restoreGlyphs(size_t index, std::vector<KeptGlyph> &kept)
+{
+    TextureAtlas *t = tex_[index].get();
+
+    // the glyphs of quads not drawn yet go back first, the page may not hold
+    // all glyphs on screen. Those of held back quads before those of the
+    // batch, which can still be drawn from the former layout.
+    unsigned int gen = texGen_[index] - 1;
+    std::map<uint32_t, int> pending;   // Rank by offset, y << 16 | x
+    for (int i = 0; i < curQuadBatch_; i++)
+    {
+        const QuadSource &source = batchSources_[i];
+        if (source.TexIdx == (int)index && source.TexGen == gen)
+            pending[(uint32_t)source.TexOffset.y << 16 | (uint32_t)source.TexOffset.x] = 1;
+    }
+    for (int layer = 0; layer < NumLayers; layer++)
+    {
+        for (const LayerQuad &q : layerQuads_[layer])
+        {
+            if (q.Source.TexIdx == (int)index && q.Source.TexGen == gen)
+                pending[(uint32_t)q.Source.TexOffset.y << 16 | (uint32_t)q.Source.TexOffset.x] = 0;
+        }
+    }
+    auto rank = [&](const KeptGlyph &k)
+    {
+        auto p = pending.find((uint32_t)k.Entry->TexOffset.y << 16 | (uint32_t)k.Entry->TexOffset.x);
+        return (p != pending.end()) ? p->second : 2;
+    };
+    std::stable_sort(kept.begin(), kept.end(), [&](const KeptGlyph &a, const KeptGlyph &b) {
+        return rank(a) < rank(b);
+    });
+
+    std::map<uint32_t, glm::ivec2> moved;  // New offsets by former ones, y << 16 | x
+    for (size_t i = 0; i < kept.size(); i++)
+    {
+        Glyph &g = *kept[i].Entry;
+        uint16_t pad = g.Pad;
+        uint16_t x, y;
+        bool added = kept[i].Pixels.empty() ?
+                     t->MoveRegion(g.TexOffset.x, g.TexOffset.y, g.Size.x, g.Size.y, x, y, pad) :
+                     t->AddRegion(g.Size.x, g.Size.y, kept[i].Pixels.data(), x, y, pad);
+        if (!added)
+        {
+            // no room left, evicted after all
+            classDropped_[(int)g.Priority]++;
+            continue;
+        }
+        moved[(uint32_t)g.TexOffset.y << 16 | (uint32_t)g.TexOffset.x] = glm::ivec2(x, y);
+        g.TexOffset = glm::ivec2(x, y);
+        g.TexGen = texGen_[index];
+        texKept_++;
+
+        size_t bytes = (g.Size.x + 2 * pad) * (g.Size.y + 2 * pad) * t->Channels();
+        frameUploads_++;
+        frameUploadBytes_ += bytes;
+        totalUploadBytes_ += bytes;
+    }
+    retargetQuads(index, moved);
+}
+
+bool TextRender::followsGlyph(const QuadSource &source, const Vertex vertices[6], size_t index,
+                              const std::map<uint32_t, glm::ivec2> &moved) const
+{
+    // line shadows don't sample the atlas, their texture coordinates are
+    // positions in the quad
+    return source.TexIdx != (int)index || source.TexGen != texGen_[index] - 1 ||
+           vertices[0].format == LineShadowVertexFormat ||
+           moved.count((uint32_t)source.TexOffset.y << 16 | (uint32_t)source.TexOffset.x) != 0;
+}
+
+void TextRender::retargetQuad(QuadSource &source, Vertex vertices[6], size_t index,
+                              const std::map<uint32_t, glm::ivec2> &moved)
+{
+    if (source.TexIdx != (int)index || source.TexGen != texGen_[index] - 1)
+    {
+        return;
+    }
+    source.TexGen = texGen_[index];
+    if (vertices[0].format == LineShadowVertexFormat)
+    {
+        return;
+    }
+    glm::ivec2 to = moved.at((uint32_t)source.TexOffset.y << 16 | (uint32_t)source.TexOffset.x);
+    const TextureAtlas *t = tex_[index].get();
+    float du = (to.x - source.TexOffset.x) / (float)t->Width();
+    float dv = (to.y - source.TexOffset.y) / (float)t->Height();
+    for (int v = 0; v < 6; v++)
+    {
+        vertices[v].u += du;
+        vertices[v].v += dv;
+    }
+    source.TexOffset = to;
+}
+
+void TextRender::retargetQuads(size_t index, const std::map<uint32_t, glm::ivec2> &moved)
+{
+    // the quads not drawn yet follow their glyphs to where they were put
+    // back, the page is uploaded right before the batch is drawn
+    bool follow = true;
+    for (int i = 0; i < curQuadBatch_ && follow; i++)
+    {
+        follow = followsGlyph(batchSources_[i], vertices_ + i * 6, index, moved);
+    }
+    if (follow)
+    {
+        for (int i = 0; i < curQuadBatch_; i++)
+        {
+            retargetQuad(batchSources_[i], vertices_ + i * 6, index, moved);
+        }
+    }
+    else
+    {
+        // glyphs of the batch didn't fit the page again: it is drawn from the
+        // page as it was, still on the GPU until the new one is uploaded
+        flushUploads((int)index);
+        drawBatch();
+    }
+
+    // held back quads of glyphs evicted after all are dropped, those glyphs
+    // were the first put back
+    for (int layer = 0; layer < NumLayers; layer++)
+    {
+        std::vector<LayerQuad> &quads = layerQuads_[layer];
+        quads.erase(std::remove_if(quads.begin(), quads.end(), [&](const LayerQuad &q) {
+            return !followsGlyph(q.Source, q.Vertices, index, moved);
+        }), quads.end());
+        for (size_t i = 0; i < quads.size(); i++)
+        {
+            retargetQuad(quads[i].Source, quads[i].Vertices, index, moved);
+        }
+    }
+}
+
+void TextRender::glyphQuad(Font& font, const Glyph& g, float x, float y, float fieldStroke, float fieldBlur,
+                           glm::vec4 color, Vertex vertices[6])
+{
+    const TextureAtlas *t = tex_[g.TexIdx].get();
+    bool color_glyph = (t->Channels() == 4);
+
+    // distance fields are always drawn scaled, a bitmap glyph only if it
+    // was rasterized for a zoom bucket or another font size; the latter is
+    // a stand-in until the right size is rasterized
+    float scale = g.Scale;
+    if (g.CharHeight != font.getCharHeight())
+    {
+        scale *= font.getCharHeight() / (float)g.CharHeight;
+        FT_F26Dot6 wanted = color_glyph ? font.getCharHeight() : bitmapCharHeight(font);
+        if (g.Format == GlyphFormat::Bitmap && g.CharHeight != wanted)
+        {
+            texRescaled_++;
+            frameRescaled_++;
+        }
+    }
+    float format = color_glyph ? ColorVertexFormat : (float)g.Format;
+    float layer = (float)t->Layer();
+    float channel = (float)t->Plane();
+
+    // synthetic styles are applied here, so all styles of a face share
+    // the same glyphs: italic shears the quad, bold is dilated by the
+    // fragment shader (into the padding of bitmap glyphs)
+    float bold = 0.0f;
+    float grow = 0.0f;
+    int spread = (g.Format == GlyphFormat::SDF) ? SDFSpread : MSDFSpread;
+    if (boldGlyphs(font) && !color_glyph)
+    {
+        if (g.Format == GlyphFormat::Bitmap)
+        {
+            // at most what the padding of the glyph leaves room for
+            bold = grow = std::min(boldRadius(true, g.CharHeight), (g.Pad - 0.5f) / 2);
+        }
+        else
+        {
+            float radius = SyntheticBoldWeight * g.CharHeight / 64.0f * Font::getResolution() / 72.0f;
+            bold = radius / (2.0f * spread);
+        }
+    }
+    if (fieldStroke > 0.0f && g.Format != GlyphFormat::Bitmap)
+    {
+        // the stroke of a distance field is another iso line, which must stay
+        // inside the spread
+        float texels = std::min(fieldStroke / scale, spread - 1.0f);
+        bold = std::min(bold + texels / (2.0f * spread), 0.5f - 0.5f / spread);
+    }
+    float soft = 0.0f;
+    if (fieldBlur > 0.0f && g.Format != GlyphFormat::Bitmap)
+    {
+        // blurred edges are a wider ramp across the iso line
+        soft = std::min(fieldBlur / scale / (2.0f * spread), 0.5f);
+    }
+    float shear = font.synthesisItalic() ? SyntheticItalicShear : 0.0f;
+
+    float glyph_x = x + (g.Bearing.x - grow) * scale;
+    float glyph_y = y - (g.Size.y - g.Bearing.y + grow) * scale;
+    float glyph_w = (g.Size.x + 2 * grow) * scale;
+    float glyph_h = (g.Size.y + 2 * grow) * scale;
+
+    // horizontal offsets of the bottom and top edge, relative to the baseline
+    float shear_b = shear * (glyph_y - y);
+    float shear_t = shear_b + shear * glyph_h;
+
+    float tex_x = (g.TexOffset.x - grow) / (float)t->Width();
+    float tex_y = (g.TexOffset.y - grow) / (float)t->Height();
+    float tex_w = (g.Size.x + 2 * grow) / (float)t->Width();
+    float tex_h = (g.Size.y + 2 * grow) / (float)t->Height();
+
+    const float r = color.r, gr = color.g, b = color.b, a = color.a;
+    vertices[0] = { glyph_x + shear_t,           glyph_y + glyph_h, tex_x,         tex_y,         layer, channel, format, bold, soft, r, gr, b, a };
+    vertices[1] = { glyph_x + shear_b,           glyph_y,           tex_x,         tex_y + tex_h, layer, channel, format, bold, soft, r, gr, b, a };
+    vertices[2] = { glyph_x + glyph_w + shear_b, glyph_y,           tex_x + tex_w, tex_y + tex_h, layer, channel, format, bold, soft, r, gr, b, a };
+
+    vertices[3] = { glyph_x + shear_t,           glyph_y + glyph_h, tex_x,         tex_y,         layer, channel, format, bold, soft, r, gr, b, a };
+    vertices[4] = { glyph_x + glyph_w + shear_b, glyph_y,           tex_x + tex_w, tex_y + tex_h, layer, channel, format, bold, soft, r, gr, b, a };
+    vertices[5] = { glyph_x + glyph_w + shear_t, glyph_y + glyph_h, tex_x + tex_w, tex_y,         layer, channel, format, bold, soft, r, gr, b, a };
+}
+
+void TextRender::lineQuad(float x, float y, float w, float h, glm::vec4 color, Vertex vertices[6])
+{
+    const TextureAtlas *t = tex_[line_.TexIdx].get();
+    float tex_x = (line_.TexOffset.x+1) / (float)t->Width();
+    float tex_y = (line_.TexOffset.y+1) / (float)t->Height();
+    float tex_w = (line_.Size.x-2) / (float)t->Width();
+    float tex_h = (line_.Size.y-2) / (float)t->Height();
+
+    const float format = (float)GlyphFormat::Bitmap;
+    const float layer = (float)t->Layer();
+    const float channel = (float)t->Plane();
+    const float r = color.r, g = color.g, b = color.b, a = color.a;
+    vertices[0] = { x,     y + h, tex_x,         tex_y,         layer, channel, format, 0.0f, 0.0f, r, g, b, a };
+    vertices[1] = { x,     y,     tex_x,         tex_y + tex_h, layer, channel, format, 0.0f, 0.0f, r, g, b, a };
+    vertices[2] = { x + w, y,     tex_x + tex_w, tex_y + tex_h, layer, channel, format, 0.0f, 0.0f, r, g, b, a };
+
+    vertices[3] = { x,     y + h, tex_x,         tex_y,         layer, channel, format, 0.0f, 0.0f, r, g, b, a };
+    vertices[4] = { x + w, y,     tex_x + tex_w, tex_y + tex_h, layer, channel, format, 0.0f, 0.0f, r, g, b, a };
+    vertices[5] = { x + w, y + h, tex_x + tex_w, tex_y,         layer, channel, format, 0.0f, 0.0f, r, g, b, a };
+}
+
+void TextRender::lineShadowQuad(float x, float y, float w, float h, float sigma, glm::vec4 color,
+                                Vertex vertices[6])
+{
+    if (sigma <= 0.0f)
+    {
+        lineQuad(x, y, w, h, color, vertices);
+        return;
+    }
+    // grown by three deviations, where the blur has faded out; texture
+    // coordinates are the offset from the centre of the line
+    float reach = 3.0f * sigma;
+    float cx = x + w * 0.5f;
+    float cy = y + h * 0.5f;
+    float x0 = x - reach, x1 = x + w + reach;
+    float y0 = y - reach, y1 = y + h + reach;
+
+    const float format = LineShadowVertexFormat;
+    const float hw = w * 0.5f, hh = h * 0.5f;
+    const float r = color.r, g = color.g, b = color.b, a = color.a;
+    vertices[0] = { x0, y1, x0 - cx, y1 - cy, hw, 0.0f, format, hh, sigma, r, g, b, a };
+    vertices[1] = { x0, y0, x0 - cx, y0 - cy, hw, 0.0f, format, hh, sigma, r, g, b, a };
+    vertices[2] = { x1, y0, x1 - cx, y0 - cy, hw, 0.0f, format, hh, sigma, r, g, b, a };
+
+    vertices[3] = { x0, y1, x0 - cx, y1 - cy, hw, 0.0f, format, hh, sigma, r, g, b, a };
+    vertices[4] = { x1, y0, x1 - cx, y0 - cy, hw, 0.0f, format, hh, sigma, r, g, b, a };
+    vertices[5] = { x1, y1, x1 - cx, y1 - cy, hw, 0.0f, format, hh, sigma, r, g, b, a };
+}
+
+void TextRender::pushQuad(Layer layer, const Glyph &g, const Vertex vertices[6])
+{
+    QuadSource source = QuadSource{ g.TexIdx, g.TexGen, g.TexOffset };
+    if (layer == baseLayer_)
+    {
+        setTexture(tex_[g.TexIdx].get());
+        appendQuad(source, vertices);
+        return;
+    }
+    LayerQuad q;
+    q.Source = source;
+    memcpy(q.Vertices, vertices, sizeof(q.Vertices));
+    layerQuads_[layer].push_back(q);
+}
+
+void TextRender::setTexture(const TextureAtlas *t)
+{
+    // the atlases are layers of one texture array per channel count, each
+    // bound to a unit of its own, so switching atlases doesn't break batches
+    curTexUnit_ = texUnit(t->Channels());
+}
+
+void TextRender::appendQuad(const QuadSource &source, const Vertex vertices[6])
 {
     if (curQuadBatch_ == maxQuadBatch_)
         commitDraw();
 
     assert(curQuadBatch_ < maxQuadBatch_);
-    memcpy(vertices_ + curQuadBatch_ * 6 * 4, vertices, sizeof(float) * 6 * 4);
+    memcpy(vertices_ + curQuadBatch_ * 6, vertices, sizeof(Vertex) * 6);
+    batchSources_[curQuadBatch_] = source;
     curQuadBatch_++;
+    batchTexUnits_ |= 1 << curTexUnit_;
 }
 
 void TextRender::commitDraw()
@@ -398,10 +2094,48 @@ void TextRender::commitDraw()
     if (!curQuadBatch_)
         return;
 
+    flushUploads();
+    drawBatch();
+}
+
+void TextRender::drawBatch()
+{
+    if (!curQuadBatch_)
+        return;
+
+    // bind the atlases here, atlas updates may have changed the bindings
+    for (int unit = 0; unit < NumTexUnits; unit++)
+    {
+        if (batchTexUnits_ & (1 << unit))
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, texArrays_[unit]->TextureID());
+        }
+    }
+    glActiveTexture(GL_TEXTURE0);
+
     // update content of VBO memory
-    glBufferSubData(GL_ARRAY_BUFFER, 0, curQuadBatch_ * sizeof(float) * 6 * 4, vertices_);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, curQuadBatch_ * sizeof(Vertex) * 6, vertices_);
     // render quad
     glDrawArrays(GL_TRIANGLES, 0, curQuadBatch_ * 6);
+    frameDrawCalls_++;
+    totalDrawCalls_++;
 
     curQuadBatch_ = 0;
+    batchTexUnits_ = 0;
+}
+
+void TextRender::flushUploads(int keepPage)
+{
+    // the glyphs added since the last flush go up in a few uploads per page
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        if ((int)i == keepPage)
+        {
+            continue;
+        }
+        int calls = tex_[i]->Flush(uploadBuffer_);
+        frameUploadCalls_ += calls;
+        totalUploadCalls_ += calls;
+    }
 }
@@ -2,7 +2,12 @@
 #define __TEXT_RENDER_H__
 
 #include "shader.h"
+#include "atlas_eviction.h"
 #include "font.h"
+#include "font_cache.h"
+#include "bitmap_cache.h"
+#include "glyph_raster.h"
+#include "raster_pool.h"
 #include "texture_atlas.h"
 #include "text_run.h"
 
@@ -14,10 +19,64 @@
 #include <map>
 #include <vector>
 #include <memory>
+#include <functional>
+
+// Atlas pages start small and all pages of a channel count double in size
+// while glyphs don't fit, up to the maximum or GL_MAX_TEXTURE_SIZE.
+const int TextureAtlasInitialSize = 256;
+const int TextureAtlasMaxSize = 4096;
+// Colour glyphs are rare in most text, their RGBA atlases are kept smaller.
+const int ColorTextureAtlasInitialSize = 128;
+const int ColorTextureAtlasMaxSize = 2048;
+// Pages per channel count while evictions thrash, or GL_MAX_ARRAY_TEXTURE_LAYERS.
+const int TextureAtlasMaxPages = 64;
+
+// Layers drawn below the text, see TextRender::DrawText.
+struct TextEffects {
+    glm::vec3 StrokeColor;
+    float StrokeWidth;         // Outline beyond the glyphs in pixels, 0 for none
+    glm::vec4 ShadowColor;     // Alpha 0 for no shadow
+    glm::vec2 ShadowOffset;    // In pixels
+    float ShadowBlur;          // Blur radius in pixels, as for CSS text-shadow
+};
 
 class TextRender
 {
-    typedef std::pair<unsigned int, unsigned int> GlyphKey;
+    // Identifies a rasterized glyph by face rather than by Font, so Fonts
+    // differing only in synthetic styles share it.
+    struct GlyphKey {
+        uint64_t FaceID;       // Font::getHash
+        unsigned int GlyphIndex;
+        uint64_t VarKey;       // Quantized variation coordinates, see Font::getVarKey
+        GlyphFormat Format;
+        FT_F26Dot6 StrokeWidth; // Stroke variant of the glyph, see RasterParams::strokeWidth
+        int BlurRadius;        // Blurred variant of the glyph, see RasterParams::blurRadius
+        FT_F26Dot6 CharHeight; // Raster size, see RasterCharHeight
+
+        bool sameGlyph(const GlyphKey &rhs) const
+        {
+            return FaceID == rhs.FaceID && GlyphIndex == rhs.GlyphIndex &&
+                   VarKey == rhs.VarKey && Format == rhs.Format &&
+                   StrokeWidth == rhs.StrokeWidth && BlurRadius == rhs.BlurRadius;
+        }
+
+        bool operator<(const GlyphKey &rhs) const
+        {
+            if (FaceID != rhs.FaceID)
+                return FaceID < rhs.FaceID;
+            if (GlyphIndex != rhs.GlyphIndex)
+                return GlyphIndex < rhs.GlyphIndex;
+            if (VarKey != rhs.VarKey)
+                return VarKey < rhs.VarKey;
+            if (Format != rhs.Format)
+                return Format < rhs.Format;
+            if (StrokeWidth != rhs.StrokeWidth)
+                return StrokeWidth < rhs.StrokeWidth;
+            if (BlurRadius != rhs.BlurRadius)
+                return BlurRadius < rhs.BlurRadius;
+            return CharHeight < rhs.CharHeight;
+        }
+    };
 
     struct Glyph {
         glm::ivec2 Size;       // Size of glyph
@@ -25,56 +84,336 @@ class TextRender
         glm::ivec2 TexOffset;  // Offset of glyph in texture atlas
         int TexIdx;            // Texture atlas index
         unsigned int TexGen;   // Texture atlas generation
+        FT_F26Dot6 CharHeight; // Font size the glyph was rasterized at
+        float Scale;           // Drawn scaled by this, see Font::getStrikeScale
+        GlyphFormat Format;    // Coverage or distance field
+        uint64_t LastUse;      // Frame the glyph was last drawn in, see ChooseEvictionPage
+        GlyphPriority Priority; // Residency class, see SetFontPriority
+        uint16_t Pad;          // Empty texels around the glyph in the atlas
+        int Lru;               // Entry of lruNodes_, 0 if in no eviction list
+    };
+
+    struct Vertex {
+        float x, y;            // Position
+        float u, v;            // Texture coordinates
+        float layer;           // Atlas page, the layer of the texture array
+        float channel;         // Channel of a channel-packed page, else 0
+        float format;          // GlyphFormat, selects the fragment shader path
+        float bold;            // Synthetic bold, dilation in texels or distance field offset
+        float soft;            // Extra softness of distance field edges, for shadows
+        float r, g, b, a;      // Colour of the layer
+    };
+
+    // Layers of DrawText, bottom to top.
+    enum Layer {
+        ShadowLayer,
+        StrokeLayer,
+        FillLayer,
+        NumLayers
+    };
+
+    // The atlas region a quad samples. Quads not drawn yet follow their
+    // glyph when its atlas is evicted, see retargetQuads.
+    struct QuadSource {
+        int TexIdx;
+        unsigned int TexGen;
+        glm::ivec2 TexOffset;
+    };
+
+    // A quad of an upper layer, held back until the lower layers of the run
+    // are drawn below it.
+    struct LayerQuad {
+        QuadSource Source;
+        Vertex Vertices[6];
     };
 
     typedef std::map<GlyphKey, Glyph> GlyphCache;
 
+    // A glyph on screen, moved over to its atlas once that is cleared.
+    struct KeptGlyph {
+        Glyph *Entry;                  // In glyphs_, or line_
+        std::vector<uint8_t> Pixels;   // Empty if moved on the GPU, see TextureAtlas::BeginMove
+    };
+
+    struct MovedGlyph {
+        GlyphKey Key;
+        glm::ivec2 From;
+        glm::ivec2 To;
+    };
+
+    // Atlas being compacted over idle frames, see compact().
+    struct Compaction {
+        int TexIdx;                    // -1 if none
+        uint64_t StartFrame;
+        std::vector<GlyphKey> Keys;    // Live glyphs, tallest first
+        size_t Next;                   // Next of Keys to repack
+        std::vector<GlyphKey> Stale;   // The other glyphs, kept if drawn meanwhile
+        size_t NextStale;              // Next of Stale to repack or drop
+        std::vector<MovedGlyph> Moved;
+    };
+
+    // Texture units of the coverage / distance field, colour and MSDF arrays.
+    static const int NumTexUnits = 3;
+
+    // Glyphs of the shelf-packed pages that evictGlyphs may free, one list
+    // per height class, texture unit and transient or not, least recently
+    // used first. Entry 0 of lruNodes_ stands for none.
+    struct LruNode {
+        GlyphCache::iterator Entry;
+        int List;
+        int Prev;
+        int Next;
+    };
+
+    struct LruList {
+        int First;
+        int Last;
+    };
+
     typedef std::vector<std::unique_ptr<TextureAtlas>> TexVector;
     typedef std::vector<unsigned int> TexGenVector;
 
+    FontCache fontCache_;
+    RasterPool rasterPool_;
+    std::map<GlyphKey, bool> rasterPending_;   // Requested for a synthetic bold font
     ShaderProgram shader_;
     unsigned int vao_;
     unsigned int vbo_;
     TexVector tex_;
     TexGenVector texGen_;
+    int texPageLimit_[NumTexUnits];         // Pages per channel count, raised while evictions thrash
+    EvictionHistory texEvictions_[NumTexUnits];
+    int maxTexSize_;       // GL_MAX_TEXTURE_SIZE
+    int maxTexLayers_;     // GL_MAX_ARRAY_TEXTURE_LAYERS
+    bool packChannels_;    // Coverage pages are the channels of RGBA layers
+    AtlasShadow atlasShadow_;
+    AtlasPacker atlasPacker_;
     uint64_t texReq_;
     uint64_t texHit_;
     uint64_t texEvict_;
+    uint64_t texEvictOnScreen_;  // Evicted atlases drawn from in the same frame
+    uint64_t texKept_;           // Glyphs on screen kept through evictions
+    uint64_t texCompactions_;
+    uint64_t texGrows_;          // Texture arrays doubled in size
+    uint64_t texPagesAdded_;     // Pages added beyond the limit on thrashing
+    uint64_t texFreed_;          // Glyphs evicted one by one, with the shelf packer
+    uint64_t texDropped_;        // Glyphs left out of a run, no image or no atlas room
+    size_t snapshotGlyphs_;      // Loaded from an atlas snapshot
+    std::vector<bool> texFull_;  // Atlas refused a glyph since cleared or compacted
+    std::vector<bool> texPinned_;  // Atlas reserved for pinned glyphs, beyond the page limit
+    std::vector<bool> texStale_;   // Reserved atlas holding regions of glyphs unpinned since
+    std::vector<bool> texSpare_;   // Emptied reserved atlas, not counted until reused
+    std::map<uint64_t, GlyphPriority> fontPriority_;   // By FaceID
+    std::map<std::pair<uint64_t, unsigned int>, GlyphPriority> glyphPriority_;  // By FaceID and glyph index, over fontPriority_
+    uint64_t classReq_[NumGlyphPriorities];
+    uint64_t classHit_[NumGlyphPriorities];
+    uint64_t classDropped_[NumGlyphPriorities];  // Glyphs evicted or compacted away
+    uint64_t pinOverflow_;       // Pinned glyphs placed among the others, no reserved room left
+    Compaction compaction_;
+    float compactBudgetMs_;
+    uint64_t l2Hit_;       // Glyphs re-admitted from bitmapCache_
+    uint64_t rasterized_;
+    uint64_t texRescaled_;
+    int frameRescaled_;
+    int rasterBudget_;
+    bool asyncRaster_;          // New glyphs are rasterized by the pool
+    uint64_t frames_;
+    uint64_t frameBase_;        // Frames of a loaded snapshot, counted in frames_ but not rendered
+    int frameUploads_;
+    int frameDrawCalls_;
+    int maxFrameDrawCalls_;
+    uint64_t totalDrawCalls_;
+    int frameUploadCalls_;       // glTexSubImage3D calls flushing the atlases
+    int maxFrameUploadCalls_;
+    uint64_t totalUploadCalls_;
+    size_t frameUploadBytes_;
+    int maxFrameUploads_;
+    size_t maxFrameUploadBytes_;
+    uint64_t totalUploadBytes_;
+    int maxRasterPerFrame_;
     GlyphCache glyphs_;
+    std::vector<LruNode> lruNodes_;
+    std::vector<int> freeLruNodes_;    // Recycled entries of lruNodes_
+    std::vector<LruList> lruLists_;    // See lruList()
+    BitmapCache<GlyphKey> bitmapCache_;
     Glyph line_;
+    uint8_t coverageLUT_[256];
+    bool coverageAdjust_;
+    bool zooming_;
 
     int maxQuadBatch_;
     int curQuadBatch_;
-    float* vertices_;
-    glm::vec3 lastColor_;
-    unsigned int lastTexID_;
+    Vertex* vertices_;
+    std::vector<QuadSource> batchSources_;  // Of the quads in vertices_
+    std::vector<LayerQuad> layerQuads_[NumLayers];
+    Layer baseLayer_;            // Lowest layer of the current run, drawn directly
+    std::unique_ptr<TextureArray> texArrays_[NumTexUnits];  // See texUnit()
+    PixelUploadBuffer uploadBuffer_;  // Atlas changes are flushed through before drawing
+    int curTexUnit_;
+    int batchTexUnits_;          // Bit mask of the texture units the batch samples
 
 public:
     TextRender();
     ~TextRender();
 
-    bool Init(int numTextureAltas, int maxQuadBatch);
+    // Atlas pages start small and grow on demand, numTextureAtlas is the
+    // number of pages per channel count before evicting. packChannels stores
+    // four coverage / distance field pages in the channels of each RGBA
+    // layer, four times the pages per layer at the same memory, for four
+    // times the upload bytes.
+    bool Init(int numTextureAltas, int maxQuadBatch, unsigned long glyphCacheBytes,
+              int numRasterThreads, bool packChannels = false);
 
     void Begin(int fbWidth, int fbHeight);
 
+    // Draws text in color, above the stroke and shadow of effects. Strokes
+    // grow outwards from the glyphs, shadows are of the stroked glyphs.
+    // Colour glyphs are not stroked, their shadow is cast by their alpha.
     void DrawText(TextRun &text,
                   float x, 
                   float y, 
-                  glm::vec3 color);
+                  glm::vec3 color,
+                  const TextEffects &effects = TextEffects());
 
     void End();
 
+    // Limits how many glyphs of resized fonts are queued for re-rasterizing
+    // per frame. They are rasterized by the worker threads and drawn scaled
+    // from their old bitmaps meanwhile.
+    void SetRasterBudget(int maxRasterPerFrame) { maxRasterPerFrame_ = maxRasterPerFrame; }
+    // Adjusts the coverage of bitmap glyphs rasterized from now on, see
+    // BuildCoverageLUT. Glyphs already in the atlases keep theirs, so set it
+    // before drawing.
+    void SetCoverageAdjust(float gamma, float contrast);
+    // Byte budget of the bitmaps kept for glyphs evicted from the atlases.
+    void SetBitmapCacheBytes(size_t maxBytes) { bitmapCache_.SetMaxBytes(maxBytes); }
+    // While zooming, bitmap glyphs are rasterized at a few bucket sizes (four
+    // per doubling) and drawn scaled, instead of at every size the animation
+    // passes through. Once zooming stops, the final size is rasterized.
+    void SetZooming(bool zooming) { zooming_ = zooming; }
+    // Time End() may spend per idle frame (one without atlas uploads) on
+    // repacking the live glyphs of a fragmented atlas. 0 disables compaction.
+    void SetCompactionBudget(float ms) { compactBudgetMs_ = ms; }
+    // CPU copy of the atlas pages, for pages created from now on, so set it
+    // before Init. Compressed and None save most of the memory of Full, at
+    // the cost of decoding or reading back texels on compaction and when
+    // glyphs are kept through evictions.
+    void SetAtlasShadow(AtlasShadow shadow) { atlasShadow_ = shadow; }
+    // Packer of the atlas pages created from now on, so set it before Init.
+    // With AtlasPacker::Shelf full pages make room by evicting glyphs not
+    // drawn for EvictionRecentFrames one by one, transient ones first and
+    // then the least recently used, before a page is cleared.
+    void SetAtlasPacker(AtlasPacker packer) { atlasPacker_ = packer; }
+    // Residency class of the glyphs of a font, by face so of all its sizes
+    // and styles, or of some of its glyphs, which takes precedence. Pinned
+    // glyphs, e.g. of a HUD, go on pages reserved for them beyond the page
+    // limit, which are never evicted and are given back once empty. Without
+    // room to reserve one they go among the others and are kept through
+    // evictions up to PinOverflowMaxKept of a page. Transient ones, e.g. of a
+    // one-off paragraph, count as cold for eviction, are dropped on
+    // compaction unless on screen and stay out of the bitmap cache. Glyphs
+    // already in the atlases are re-added on next use if pinned or unpinned.
+    void SetFontPriority(Font& font, GlyphPriority priority);
+    void SetGlyphPriority(Font& font, const std::vector<unsigned int>& glyphs, GlyphPriority priority);
+    // True if glyphs still wait for (re-)rasterization or an atlas for
+    // compaction.
+    bool HasPendingWork()
+    {
+        return frameRescaled_ > 0 || rasterPool_.Pending() > 0 || compaction_.TexIdx >= 0;
+    }
+
+    // Warm start: SaveAtlasSnapshot writes the atlas pages and the glyph
+    // table to a cache file, e.g. on exit, replacing it only once written in
+    // full. The glyphs keep their last use. LoadAtlasSnapshot, right after
+    // Init, maps the file and uploads the pages in bulk. The file is ignored
+    // unless fonts are the same as when it was saved, in order, by file
+    // contents, size, variation, style and glyph format, and the atlas
+    // configuration and coverage adjustment match.
+    bool SaveAtlasSnapshot(const char *path, const std::vector<Font*> &fonts);
+    bool LoadAtlasSnapshot(const char *path, const std::vector<Font*> &fonts);
+
+    // Rasterizes the glyphs of codepoints / glyph ids on the worker threads.
+    // The finished bitmaps are added to the texture atlases by Begin().
+    void Prewarm(Font& font, const std::vector<uint32_t>& codepoints);
+    void PrewarmGlyphs(Font& font, const std::vector<unsigned int>& glyphs);
+    // Called on a worker thread when prewarmed glyphs become available, e.g.
+    // to wake up the event loop.
+    void SetWakeCallback(std::function<void()> wake) { rasterPool_.SetNotify(wake); }
+    // Blocks until the worker threads are idle. Fonts with pending requests
+    // must not be destroyed before.
+    void WaitIdle() { rasterPool_.WaitIdle(); }
+
     void PrintStats();
 
+    // Atlas cost of the last frame: glyphs added to the atlas and their bytes.
+    int LastFrameUploads() const { return frameUploads_; }
+    size_t LastFrameUploadBytes() const { return frameUploadBytes_; }
+    int LastFrameDrawCalls() const { return frameDrawCalls_; }
+    int LastFrameUploadCalls() const { return frameUploadCalls_; }
+
 private:
-    bool getGlyph(Font& font, unsigned int glyph_index, Glyph& x);
+    bool getGlyph(Font& font, unsigned int glyph_index, FT_F26Dot6 strokeWidth, int blurRadius, Glyph& x);
+    GlyphKey glyphKey(Font& font, unsigned int glyph_index, FT_F26Dot6 strokeWidth, int blurRadius);
+    FT_F26Dot6 bitmapCharHeight(const Font& font) const;
+    bool isCached(const GlyphKey &key);
+    bool isResident(const Glyph &g) const;
+    GlyphPriority glyphPriority(const GlyphKey &key) const;
+    void updatePriorities(uint64_t faceID);
+    bool readmitGlyph(const GlyphKey &key, bool bold, Glyph& x);
+    bool findOtherSize(const GlyphKey &key, Glyph& x);
+    RasterParams rasterParams(Font& font, const GlyphKey &key);
+    RasterPool::Request rasterRequest(Font& font, unsigned int glyph_index, const GlyphKey &key);
+    void requestGlyph(Font& font, unsigned int glyph_index, const GlyphKey &key);
+    bool storeGlyph(const GlyphKey &key, const GlyphBitmap &bitmap, bool bold, Glyph& x);
+    void collectRasterResults();
     bool setupLineGlyph();
-    bool addToTextureAtlas(uint16_t width, uint16_t height, const uint8_t *data, 
-                           int &tex_idx, unsigned int &tex_gen, uint16_t &tex_x, uint16_t &tex_y);
-    void setTextColor(glm::vec3 color);
-    void setTexID(unsigned int texID);
-    void appendQuad(float vertices[6][4]);
+    static int texUnit(int channels);
+    int arrayChannels(int channels) const;
+    int arrayLayers(int channels, int pages) const;
+    int newTextureAtlas(int channels);
+    bool resizeTextureArray(int channels, int size, int layers);
+    void effectiveCoverageLUT(uint8_t lut[256]) const;
+    bool raisePageLimit(int channels);
+    bool addToTextureAtlas(uint16_t width, uint16_t height, int channels, const uint8_t *data, 
+                           uint16_t padding, GlyphPriority priority, int &tex_idx, unsigned int &tex_gen,
+                           uint16_t &tex_x, uint16_t &tex_y);
+    bool addPinnedGlyph(uint16_t width, uint16_t height, int channels, const uint8_t *data,
+                        uint16_t padding, int &tex_idx, unsigned int &tex_gen, uint16_t &tex_x, uint16_t &tex_y);
+    void releasePinnedAtlas(size_t index);
+    bool freeGlyph(const Glyph &g);
+    int lruList(const Glyph &g) const;
+    void linkGlyph(GlyphCache::iterator iter);
+    void unlinkGlyph(Glyph &g);
+    void touchGlyph(GlyphCache::iterator iter);
+    GlyphCache::iterator eraseGlyph(GlyphCache::iterator iter);
+    void clearGlyphs();
+    bool evictGlyphs(const std::vector<size_t> &candidates, uint16_t width, uint16_t height, int channels,
+                     const uint8_t *data, uint16_t padding, int &tex_idx, unsigned int &tex_gen,
+                     uint16_t &tex_x, uint16_t &tex_y);
+    size_t evictTextureAtlas(const std::vector<size_t> &candidates, std::vector<KeptGlyph> &kept);
+    void restoreGlyphs(size_t index, std::vector<KeptGlyph> &kept);
+    bool followsGlyph(const QuadSource &source, const Vertex vertices[6], size_t index,
+                      const std::map<uint32_t, glm::ivec2> &moved) const;
+    void retargetQuad(QuadSource &source, Vertex vertices[6], size_t index,
+                      const std::map<uint32_t, glm::ivec2> &moved);
+    void retargetQuads(size_t index, const std::map<uint32_t, glm::ivec2> &moved);
+    void compact();
+    bool beginCompaction();
+    int compactionCandidate();
+    void finishCompaction();
+    void cancelCompaction();
+    void glyphQuad(Font& font, const Glyph& g, float x, float y, float fieldStroke, float fieldBlur,
+                   glm::vec4 color, Vertex vertices[6]);
+    void lineQuad(float x, float y, float w, float h, glm::vec4 color, Vertex vertices[6]);
+    void lineShadowQuad(float x, float y, float w, float h, float sigma, glm::vec4 color, Vertex vertices[6]);
+    void pushQuad(Layer layer, const Glyph &g, const Vertex vertices[6]);
+    void flushLayers();
+    void setTexture(const TextureAtlas *t);
+    void appendQuad(const QuadSource &source, const Vertex vertices[6]);
     void commitDraw();
+    void drawBatch();
+    // Uploads the changes of all pages but keepPage.
+    void flushUploads(int keepPage = -1);
 };
 
 #endif // !__TEXT_RENDER_H__
@@ -0,0 +1,242 @@
+#include "text_render.h"
+
+#include <algorithm>
+#include <chrono>
+
+//------------------------------------------------------------------------------
+
+// Rows per frame copied out of the readback of a page compacted without a
+// full shadow.
+const uint16_t CompactionReadRows = 256;
+
+void TextRender::compact()
+{
+    if (compactBudgetMs_ <= 0.0f)
+    {
+        return;
+    }
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point deadline = Clock::now() +
+        std::chrono::microseconds((long long)(compactBudgetMs_ * 1000.0f));
+
+    if (compaction_.TexIdx < 0 && !beginCompaction())
+    {
+        return;
+    }
+
+    // the glyphs are copied into the new layout on the CPU, drawing keeps
+    // using the old one until all are there. Every step checks the budget,
+    // the page is not given new glyphs meanwhile.
+    int index = compaction_.TexIdx;
+    TextureAtlas *t = tex_[index].get();
+    if (!t->Repacking())
+    {
+        if (Clock::now() >= deadline)
+        {
+            return;
+        }
+        if (!t->BeginRepack())
+        {
+            cancelCompaction();
+            return;
+        }
+    }
+    // a slice of the page read back per frame, the first frame queues it
+    if (!t->ReadRepackSource(CompactionReadRows))
+    {
+        return;
+    }
+    while (compaction_.Next < compaction_.Keys.size())
+    {
+        if (Clock::now() >= deadline)
+        {
+            return;
+        }
+        const GlyphKey &key = compaction_.Keys[compaction_.Next++];
+        GlyphCache::iterator iter = glyphs_.find(key);
+        if (iter == glyphs_.end() || iter->second.TexIdx != index || !isResident(iter->second))
+        {
+            continue;
+        }
+        const Glyph &g = iter->second;
+        uint16_t x, y;
+        if (!t->RepackRegion(g.TexOffset.x, g.TexOffset.y, g.Size.x, g.Size.y, g.Pad, x, y))
+        {
+            cancelCompaction();
+            return;
+        }
+        compaction_.Moved.push_back(MovedGlyph{ key, g.TexOffset, glm::ivec2(x, y) });
+    }
+
+    // glyphs drawn since the compaction started come along, the others are
+    // dropped from the atlas
+    while (compaction_.NextStale < compaction_.Stale.size())
+    {
+        if (Clock::now() >= deadline)
+        {
+            return;
+        }
+        const GlyphKey &key = compaction_.Stale[compaction_.NextStale++];
+        GlyphCache::iterator iter = glyphs_.find(key);
+        if (iter == glyphs_.end() || iter->second.TexIdx != index || !isResident(iter->second))
+        {
+            continue;
+        }
+        const Glyph &g = iter->second;
+        uint16_t x, y;
+        if (g.LastUse >= compaction_.StartFrame &&
+            t->RepackRegion(g.TexOffset.x, g.TexOffset.y, g.Size.x, g.Size.y, g.Pad, x, y))
+        {
+            compaction_.Moved.push_back(MovedGlyph{ key, g.TexOffset, glm::ivec2(x, y) });
+            continue;
+        }
+        classDropped_[(int)g.Priority]++;
+        eraseGlyph(iter);
+    }
+    finishCompaction();
+}
+
+bool TextRender::beginCompaction()
+{
+    int index = compactionCandidate();
+    if (index < 0)
+    {
+        return false;
+    }
+
+    // tallest first packs the skyline tightest
+    std::vector<std::pair<int, GlyphKey>> live;
+    compaction_.Stale.clear();
+    for (GlyphCache::iterator iter = glyphs_.begin(); iter != glyphs_.end(); ++iter)
+    {
+        const Glyph &g = iter->second;
+        if (g.TexIdx != index || !isResident(g))
+        {
+            continue;
+        }
+        if (KeepOnCompaction(g.LastUse, frames_, g.Priority))
+        {
+            live.push_back(std::make_pair(g.Size.y + 2 * g.Pad, iter->first));
+        }
+        else
+        {
+            compaction_.Stale.push_back(iter->first);
+        }
+    }
+    std::stable_sort(live.begin(), live.end(),
+                     [](const std::pair<int, GlyphKey> &a, const std::pair<int, GlyphKey> &b)
+                     {
+                         return a.first > b.first;
+                     });
+
+    compaction_.TexIdx = index;
+    compaction_.StartFrame = frames_;
+    compaction_.Keys.clear();
+    for (size_t i = 0; i < live.size(); i++)
+    {
+        compaction_.Keys.push_back(live[i].second);
+    }
+    compaction_.Next = 0;
+    compaction_.NextStale = 0;
+    compaction_.Moved.clear();
+    return true;
+}
+
+int TextRender::compactionCandidate()
+{
+    // reserved atlases holding regions of unpinned glyphs first
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        if (texStale_[i])
+        {
+            return (int)i;
+        }
+    }
+
+    // idle frames without full atlases are the common case, skip the scan
+    bool full = false;
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        full = full || (texFull_[i] && !texPinned_[i]);
+    }
+    if (!full)
+    {
+        return -1;
+    }
+
+    // area of the live glyphs per atlas
+    std::vector<size_t> liveArea(tex_.size(), 0);
+    for (GlyphCache::iterator iter = glyphs_.begin(); iter != glyphs_.end(); ++iter)
+    {
+        const Glyph &g = iter->second;
+        if (g.TexIdx >= 0 && texFull_[g.TexIdx] && isResident(g) && KeepOnCompaction(g.LastUse, frames_, g.Priority))
+        {
+            int pad = g.Pad;
+            liveArea[g.TexIdx] += (size_t)(g.Size.x + 2 * pad) * (g.Size.y + 2 * pad);
+        }
+    }
+
+    // the most fragmented of the atlases that refused glyphs
+    int index = -1;
+    float bestLive = CompactionMaxLive;
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        float live = liveArea[i] / ((float)tex_[i]->Width() * tex_[i]->Height());
+        if (texFull_[i] && !texPinned_[i] && live <= bestLive)
+        {
+            index = (int)i;
+            bestLive = live;
+        }
+    }
+    return index;
+}
+
+void TextRender::finishCompaction()
+{
+    int index = compaction_.TexIdx;
+    TextureAtlas *t = tex_[index].get();
+
+    size_t bytes = t->EndRepack();
+    frameUploadBytes_ += bytes;
+    totalUploadBytes_ += bytes;
+
+    // the glyphs keep their atlas and generation, only their offsets change
+    for (size_t i = 0; i < compaction_.Moved.size(); i++)
+    {
+        const MovedGlyph &m = compaction_.Moved[i];
+        GlyphCache::iterator entry = glyphs_.find(m.Key);
+        if (entry != glyphs_.end() && entry->second.TexIdx == index && entry->second.TexOffset == m.From)
+        {
+            entry->second.TexOffset = m.To;
+        }
+    }
+    if (line_.TexIdx == index)
+    {
+        // added again on next use
+        line_ = Glyph{};
+        line_.TexIdx = -1;
+    }
+
+    texFull_[index] = false;
+    texStale_[index] = false;
+    texCompactions_++;
+    compaction_.TexIdx = -1;
+    compaction_.Keys.clear();
+    compaction_.Stale.clear();
+    compaction_.Moved.clear();
+}
+
+void TextRender::cancelCompaction()
+{
+    if (compaction_.TexIdx < 0)
+    {
+        return;
+    }
+    // not retried until the atlas refuses a glyph again
+    tex_[compaction_.TexIdx]->CancelRepack();
+    texFull_[compaction_.TexIdx] = false;
+    compaction_.TexIdx = -1;
+    compaction_.Keys.clear();
+    compaction_.Stale.clear();
+    compaction_.Moved.clear();
+}
@@ -0,0 +1,363 @@
+#include "text_render.h"
+#include "atlas_snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+
+//------------------------------------------------------------------------------
+
+static SnapshotFont snapshotFont(Font &font)
+{
+    SnapshotFont f;
+    f.hash = font.getHash();
+    f.varKey = font.getVarKey();
+    f.charHeight = font.getCharHeight();
+    f.format = (uint32_t)font.getGlyphFormat();
+    f.bold = font.getBold() ? 1 : 0;
+    f.italic = font.getItalic() ? 1 : 0;
+    return f;
+}
+
+static bool sameFont(const SnapshotFont &a, const SnapshotFont &b)
+{
+    return a.hash == b.hash && a.varKey == b.varKey && a.charHeight == b.charHeight && a.format == b.format &&
+           a.bold == b.bold && a.italic == b.italic;
+}
+
+bool TextRender::SaveAtlasSnapshot(const char *path, const std::vector<Font*> &fonts)
+{
+    AtlasSnapshotWriter writer;
+    if (!writer.Open(path))
+    {
+        return false;
+    }
+
+    // the resident glyphs by page, so the texels are read a page at a time
+    std::vector<GlyphCache::const_iterator> saved;
+    for (GlyphCache::const_iterator iter = glyphs_.begin(); iter != glyphs_.end(); ++iter)
+    {
+        const Glyph &g = iter->second;
+        if (isResident(g) && (g.TexIdx < 0 || (g.Size.x > 0 && g.Size.y > 0)))
+        {
+            saved.push_back(iter);
+        }
+    }
+    std::stable_sort(saved.begin(), saved.end(), [](GlyphCache::const_iterator a, GlyphCache::const_iterator b) {
+        return a->second.TexIdx < b->second.TexIdx;
+    });
+
+    AtlasSnapshotHeader header;
+    header.numFonts = (uint32_t)fonts.size();
+    header.numPages = (uint32_t)tex_.size();
+    header.numGlyphs = (uint32_t)saved.size();
+    header.packChannels = packChannels_ ? 1 : 0;
+    header.packer = (uint32_t)atlasPacker_;
+    header.frame = frames_;
+    effectiveCoverageLUT(header.coverageLUT);
+    writer.Write(header);
+    for (size_t i = 0; i < fonts.size(); i++)
+    {
+        writer.Write(snapshotFont(*fonts[i]));
+    }
+
+    for (size_t i = 0; i < tex_.size(); i++)
+    {
+        const TextureAtlas *t = tex_[i].get();
+        const std::vector<binpack::SkylineBinPack::SkylineNode> &skyline = t->Packer().Skyline();
+        SnapshotPage page;
+        page.width = t->Width();
+        page.height = t->Height();
+        page.layer = (uint16_t)t->Layer();
+        page.channels = (uint8_t)t->Channels();
+        page.plane = (uint8_t)t->Plane();
+        page.numNodes = (uint32_t)skyline.size();
+        page.pinned = texPinned_[i] ? 1 : 0;
+        page.usedArea = t->Packer().UsedSurfaceArea();
+        writer.Write(page);
+        for (size_t n = 0; n < skyline.size(); n++)
+        {
+            writer.Write(SnapshotNode{ skyline[n].x, skyline[n].y, skyline[n].width });
+        }
+    }
+
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+        const GlyphKey &k = saved[i]->first;
+        const Glyph &g = saved[i]->second;
+        SnapshotGlyph r;
+        r.faceID = k.FaceID;
+        r.varKey = k.VarKey;
+        r.strokeWidth = k.StrokeWidth;
+        r.keyCharHeight = k.CharHeight;
+        r.glyphIndex = k.GlyphIndex;
+        r.blurRadius = k.BlurRadius;
+        r.keyFormat = (int32_t)k.Format;
+        r.format = (int32_t)g.Format;
+        r.size[0] = g.Size.x;
+        r.size[1] = g.Size.y;
+        r.bearing[0] = g.Bearing.x;
+        r.bearing[1] = g.Bearing.y;
+        r.texOffset[0] = g.TexOffset.x;
+        r.texOffset[1] = g.TexOffset.y;
+        r.texIdx = g.TexIdx;
+        r.scale = g.Scale;
+        r.priority = (int32_t)g.Priority;
+        r.pad = g.Pad;
+        r.charHeight = g.CharHeight;
+        r.lastUse = g.LastUse;
+        writer.Write(r);
+    }
+
+    // the pages are all on their way back before the first is waited for
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+        int index = saved[i]->second.TexIdx;
+        if (index >= 0 && (i == 0 || index != saved[i - 1]->second.TexIdx))
+        {
+            tex_[index]->QueueRead();
+        }
+    }
+    std::vector<uint8_t> texels;
+    int page = -1;
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+        const Glyph &g = saved[i]->second;
+        if (g.TexIdx < 0)
+        {
+            continue;
+        }
+        TextureAtlas *t = tex_[g.TexIdx].get();
+        if (g.TexIdx != page)
+        {
+            page = g.TexIdx;
+            texels.resize(t->FullShadowBytes());
+            t->ReadQueued(texels.data());
+        }
+        size_t pitch = t->Width() * t->Channels();
+        for (int y = 0; y < g.Size.y; y++)
+        {
+            writer.WriteTexels(texels.data() + (g.TexOffset.y + y) * pitch + g.TexOffset.x * t->Channels(),
+                               g.Size.x * t->Channels());
+        }
+    }
+    return writer.Commit();
+}
+
+bool TextRender::LoadAtlasSnapshot(const char *path, const std::vector<Font*> &fonts)
+{
+    // only into the empty atlas Init created
+    if (!glyphs_.empty() || tex_.size() != 1)
+    {
+        return false;
+    }
+
+    AtlasSnapshotReader reader;
+    AtlasSnapshotHeader header;
+    uint8_t lut[256];
+    effectiveCoverageLUT(lut);
+    if (!reader.Open(path) || !reader.Read(header) ||
+        header.numFonts != fonts.size() ||
+        header.numPages == 0 || header.numPages > (uint32_t)(NumTexUnits * TextureAtlasMaxPages) ||
+        header.packChannels != (packChannels_ ? 1u : 0u) ||
+        header.packer != (uint32_t)atlasPacker_ ||
+        memcmp(header.coverageLUT, lut, sizeof(lut)) != 0)
+    {
+        return false;
+    }
+    // a font file, size or style changed since
+    for (size_t i = 0; i < fonts.size(); i++)
+    {
+        SnapshotFont f;
+        SnapshotFont current = snapshotFont(*fonts[i]);
+        if (!reader.Read(f) || !sameFont(f, current))
+        {
+            return false;
+        }
+    }
+
+    // validate the layout before touching the atlases
+    std::vector<SnapshotPage> pages(header.numPages);
+    std::vector<std::vector<binpack::SkylineBinPack::SkylineNode>> skylines(header.numPages);
+    int pageCount[NumTexUnits] = {};
+    int pageSize[NumTexUnits] = {};
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        SnapshotPage &p = pages[i];
+        if (!reader.Read(p) || (p.channels != 1 && p.channels != 3 && p.channels != 4) ||
+            p.numNodes == 0 || p.numNodes > p.width)
+        {
+            return false;
+        }
+        int unit = texUnit(p.channels);
+        int maxSize = std::min(maxTexSize_, (p.channels == 4) ? ColorTextureAtlasMaxSize : TextureAtlasMaxSize);
+        if (p.width != p.height || p.width > maxSize || (pageSize[unit] != 0 && pageSize[unit] != p.width))
+        {
+            return false;
+        }
+        pageSize[unit] = p.width;
+        pageCount[unit]++;
+        if (reader.Remaining() / SnapshotNodeBytes < p.numNodes)
+        {
+            return false;
+        }
+        skylines[i].resize(p.numNodes);
+        for (size_t n = 0; n < p.numNodes; n++)
+        {
+            SnapshotNode node;
+            if (!reader.Read(node))
+            {
+                return false;
+            }
+            skylines[i][n] = binpack::SkylineBinPack::SkylineNode{ node.x, node.y, node.width };
+        }
+    }
+    if (pages[0].channels != 1)
+    {
+        return false;
+    }
+    for (int channels : { 1, 3, 4 })
+    {
+        int count = pageCount[texUnit(channels)];
+        if (count > TextureAtlasMaxPages || arrayLayers(channels, count) > maxTexLayers_)
+        {
+            return false;
+        }
+    }
+    // a corrupt count is not allocated for
+    if (reader.Remaining() / SnapshotGlyphBytes < header.numGlyphs)
+    {
+        return false;
+    }
+    std::vector<SnapshotGlyph> records(header.numGlyphs);
+    size_t texelBytes = 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const SnapshotGlyph &r = records[i];
+        if (!reader.Read(records[i]) || r.texIdx < -1 || r.texIdx >= (int32_t)pages.size() ||
+            r.format < (int32_t)GlyphFormat::Bitmap || r.format > (int32_t)GlyphFormat::MSDF ||
+            r.keyFormat < (int32_t)GlyphFormat::Bitmap || r.keyFormat > (int32_t)GlyphFormat::MSDF ||
+            r.priority < 0 || r.priority >= NumGlyphPriorities || r.lastUse > header.frame)
+        {
+            return false;
+        }
+        if (r.texIdx >= 0)
+        {
+            const SnapshotPage &p = pages[r.texIdx];
+            int pad = r.pad;
+            if (pad < 0 || pad > 255 || r.size[0] <= 0 || r.size[1] <= 0 || r.texOffset[0] < pad || r.texOffset[1] < pad ||
+                r.texOffset[0] + r.size[0] + pad > p.width || r.texOffset[1] + r.size[1] + pad > p.height)
+            {
+                return false;
+            }
+            texelBytes += (size_t)r.size[0] * r.size[1] * p.channels;
+        }
+    }
+    if (reader.TexelBytes() != texelBytes)
+    {
+        return false;
+    }
+
+    // the arrays get the snapshot's size and room for its pages, the pages
+    // are created in the same order, so they land on the same layers
+    auto fitArrays = [&]() {
+        for (int channels : { 1, 3, 4 })
+        {
+            int unit = texUnit(channels);
+            texPageLimit_[unit] = std::max(texPageLimit_[unit], pageCount[unit]);
+            if (pageCount[unit] == 0 || !texArrays_[unit])
+            {
+                continue;
+            }
+            int layers = arrayLayers(channels, texPageLimit_[unit]);
+            if ((texArrays_[unit]->Width() != pageSize[unit] || texArrays_[unit]->Layers() != layers) &&
+                !resizeTextureArray(channels, pageSize[unit], layers))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto fail = [this]() {
+        clearGlyphs();
+        for (size_t i = 0; i < tex_.size(); i++)
+        {
+            tex_[i]->Clear();
+            texPinned_[i] = false;
+        }
+        return false;
+    };
+    if (!fitArrays())
+    {
+        return fail();
+    }
+    for (size_t i = 1; i < pages.size(); i++)
+    {
+        int index = newTextureAtlas(pages[i].channels);
+        if (index < 0 || tex_[index]->Layer() != pages[i].layer || tex_[index]->Plane() != pages[i].plane)
+        {
+            return fail();
+        }
+    }
+    if (!fitArrays())
+    {
+        return fail();
+    }
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        if (!tex_[i]->RestorePacker(skylines[i], (unsigned long)pages[i].usedArea))
+        {
+            return fail();
+        }
+        texPinned_[i] = (pages[i].pinned != 0);
+    }
+
+    // place the texels straight from the mapping, one upload per page
+    const uint8_t *texels = reader.Texels();
+    std::vector<GlyphCache::iterator> loaded;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const SnapshotGlyph &r = records[i];
+        GlyphKey key = GlyphKey{ r.faceID, r.glyphIndex, r.varKey, (GlyphFormat)r.keyFormat, r.strokeWidth,
+                                 r.blurRadius, r.keyCharHeight };
+        Glyph g = Glyph{};
+        g.Size = glm::ivec2(r.size[0], r.size[1]);
+        g.Bearing = glm::ivec2(r.bearing[0], r.bearing[1]);
+        g.TexOffset = glm::ivec2(r.texOffset[0], r.texOffset[1]);
+        g.TexIdx = r.texIdx;
+        g.CharHeight = r.charHeight;
+        g.Scale = r.scale;
+        g.Format = (GlyphFormat)r.format;
+        g.Priority = (GlyphPriority)r.priority;
+        g.Pad = (uint16_t)r.pad;
+        g.LastUse = r.lastUse;
+        if (g.TexIdx >= 0)
+        {
+            TextureAtlas *t = tex_[g.TexIdx].get();
+            if (!t->PlaceRegion(g.TexOffset.x, g.TexOffset.y, g.Size.x, g.Size.y, texels, g.Pad))
+            {
+                return fail();
+            }
+            texels += (size_t)g.Size.x * g.Size.y * t->Channels();
+            g.TexGen = texGen_[g.TexIdx];
+        }
+        loaded.push_back(glyphs_.insert(std::make_pair(key, g)).first);
+    }
+    flushUploads();
+    // into the eviction lists in the order they were drawn
+    std::sort(loaded.begin(), loaded.end(), [](GlyphCache::iterator a, GlyphCache::iterator b)
+              {
+                  return a->second.LastUse < b->second.LastUse;
+              });
+    for (size_t i = 0; i < loaded.size(); i++)
+    {
+        linkGlyph(loaded[i]);
+    }
+    snapshotGlyphs_ = records.size();
+    // the frame count goes on from the snapshot's, the glyphs keep their age
+    if (header.frame > frames_)
+    {
+        frameBase_ += header.frame - frames_;
+        frames_ = header.frame;
+    }
+    return true;
+}
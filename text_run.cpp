@@ -8,7 +8,8 @@ TextRun::TextRun(Font &font,
                  hb_script_t script, 
                  hb_language_t language,
                  bool underline)
-: font_(font), text_(text), direction_(direction), script_(script), language_(language), underline_(underline)
+: font_(font), text_(text), direction_(direction), script_(script), language_(language), underline_(underline),
+  layoutGen_(0)
 {
     setDirty();
 }
@@ -37,7 +38,8 @@ void TextRun::setDirty()
 
 void TextRun::doLayout()
 {
-    if (!dirty_)
+    // the font may have been resized since the last layout
+    if (!dirty_ && layoutGen_ == font_.getLayoutGen())
         return;
 
     glyphs_.clear();
@@ -51,24 +53,33 @@ void TextRun::doLayout()
     hb_buffer_set_direction(buf, direction_);
     hb_buffer_set_script(buf, script_);
     hb_buffer_set_language(buf, language_);
-    // Shape
-    hb_shape(font_.getHBFont(), buf, NULL, 0);
+    // Shape, with the calling thread's instance of the font
+    Font::Instance inst = font_.ForThread();
+    if (!inst.hbFont)
+    {
+        return;
+    }
+    hb_shape(inst.hbFont, buf, NULL, 0);
     // Get the glyph and position information.
     unsigned int glyph_count;
     hb_glyph_info_t *glyph_info    = hb_buffer_get_glyph_infos(buf, &glyph_count);
     hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
     
+    // positions of fixed-size strikes are scaled to the font size
+    float scale = font_.getStrikeScale() / 64;
+
     // Iterate over each glyph.
     for (unsigned int i = 0; i < glyph_count; i++)
     {
         hb_codepoint_t glyphid  = glyph_info[i].codepoint;
-        hb_position_t x_offset  = glyph_pos[i].x_offset / 64;
-        hb_position_t y_offset  = glyph_pos[i].y_offset / 64;
-        hb_position_t x_advance = glyph_pos[i].x_advance / 64;
-        hb_position_t y_advance = glyph_pos[i].y_advance / 64;
+        hb_position_t x_offset  = (hb_position_t)(glyph_pos[i].x_offset * scale);
+        hb_position_t y_offset  = (hb_position_t)(glyph_pos[i].y_offset * scale);
+        hb_position_t x_advance = (hb_position_t)(glyph_pos[i].x_advance * scale);
+        hb_position_t y_advance = (hb_position_t)(glyph_pos[i].y_advance * scale);
 
         glyphs_.push_back(GlyphInfo { glyphid, x_offset, y_offset, x_advance, y_advance });
     }
 
     dirty_ = false;
+    layoutGen_ = font_.getLayoutGen();
 }
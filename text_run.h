@@ -27,6 +27,7 @@ private:
     bool underline_;
     std::vector<GlyphInfo> glyphs_;
     bool dirty_;
+    unsigned int layoutGen_;
 
 public:
     TextRun(Font &font, 
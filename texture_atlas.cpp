@@ -1,61 +1,677 @@
 #include "texture_atlas.h"
+#include "pixel_kernels.h"
+#include "rle.h"
 #include <glad/glad.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 
-TextureAtlas::TextureAtlas()
-: width_(0), height_(0), data_(nullptr), texture_(0)
+// Dirty regions are merged while the texels in between, uploaded along, are
+// at most as many as the texels of the regions or this many.
+static const size_t DirtyMergeTexels = 4096;
+
+// Map nodes and vector headers of a compressed shadow region.
+static const size_t ShadowRegionOverhead = 64;
+
+static GLenum pixelFormat(int channels)
 {
+    switch (channels)
+    {
+    case 3:
+        return GL_RGB;
+    case 4:
+        return GL_RGBA;
+    default:
+        return GL_RED;
+    }
 }
 
-TextureAtlas::~TextureAtlas()
+// Framebuffers to attach texture layers to, for blits and reads back. The
+// framebuffer bindings and scissor test of the caller are restored.
+class LayerFramebuffers
+{
+public:
+    LayerFramebuffers()
+    {
+        glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_);
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw_);
+        scissor_ = glIsEnabled(GL_SCISSOR_TEST);
+        glDisable(GL_SCISSOR_TEST);
+        glGenFramebuffers(2, fbo_);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_[0]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_[1]);
+    }
+
+    ~LayerFramebuffers()
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, read_);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_);
+        if (scissor_)
+        {
+            glEnable(GL_SCISSOR_TEST);
+        }
+        glDeleteFramebuffers(2, fbo_);
+    }
+
+    void Attach(GLenum target, unsigned int texture, int layer)
+    {
+        glFramebufferTextureLayer(target, GL_COLOR_ATTACHMENT0, texture, 0, layer);
+    }
+
+private:
+    GLuint fbo_[2];
+    GLint read_;
+    GLint draw_;
+    GLboolean scissor_;
+};
+
+//------------------------------------------------------------------------------
+
+PixelUploadBuffer::PixelUploadBuffer()
+: buffer_(0), size_(0)
+{
+}
+
+PixelUploadBuffer::~PixelUploadBuffer()
+{
+    glDeleteBuffers(1, &buffer_);
+}
+
+bool PixelUploadBuffer::Init()
+{
+    glGenBuffers(1, &buffer_);
+    return buffer_ != 0;
+}
+
+uint8_t *PixelUploadBuffer::Map(size_t size)
+{
+    assert(size > 0);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_);
+    if (size > size_)
+    {
+        size_ = std::max(size, 2 * size_);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size_, nullptr, GL_STREAM_DRAW);
+    }
+    // invalidating orphans the storage uploads still read from
+    void *data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (data == nullptr)
+    {
+        Unbind();
+    }
+    return (uint8_t*)data;
+}
+
+bool PixelUploadBuffer::Unmap()
+{
+    if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE)
+    {
+        Unbind();
+        return false;
+    }
+    return true;
+}
+
+void PixelUploadBuffer::Unbind()
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+//------------------------------------------------------------------------------
+
+PixelReadBuffer::PixelReadBuffer()
+: buffer_(0), sync_(nullptr)
+{
+}
+
+PixelReadBuffer::~PixelReadBuffer()
+{
+    Release();
+}
+
+bool PixelReadBuffer::Init(size_t size)
+{
+    assert(size > 0);
+
+    if (buffer_ == 0)
+    {
+        glGenBuffers(1, &buffer_);
+        if (buffer_ == 0)
+        {
+            return false;
+        }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer_);
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+    return true;
+}
+
+void PixelReadBuffer::Unbind()
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteSync((GLsync)sync_);
+    sync_ = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool PixelReadBuffer::Ready()
+{
+    if (sync_ == nullptr)
+    {
+        return true;
+    }
+    GLenum status = glClientWaitSync((GLsync)sync_, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
+const uint8_t *PixelReadBuffer::Map(size_t offset, size_t size)
+{
+    if (buffer_ == 0)
+    {
+        return nullptr;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer_);
+    const void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, offset, size, GL_MAP_READ_BIT);
+    if (data == nullptr)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    return (const uint8_t*)data;
+}
+
+void PixelReadBuffer::Unmap()
+{
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+bool PixelReadBuffer::BindUnpack()
+{
+    if (buffer_ == 0)
+    {
+        return false;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_);
+    return true;
+}
+
+void PixelReadBuffer::UnbindUnpack()
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void PixelReadBuffer::Release()
+{
+    glDeleteBuffers(1, &buffer_);
+    buffer_ = 0;
+    glDeleteSync((GLsync)sync_);
+    sync_ = nullptr;
+}
+
+//------------------------------------------------------------------------------
+
+TextureArray::TextureArray()
+: width_(0), height_(0), layers_(0), channels_(1), texture_(0)
+{
+}
+
+TextureArray::~TextureArray()
 {
-    free(data_);
     glDeleteTextures(1, &texture_);
 }
 
-bool TextureAtlas::Init(uint16_t width, uint16_t height)
+bool TextureArray::Init(uint16_t width, uint16_t height, int layers, int channels)
 {
     assert(width > 0);
     assert(height > 0);
+    assert(layers > 0);
+    assert(channels == 1 || channels == 3 || channels == 4);
 
     width_ = width;
     height_ = height;
-    
-    binPacker_.Init(width, height);
-
-    data_ = (uint8_t*)calloc(width * height * 1, sizeof(uint8_t));
-    if (data_ == nullptr)
-    {
-        return false;
-    }
+    layers_ = layers;
+    channels_ = channels;
 
     // generate texture
     glGenTextures(1, &texture_);
-    glBindTexture(GL_TEXTURE_2D, texture_);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage2D(
-        GL_TEXTURE_2D,
+    glTexImage3D(
+        GL_TEXTURE_2D_ARRAY,
         0,
-        GL_RED,
+        pixelFormat(channels_),
         width_,
         height_,
+        layers_,
         0,
-        GL_RED,
+        pixelFormat(channels_),
         GL_UNSIGNED_BYTE,
         nullptr
     );
     // set texture options
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    pages_.assign(layers_ * 4, nullptr);
+    return true;
+}
+
+void TextureArray::CopyFrom(const TextureArray &src)
+{
+    assert(src.width_ <= width_ && src.height_ <= height_);
+    assert(src.channels_ == channels_);
+
+    LayerFramebuffers fbo;
+    for (int layer = 0; layer < std::min(layers_, src.layers_); layer++)
+    {
+        fbo.Attach(GL_READ_FRAMEBUFFER, src.texture_, layer);
+        fbo.Attach(GL_DRAW_FRAMEBUFFER, texture_, layer);
+        glBlitFramebuffer(0, 0, src.width_, src.height_, 0, 0, src.width_, src.height_, GL_COLOR_BUFFER_BIT,
+                          GL_NEAREST);
+    }
+}
+
+void TextureArray::ReadTexels(int layer, int x, int y, int width, int height, uint8_t *data, size_t pitch) const
+{
+    assert(layer >= 0 && layer < layers_);
+    assert(pitch % channels_ == 0);
+
+    LayerFramebuffers fbo;
+    fbo.Attach(GL_READ_FRAMEBUFFER, texture_, layer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glPixelStorei(GL_PACK_ROW_LENGTH, (GLint)(pitch / channels_));
+    glReadPixels(x, y, width, height, pixelFormat(channels_), GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+void TextureArray::SetPage(int layer, int plane, const TextureAtlas *page)
+{
+    assert(layer >= 0 && layer < layers_);
+    assert(plane >= 0 && plane < 4);
+    pages_[layer * 4 + plane] = page;
+}
+
+//------------------------------------------------------------------------------
+
+TextureAtlas::TextureAtlas()
+: width_(0), height_(0), channels_(1), packer_(AtlasPacker::Skyline), shadow_(AtlasShadow::Full), data_(nullptr), resizeData_(nullptr), array_(nullptr), layer_(0),
+  plane_(0), moveWidth_(0), moveQueued_(false), repacking_(false), repackData_(nullptr), repackReadQueued_(false),
+  repackSourceRows_(0), repackRows_(0)
+{
+}
+
+TextureAtlas::~TextureAtlas()
+{
+    free(data_);
+    free(resizeData_);
+    free(repackData_);
+}
+
+bool TextureAtlas::Init(TextureArray &array, int layer, AtlasShadow shadow, AtlasPacker packer)
+{
+    return init(array, layer, 0, array.Channels(), shadow, packer);
+}
+
+bool TextureAtlas::InitPlane(TextureArray &array, int layer, int plane, AtlasShadow shadow, AtlasPacker packer)
+{
+    assert(array.Channels() == 4);
+    assert(plane >= 0 && plane < 4);
+    return init(array, layer, plane, 1, shadow == AtlasShadow::None ? AtlasShadow::Compressed : shadow, packer);
+}
+
+bool TextureAtlas::init(TextureArray &array, int layer, int plane, int channels, AtlasShadow shadow,
+                        AtlasPacker packer)
+{
+    assert(array.TextureID() != 0);
+    assert(layer >= 0 && layer < array.Layers());
+
+    width_ = array.Width();
+    height_ = array.Height();
+    channels_ = channels;
+    packer_ = packer;
+    shadow_ = shadow;
+    array_ = &array;
+    layer_ = layer;
+    plane_ = plane;
+    array.SetPage(layer_, plane_, this);
+    
+    binPacker_.Init(width_, height_);
+    shelfPacker_.Init(width_, height_);
+
+    if (shadow_ == AtlasShadow::Full)
+    {
+        data_ = (uint8_t*)calloc(width_ * height_ * channels_, sizeof(uint8_t));
+        if (data_ == nullptr)
+        {
+            return false;
+        }
+    }
 
     return true;
 }
 
-bool TextureAtlas::AddRegion(uint16_t width, uint16_t height, const uint8_t *data, uint16_t &x, uint16_t &y)
+unsigned int TextureAtlas::TextureID() const
+{
+    return array_->TextureID();
+}
+
+bool TextureAtlas::Packed() const
+{
+    return array_->Channels() != channels_;
+}
+
+size_t TextureAtlas::ShadowBytes() const
+{
+    return (shadow_ == AtlasShadow::Full) ? FullShadowBytes() : regions_.Bytes;
+}
+
+bool TextureAtlas::Resize(TextureArray &array)
+{
+    assert(array.Width() >= width_ && array.Height() >= height_);
+    assert(array.Channels() == array_->Channels());
+    assert(layer_ < array.Layers());
+    assert(!Repacking());
+
+    if (!ReserveResize(array.Width(), array.Height()))
+    {
+        return false;
+    }
+    if (shadow_ == AtlasShadow::Full)
+    {
+        BlitRows(resizeData_, array.Width() * channels_, data_, width_ * channels_, width_ * channels_, height_);
+        free(data_);
+        data_ = resizeData_;
+        resizeData_ = nullptr;
+    }
+
+    // regions not uploaded yet stay dirty, they go to the new array
+    width_ = array.Width();
+    height_ = array.Height();
+    array_ = &array;
+    array.SetPage(layer_, plane_, this);
+    binPacker_.Grow(width_, height_);
+    shelfPacker_.Grow(width_, height_);
+    return true;
+}
+
+bool TextureAtlas::ReserveResize(uint16_t width, uint16_t height)
+{
+    if (shadow_ != AtlasShadow::Full || resizeData_ != nullptr)
+    {
+        return true;
+    }
+    resizeData_ = (uint8_t*)calloc(width * height * channels_, sizeof(uint8_t));
+    return resizeData_ != nullptr;
+}
+
+void TextureAtlas::CancelResize()
+{
+    free(resizeData_);
+    resizeData_ = nullptr;
+}
+
+int TextureAtlas::Flush(PixelUploadBuffer &buffer)
+{
+    int moves = flushMoves();
+    if (dirty_.empty())
+    {
+        return moves;
+    }
+    coalesceDirty();
+
+    int channels = array_->Channels();
+    size_t size = 0;
+    for (const binpack::Rect &r : dirty_)
+    {
+        size += (size_t)r.width * r.height * channels;
+    }
+    uint8_t *data = buffer.Map(size);
+    if (data == nullptr)
+    {
+        return moves;
+    }
+    size_t offset = 0;
+    for (const binpack::Rect &r : dirty_)
+    {
+        copyRegion(r, data + offset);
+        offset += (size_t)r.width * r.height * channels;
+    }
+    if (!buffer.Unmap())
+    {
+        // the storage was lost, the regions stay dirty for the next flush
+        return moves;
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array_->TextureID());
+    offset = 0;
+    for (const binpack::Rect &r : dirty_)
+    {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, r.x, r.y, layer_, r.width, r.height, 1, pixelFormat(channels),
+                        GL_UNSIGNED_BYTE, (const void*)offset);
+        offset += (size_t)r.width * r.height * channels;
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    buffer.Unbind();
+
+    int uploads = (int)dirty_.size();
+    dirty_.clear();
+    if (shadow_ == AtlasShadow::None)
+    {
+        for (auto &entry : regions_.Regions)
+        {
+            regions_.Bytes -= entry.second.Data.capacity();
+            std::vector<uint8_t>().swap(entry.second.Data);
+        }
+    }
+    return moves + uploads;
+}
+
+int TextureAtlas::flushMoves()
+{
+    if (moves_.empty())
+    {
+        return 0;
+    }
+    // the buffer holds the page as it was before Clear, the texels never
+    // leave the GPU
+    int moves = (int)moves_.size();
+    if (moveSource_.BindUnpack())
+    {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, moveWidth_);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, array_->TextureID());
+        for (const Move &m : moves_)
+        {
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, m.To.x, m.To.y, layer_, m.To.width, m.To.height, 1,
+                            pixelFormat(channels_), GL_UNSIGNED_BYTE, (const void*)m.Offset);
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        moveSource_.UnbindUnpack();
+    }
+    moves_.clear();
+    moveRegions_ = RegionStore();
+    moveSource_.Release();
+    return moves;
+}
+
+void TextureAtlas::markDirty(int x, int y, int width, int height)
+{
+    dirty_.push_back(binpack::Rect{x, y, width, height});
+}
+
+void TextureAtlas::coalesceDirty()
+{
+    // regions inserted along the skyline share rows, sorted by row they merge
+    // into bands
+    std::sort(dirty_.begin(), dirty_.end(), [](const binpack::Rect &a, const binpack::Rect &b) {
+        return a.y != b.y ? a.y < b.y : a.x < b.x;
+    });
+
+    size_t merged = 0;
+    size_t texels = (size_t)dirty_[0].width * dirty_[0].height;   // Of the regions merged into dirty_[merged]
+    for (size_t i = 1; i < dirty_.size(); i++)
+    {
+        binpack::Rect &m = dirty_[merged];
+        const binpack::Rect &r = dirty_[i];
+        int x0 = std::min(m.x, r.x);
+        int y0 = std::min(m.y, r.y);
+        int x1 = std::max(m.x + m.width, r.x + r.width);
+        int y1 = std::max(m.y + m.height, r.y + r.height);
+        size_t payload = texels + (size_t)r.width * r.height;
+        size_t area = (size_t)(x1 - x0) * (y1 - y0);
+        binpack::Rect u = binpack::Rect{x0, y0, x1 - x0, y1 - y0};
+        // without a shadow the texels of uploaded regions are unknown, unions
+        // must not cover them
+        if (area <= payload + std::max(payload, DirtyMergeTexels) &&
+            (shadow_ != AtlasShadow::None || !overlapsUploaded(u)))
+        {
+            m = u;
+            texels = payload;
+        }
+        else
+        {
+            texels = (size_t)r.width * r.height;
+            dirty_[++merged] = r;
+        }
+    }
+    dirty_.resize(merged + 1);
+}
+
+void TextureAtlas::copyRegion(const binpack::Rect &r, uint8_t *dst)
+{
+    if (Packed())
+    {
+        // GL writes all channels of the texels, the other pages of the
+        // layer are interleaved with this one. Pages not created yet are
+        // zeros. Without a full shadow the planes are decoded first.
+        zeros_.resize(r.width, 0);
+        std::vector<uint8_t> decoded;
+        const uint8_t *planes[4];
+        ptrdiff_t pitches[4];
+        for (int c = 0; c < 4; c++)
+        {
+            const TextureAtlas *page = array_->Page(layer_, c);
+            assert(page == nullptr || (r.x + r.width <= page->width_ && r.y + r.height <= page->height_));
+            if (page == nullptr)
+            {
+                planes[c] = zeros_.data();
+                pitches[c] = 0;
+            }
+            else if (page->shadow_ == AtlasShadow::Full)
+            {
+                planes[c] = page->data_ + r.y * page->width_ + r.x;
+                pitches[c] = page->width_;
+            }
+            else
+            {
+                decoded.resize((size_t)r.width * r.height * 4);
+                uint8_t *plane = decoded.data() + (size_t)r.width * r.height * c;
+                page->readTexels(r, plane, r.width);
+                planes[c] = plane;
+                pitches[c] = r.width;
+            }
+        }
+        InterleaveRows(dst, r.width * 4, planes, pitches, r.width, r.height);
+    }
+    else if (shadow_ == AtlasShadow::None)
+    {
+        // r covers regions not uploaded yet and unused texels only
+        FillRows(dst, r.width * channels_, 0, r.width * channels_, r.height);
+        decodeRegions(regions_, r, dst, r.width * channels_);
+    }
+    else
+    {
+        readTexels(r, dst, r.width * channels_);
+    }
+}
+
+void TextureAtlas::readTexels(const binpack::Rect &r, uint8_t *dst, size_t pitch) const
+{
+    switch (shadow_)
+    {
+    case AtlasShadow::Full:
+        BlitRows(dst, pitch, data_ + (r.y * width_ + r.x) * channels_, width_ * channels_, r.width * channels_,
+                 r.height);
+        break;
+    case AtlasShadow::Compressed:
+        FillRows(dst, pitch, 0, r.width * channels_, r.height);
+        decodeRegions(regions_, r, dst, pitch);
+        break;
+    case AtlasShadow::None:
+        assert(!Packed());
+        array_->ReadTexels(layer_, r.x, r.y, r.width, r.height, dst, pitch);
+        decodeRegions(regions_, r, dst, pitch);
+        break;
+    }
+}
+
+void TextureAtlas::decodeRegions(const RegionStore &store, const binpack::Rect &r, uint8_t *dst, size_t pitch) const
+{
+    // regions starting up to MaxHeight rows above r may reach into it
+    uint32_t first = (uint32_t)std::max(0, r.y - store.MaxHeight + 1) << 16;
+    uint32_t last = (uint32_t)(r.y + r.height) << 16;
+    std::vector<uint8_t> texels;
+    for (auto iter = store.Regions.lower_bound(first); iter != store.Regions.end() && iter->first < last; ++iter)
+    {
+        const ShadowRegion &region = iter->second;
+        if (region.Data.empty())
+        {
+            continue;
+        }
+        int x = iter->first & 0xffff;
+        int y = iter->first >> 16;
+        int x0 = std::max(x, r.x);
+        int y0 = std::max(y, r.y);
+        int x1 = std::min(x + region.Width, r.x + r.width);
+        int y1 = std::min(y + region.Height, r.y + r.height);
+        if (x0 >= x1 || y0 >= y1)
+        {
+            continue;
+        }
+        size_t regionPitch = region.Width * channels_;
+        texels.resize(regionPitch * region.Height);
+        RleDecode(region.Data.data(), region.Data.size(), texels.data(), texels.size());
+        BlitRows(dst + (y0 - r.y) * pitch + (x0 - r.x) * channels_, pitch,
+                 texels.data() + (y0 - y) * regionPitch + (x0 - x) * channels_, regionPitch,
+                 (x1 - x0) * channels_, y1 - y0);
+    }
+}
+
+void TextureAtlas::storeRegion(RegionStore &store, const binpack::Rect &r, const uint8_t *texels)
+{
+    auto entry = store.Regions.insert(std::make_pair((uint32_t)r.y << 16 | (uint32_t)r.x, ShadowRegion()));
+    ShadowRegion &region = entry.first->second;
+    store.Bytes += entry.second ? ShadowRegionOverhead : 0;
+    store.Bytes -= region.Data.capacity();
+    region.Width = (uint16_t)r.width;
+    region.Height = (uint16_t)r.height;
+    RleEncode(texels, (size_t)r.width * r.height * channels_, region.Data);
+    region.Data.shrink_to_fit();
+    store.Bytes += region.Data.capacity();
+    store.MaxHeight = std::max(store.MaxHeight, r.height);
+}
+
+bool TextureAtlas::overlapsUploaded(const binpack::Rect &r) const
+{
+    uint32_t first = (uint32_t)std::max(0, r.y - regions_.MaxHeight + 1) << 16;
+    uint32_t last = (uint32_t)(r.y + r.height) << 16;
+    for (auto iter = regions_.Regions.lower_bound(first); iter != regions_.Regions.end() && iter->first < last; ++iter)
+    {
+        int x = iter->first & 0xffff;
+        int y = iter->first >> 16;
+        if (iter->second.Data.empty() && x < r.x + r.width && r.x < x + iter->second.Width &&
+            y < r.y + r.height && r.y < y + iter->second.Height)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TextureAtlas::AddRegion(uint16_t width, uint16_t height, const uint8_t *data, uint16_t &x, uint16_t &y,
+                             uint16_t padding)
 {
     assert(width > 0);
     assert(height > 0);
@@ -63,27 +679,205 @@ bool TextureAtlas::AddRegion(uint16_t width, uint16_t height, const uint8_t *dat
 
     assert(width_ > 0);
     assert(height_ > 0);
-    assert(data_ != nullptr);
-    assert(texture_ != 0);
+    assert(array_ != nullptr);
+    assert(!Repacking());
 
-    binpack::Rect r = binPacker_.Insert(width, height);
+    binpack::Rect r = (packer_ == AtlasPacker::Shelf) ?
+                      shelfPacker_.Insert(width + 2 * padding, height + 2 * padding) :
+                      binPacker_.Insert(width + 2 * padding, height + 2 * padding);
     if (r.height <= 0)
     {
         return false;
     }
 
-    for (uint16_t i = 0; i < height; i++)
+    placeRegion(r, data, width, height, padding);
+
+    x = r.x + padding;
+    y = r.y + padding;
+    
+    return true;
+}
+
+bool TextureAtlas::FreeRegion(uint16_t x, uint16_t y, uint16_t padding)
+{
+    assert(x >= padding && y >= padding);
+    assert(!Repacking());
+
+    if (packer_ != AtlasPacker::Shelf || !shelfPacker_.Free(x - padding, y - padding))
+    {
+        return false;
+    }
+    // a pending upload of the region may still go out, the texels are not
+    // sampled anymore either way
+    auto region = regions_.Regions.find((uint32_t)(y - padding) << 16 | (uint32_t)(x - padding));
+    if (region != regions_.Regions.end())
     {
-        memcpy(data_ + ((r.y + i) * width_ + r.x), data + i * width, width);
+        regions_.Bytes -= ShadowRegionOverhead + region->second.Data.capacity();
+        regions_.Regions.erase(region);
     }
+    return true;
+}
 
-    glBindTexture(GL_TEXTURE_2D, texture_);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, width, height, GL_RED, GL_UNSIGNED_BYTE, data);
-    glBindTexture(GL_TEXTURE_2D, 0);
+bool TextureAtlas::RestorePacker(const std::vector<binpack::SkylineBinPack::SkylineNode> &skyline,
+                                 unsigned long usedArea)
+{
+    assert(!Repacking());
+    return binPacker_.Restore(skyline, usedArea);
+}
 
-    x = r.x;
-    y = r.y;
-    
+bool TextureAtlas::PlaceRegion(uint16_t x, uint16_t y, uint16_t width, uint16_t height, const uint8_t *data,
+                               uint16_t padding)
+{
+    assert(x >= padding && x + width + padding <= width_);
+    assert(y >= padding && y + height + padding <= height_);
+    assert(!Repacking());
+
+    binpack::Rect r = binpack::Rect{x - padding, y - padding, width + 2 * padding, height + 2 * padding};
+    if (packer_ == AtlasPacker::Shelf && !shelfPacker_.Place(r))
+    {
+        return false;
+    }
+    placeRegion(r, data, width, height, padding);
+    return true;
+}
+
+void TextureAtlas::placeRegion(const binpack::Rect &r, const uint8_t *data, uint16_t width, uint16_t height,
+                               uint16_t padding)
+{
+    // the padded region is uploaded from the shadow
+    if (shadow_ == AtlasShadow::Full)
+    {
+        size_t pitch = width_ * channels_;
+        writeRegion(data_ + r.y * pitch + r.x * channels_, pitch, r, data, width * channels_, width, height, padding);
+    }
+    else
+    {
+        std::vector<uint8_t> texels((size_t)r.width * r.height * channels_);
+        writeRegion(texels.data(), r.width * channels_, r, data, width * channels_, width, height, padding);
+        storeRegion(regions_, r, texels.data());
+    }
+    markDirty(r.x, r.y, r.width, r.height);
+}
+
+void TextureAtlas::writeRegion(uint8_t *region, size_t pitch, const binpack::Rect &r, const uint8_t *data,
+                               size_t dataPitch, uint16_t width, uint16_t height, uint16_t padding)
+{
+    if (padding > 0)
+    {
+        // the border may hold texels of a previous region
+        size_t rowBytes = r.width * channels_;
+        size_t sideBytes = padding * channels_;
+        FillRows(region, pitch, 0, rowBytes, padding);
+        FillRows(region + (padding + height) * pitch, pitch, 0, rowBytes, padding);
+        FillRows(region + padding * pitch, pitch, 0, sideBytes, height);
+        FillRows(region + padding * pitch + rowBytes - sideBytes, pitch, 0, sideBytes, height);
+    }
+    BlitRows(region + padding * pitch + padding * channels_, pitch, data, dataPitch, width * channels_, height);
+}
+
+void TextureAtlas::ReadRegion(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t *data) const
+{
+    assert(x + width <= width_);
+    assert(y + height <= height_);
+
+    readTexels(binpack::Rect{x, y, width, height}, data, width * channels_);
+}
+
+void TextureAtlas::QueueRead()
+{
+    if (shadow_ != AtlasShadow::None)
+    {
+        return;
+    }
+    flushMoves();
+    if (readback_.Init(FullShadowBytes()))
+    {
+        array_->ReadTexels(layer_, 0, 0, width_, height_, nullptr, width_ * channels_);
+        readback_.Unbind();
+    }
+}
+
+void TextureAtlas::ReadQueued(uint8_t *data)
+{
+    binpack::Rect r{0, 0, width_, height_};
+    size_t pitch = width_ * channels_;
+    const uint8_t *texels = (shadow_ == AtlasShadow::None) ? readback_.Map(0, FullShadowBytes()) : nullptr;
+    if (texels != nullptr)
+    {
+        BlitRows(data, pitch, texels, pitch, pitch, height_);
+        readback_.Unmap();
+        decodeRegions(regions_, r, data, pitch);
+    }
+    else
+    {
+        readTexels(r, data, pitch);
+    }
+    readback_.Release();
+}
+
+bool TextureAtlas::BeginMove()
+{
+    if (shadow_ != AtlasShadow::None)
+    {
+        return false;
+    }
+    // moves still pending are part of the page to copy
+    flushMoves();
+    if (!moveSource_.Init(FullShadowBytes()))
+    {
+        return false;
+    }
+    array_->ReadTexels(layer_, 0, 0, width_, height_, nullptr, width_ * channels_);
+    moveSource_.Unbind();
+    moveWidth_ = width_;
+    moveQueued_ = true;
+    return true;
+}
+
+bool TextureAtlas::MoveRegion(uint16_t srcX, uint16_t srcY, uint16_t width, uint16_t height, uint16_t &x,
+                              uint16_t &y, uint16_t padding)
+{
+    assert(width > 0);
+    assert(height > 0);
+    assert(srcX >= padding && srcX + width + padding <= moveWidth_);
+    assert(srcY >= padding);
+    assert(shadow_ == AtlasShadow::None);
+    assert(!Repacking());
+
+    binpack::Rect r = (packer_ == AtlasPacker::Shelf) ?
+                      shelfPacker_.Insert(width + 2 * padding, height + 2 * padding) :
+                      binPacker_.Insert(width + 2 * padding, height + 2 * padding);
+    if (r.height <= 0)
+    {
+        return false;
+    }
+
+    // the padding goes along
+    uint16_t fromX = srcX - padding;
+    uint16_t fromY = srcY - padding;
+    auto from = moveRegions_.Regions.find((uint32_t)fromY << 16 | (uint32_t)fromX);
+    if (from != moveRegions_.Regions.end() && !from->second.Data.empty())
+    {
+        // not uploaded yet, its texels are still here
+        std::vector<uint8_t> texels((size_t)r.width * r.height * channels_);
+        RleDecode(from->second.Data.data(), from->second.Data.size(), texels.data(), texels.size());
+        storeRegion(regions_, r, texels.data());
+        markDirty(r.x, r.y, r.width, r.height);
+    }
+    else
+    {
+        // without data, as if uploaded already, so dirty regions don't
+        // cover it
+        auto entry = regions_.Regions.insert(std::make_pair((uint32_t)r.y << 16 | (uint32_t)r.x, ShadowRegion()));
+        entry.first->second.Width = (uint16_t)r.width;
+        entry.first->second.Height = (uint16_t)r.height;
+        regions_.Bytes += entry.second ? ShadowRegionOverhead : 0;
+        regions_.MaxHeight = std::max(regions_.MaxHeight, r.height);
+        moves_.push_back(Move{r, ((size_t)fromY * moveWidth_ + fromX) * channels_});
+    }
+
+    x = r.x + padding;
+    y = r.y + padding;
     return true;
 }
 
@@ -91,14 +885,172 @@ void TextureAtlas::Clear()
 {
     assert(width_ > 0);
     assert(height_ > 0);
-    assert(data_ != nullptr);
-    assert(texture_ != 0);
+    assert(array_ != nullptr);
 
+    // texels outside the regions are never sampled, the old contents stay
+    // until new regions cover them
     binPacker_.Init(width_, height_);
+    shelfPacker_.Init(width_, height_);
+    // right after BeginMove the regions are kept to be moved, moves still
+    // pending are of regions gone now
+    moves_.clear();
+    moveRegions_ = RegionStore();
+    if (moveQueued_)
+    {
+        std::swap(moveRegions_, regions_);
+        moveQueued_ = false;
+    }
+    else
+    {
+        moveSource_.Release();
+    }
+    regions_ = RegionStore();
+    dirty_.clear();
+    CancelRepack();
+}
+
+bool TextureAtlas::BeginRepack()
+{
+    CancelRepack();
+    // the page is read back with the regions moved to it
+    flushMoves();
+    if (shadow_ == AtlasShadow::Full)
+    {
+        // EndRepack uploads whole rows, the gaps between the glyphs included
+        repackData_ = (uint8_t*)calloc((size_t)width_ * height_, channels_);
+        if (repackData_ == nullptr)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        repackSource_.resize(FullShadowBytes());
+        repackReadQueued_ = false;
+        repackSourceRows_ = 0;
+    }
+    repackPacker_.Init(width_, height_);
+    repackShelfPacker_.Init(width_, height_);
+    repackRows_ = 0;
+    repacking_ = true;
+    return true;
+}
 
-    memset(data_, 0, width_ * height_ * 1 * sizeof(uint8_t));
+bool TextureAtlas::ReadRepackSource(uint16_t rows)
+{
+    assert(repacking_);
+    if (shadow_ == AtlasShadow::Full)
+    {
+        return true;
+    }
+    // reading the page straight into memory waits for all drawing queued,
+    // it goes through a buffer instead and is copied out a slice per call
+    size_t pitch = width_ * channels_;
+    if (shadow_ == AtlasShadow::None && !repackReadQueued_)
+    {
+        if (repackReadback_.Init(FullShadowBytes()))
+        {
+            array_->ReadTexels(layer_, 0, 0, width_, height_, nullptr, pitch);
+            repackReadback_.Unbind();
+        }
+        repackReadQueued_ = true;
+        return false;
+    }
+    if (shadow_ == AtlasShadow::None && !repackReadback_.Ready())
+    {
+        return false;
+    }
+    uint16_t y = repackSourceRows_;
+    uint16_t height = std::min<uint16_t>(rows, height_ - y);
+    if (height > 0)
+    {
+        binpack::Rect r{0, y, width_, height};
+        uint8_t *dst = repackSource_.data() + y * pitch;
+        const uint8_t *texels = (shadow_ == AtlasShadow::None) ? repackReadback_.Map(y * pitch, height * pitch) :
+                                nullptr;
+        if (texels != nullptr)
+        {
+            BlitRows(dst, pitch, texels, pitch, pitch, height);
+            repackReadback_.Unmap();
+            decodeRegions(regions_, r, dst, pitch);
+        }
+        else
+        {
+            // decoded, or read directly without the buffer
+            readTexels(r, dst, pitch);
+        }
+        repackSourceRows_ += height;
+    }
+    if (repackSourceRows_ < height_)
+    {
+        return false;
+    }
+    repackReadback_.Release();
+    return true;
+}
 
-    glBindTexture(GL_TEXTURE_2D, texture_);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width_, height_, GL_RED, GL_UNSIGNED_BYTE, data_);
-    glBindTexture(GL_TEXTURE_2D, 0);
+bool TextureAtlas::RepackRegion(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t padding,
+                                uint16_t &newX, uint16_t &newY)
+{
+    assert(repacking_);
+    assert(shadow_ == AtlasShadow::Full || repackSourceRows_ == height_);
+    assert(x >= padding && x + width + padding <= width_);
+    assert(y >= padding && y + height + padding <= height_);
+
+    binpack::Rect r = (packer_ == AtlasPacker::Shelf) ?
+                      repackShelfPacker_.Insert(width + 2 * padding, height + 2 * padding) :
+                      repackPacker_.Insert(width + 2 * padding, height + 2 * padding);
+    if (r.height <= 0)
+    {
+        return false;
+    }
+
+    size_t pitch = width_ * channels_;
+    if (shadow_ == AtlasShadow::Full)
+    {
+        writeRegion(repackData_ + r.y * pitch + r.x * channels_, pitch, r, data_ + y * pitch + x * channels_, pitch,
+                    width, height, padding);
+    }
+    else
+    {
+        std::vector<uint8_t> texels((size_t)r.width * r.height * channels_);
+        writeRegion(texels.data(), r.width * channels_, r, repackSource_.data() + y * pitch + x * channels_, pitch,
+                    width, height, padding);
+        storeRegion(repackRegions_, r, texels.data());
+    }
+    repackRows_ = std::max(repackRows_, r.y + r.height);
+
+    newX = r.x + padding;
+    newY = r.y + padding;
+    return true;
+}
+
+size_t TextureAtlas::EndRepack()
+{
+    assert(repacking_);
+
+    std::swap(data_, repackData_);
+    std::swap(regions_, repackRegions_);
+    std::swap(binPacker_, repackPacker_);
+    std::swap(shelfPacker_, repackShelfPacker_);
+    CancelRepack();
+
+    // the new layout starts at the bottom, the rows above it are not sampled
+    dirty_.clear();
+    if (repackRows_ == 0)
+    {
+        return 0;
+    }
+    markDirty(0, 0, width_, repackRows_);
+    return (size_t)width_ * repackRows_ * array_->Channels();
+}
+
+void TextureAtlas::CancelRepack()
+{
+    free(repackData_);
+    repackData_ = nullptr;
+    repackRegions_ = RegionStore();
+    std::vector<uint8_t>().swap(repackSource_);
+    repackReadback_.Release();
+    repacking_ = false;
 }
@@ -2,32 +2,290 @@
 #define __TEXTURE_ATLAS_H__
 
 #include "skyline_binpack.h"
+#include "shelf_packer.h"
+#include <cstddef>
 #include <cstdint>
+#include <map>
+#include <vector>
 
+class TextureAtlas;
+
+// A GL_TEXTURE_2D_ARRAY holding the pages (TextureAtlas) of one channel
+// count, so all of them are sampled through a single binding. A layer holds
+// a page, or four single-channel pages in its channels if channel-packed.
+class TextureArray
+{
+public:
+    TextureArray();
+    ~TextureArray();
+
+    // channels is 1 (GL_RED), 3 (GL_RGB) or 4 (GL_RGBA). The contents are
+    // undefined until the pages upload theirs.
+    bool Init(uint16_t width, uint16_t height, int layers, int channels);
+
+    uint16_t Width() const { return width_; }
+    uint16_t Height() const { return height_; }
+    int Layers() const { return layers_; }
+    int Channels() const { return channels_; }
+    unsigned int TextureID() const { return texture_; }
+
+    // Copies the layers of src, which is at most as large, into the same
+    // positions on the GPU.
+    void CopyFrom(const TextureArray &src);
+    // Reads texels of a layer back into rows of pitch bytes, all channels.
+    void ReadTexels(int layer, int x, int y, int width, int height, uint8_t *data, size_t pitch) const;
+
+    // Page of channel plane of a layer, plane 0 unless channel-packed.
+    void SetPage(int layer, int plane, const TextureAtlas *page);
+    const TextureAtlas *Page(int layer, int plane) const { return pages_[layer * 4 + plane]; }
+
+private:
+    uint16_t width_;
+    uint16_t height_;
+    int layers_;
+    int channels_;
+    unsigned int texture_;
+    std::vector<const TextureAtlas*> pages_;  // 4 per layer
+};
+
+// Streams texel uploads through a pixel buffer object: regions are copied
+// into mapped storage, which is orphaned on every Map, and the texture reads
+// them from there, so the driver doesn't copy from client memory at the call.
+class PixelUploadBuffer
+{
+public:
+    PixelUploadBuffer();
+    ~PixelUploadBuffer();
+
+    bool Init();
+
+    // Binds the buffer as GL_PIXEL_UNPACK_BUFFER and maps size bytes of
+    // fresh storage. After Unmap, uploads take offsets into it until Unbind.
+    uint8_t *Map(size_t size);
+    bool Unmap();
+    void Unbind();
+
+private:
+    unsigned int buffer_;
+    size_t size_;
+};
+
+// Reads texels back through a pixel buffer object: the read is queued while
+// the buffer is bound, without waiting for the GPU, and the result mapped a
+// frame or more later, when it is there.
+class PixelReadBuffer
+{
+public:
+    PixelReadBuffer();
+    ~PixelReadBuffer();
+
+    // Creates size bytes of storage and binds the buffer as
+    // GL_PIXEL_PACK_BUFFER, reads back then take offsets into it until Unbind,
+    // which fences them.
+    bool Init(size_t size);
+    void Unbind();
+    // Whether the reads fenced by Unbind are done, so Map won't block.
+    bool Ready();
+    // Maps size bytes at offset for reading, blocks if the reads aren't done.
+    // nullptr without storage or on failure.
+    const uint8_t *Map(size_t offset, size_t size);
+    void Unmap();
+    // Binds the buffer as GL_PIXEL_UNPACK_BUFFER, uploads then take offsets
+    // into it, copying the texels read on the GPU, until UnbindUnpack.
+    bool BindUnpack();
+    void UnbindUnpack();
+    // Frees the storage.
+    void Release();
+
+private:
+    unsigned int buffer_;
+    void *sync_;
+};
+
+// What a TextureAtlas keeps of its texels on the CPU, for uploads and to
+// read regions back.
+enum class AtlasShadow {
+    Full,         // A copy of the page
+    Compressed,   // The regions, RLE compressed
+    None          // Only the regions not uploaded yet, others are read back
+                  // from the GPU and only their rectangles are kept.
+                  // Compressed for channel-packed pages, whose uploads
+                  // rewrite the other pages of their layer
+};
+
+// How a TextureAtlas places its regions.
+enum class AtlasPacker {
+    Skyline,      // Tightly, but regions are only freed all at once by Clear
+    Shelf         // In shelves of height classes, regions can be freed one by one
+};
+
+// A page of glyphs, one layer of a TextureArray, with a CPU shadow of its
+// texels. Changes are uploaded by Flush.
 class TextureAtlas
 {
+    struct ShadowRegion {
+        uint16_t Width;
+        uint16_t Height;
+        std::vector<uint8_t> Data;   // RLE compressed texels, empty once uploaded without a shadow
+    };
+    // Regions by position, y << 16 | x, if the shadow isn't Full.
+    struct RegionStore {
+        std::map<uint32_t, ShadowRegion> Regions;
+        int MaxHeight;
+        size_t Bytes;
+        RegionStore() : MaxHeight(0), Bytes(0) {}
+    };
+    // A region copied on the GPU from the page before Clear, see BeginMove.
+    struct Move {
+        binpack::Rect To;
+        size_t Offset;   // Of its texels in the buffer
+    };
+
 public:
     TextureAtlas();
     ~TextureAtlas();
 
-    bool Init(uint16_t width, uint16_t height);
+    // The page is a layer of array, regions are tightly packed 8-bit pixels
+    // with the array's channels.
+    bool Init(TextureArray &array, int layer, AtlasShadow shadow = AtlasShadow::Full,
+              AtlasPacker packer = AtlasPacker::Skyline);
+    // Channel-packed: the page is channel plane of a layer of an RGBA array,
+    // with single-channel regions.
+    bool InitPlane(TextureArray &array, int layer, int plane, AtlasShadow shadow = AtlasShadow::Full,
+                   AtlasPacker packer = AtlasPacker::Skyline);
+
+    // Moves the page over to array, which is at least as large and holds a
+    // copy of the former one (TextureArray::CopyFrom), keeping the regions in
+    // place. False if out of memory. Not while repacking.
+    bool Resize(TextureArray &array);
+    // Allocates what Resize to a width x height array needs, so moving several
+    // pages can't fail half way. False if out of memory; CancelResize frees it.
+    bool ReserveResize(uint16_t width, uint16_t height);
+    void CancelResize();
+
+    // Uploads the regions changed since the last Flush through buffer,
+    // merging neighbouring ones. Returns the number of uploads.
+    int Flush(PixelUploadBuffer &buffer);
     
-    bool AddRegion(uint16_t width, uint16_t height, const uint8_t *data, uint16_t &x, uint16_t &y);
+    // Adds data surrounded by padding texels of zeros, x and y receive the
+    // position of data itself. The region is uploaded by the next Flush.
+    bool AddRegion(uint16_t width, uint16_t height, const uint8_t *data, uint16_t &x, uint16_t &y,
+                   uint16_t padding = 0);
+    // Frees the region AddRegion placed at x, y with padding, for the shelf
+    // packer only. Its texels stay until another region covers them. Not
+    // while repacking.
+    bool FreeRegion(uint16_t x, uint16_t y, uint16_t padding = 0);
+
+    // Snapshots: the packer state is saved and restored on an empty page,
+    // then the regions are placed back where they were, to be uploaded by
+    // the next Flush. Shelves are rebuilt from the regions as they are
+    // placed, PlaceRegion fails if they don't fit them.
+    AtlasPacker PackerType() const { return packer_; }
+    const binpack::SkylineBinPack &Packer() const { return binPacker_; }
+    bool RestorePacker(const std::vector<binpack::SkylineBinPack::SkylineNode> &skyline, unsigned long usedArea);
+    bool PlaceRegion(uint16_t x, uint16_t y, uint16_t width, uint16_t height, const uint8_t *data,
+                     uint16_t padding = 0);
+
+    // Copies a region from the shadow, or from the GPU if it was dropped.
+    void ReadRegion(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t *data) const;
+    // Reads the whole page in two steps, so several pages can be on their
+    // way back at once: QueueRead queues the read from the GPU, ReadQueued
+    // copies it out, blocking only until the GPU is done. With a shadow the
+    // page is copied from it.
+    void QueueRead();
+    void ReadQueued(uint8_t *data);
+
+    // Regions kept over a Clear are copied on the GPU without a shadow,
+    // instead of read back: BeginMove, right before Clear, queues a copy of
+    // the page into a buffer, MoveRegion then adds the region that was at
+    // srcX, srcY like AddRegion, the next Flush copies its texels over from
+    // the buffer. False with a shadow, the regions are read with ReadRegion
+    // and added anew then.
+    bool BeginMove();
+    bool MoveRegion(uint16_t srcX, uint16_t srcY, uint16_t width, uint16_t height, uint16_t &x, uint16_t &y,
+                    uint16_t padding = 0);
 
+    // Frees all regions. Texels are left as they are, so sampling must stay
+    // within the regions, their padding included.
     void Clear();
 
+    // Compaction: regions are copied one by one into a fresh layout on the
+    // CPU, while the current layout stays in use. EndRepack switches over to
+    // the new layout to be uploaded, returning the bytes to upload;
+    // CancelRepack drops it. No regions may be added meanwhile. Without a
+    // full shadow the page is first read into a transient copy, rows at a
+    // time by ReadRepackSource until it returns true. Without any shadow the
+    // first call queues the readback from the GPU, the next ones return
+    // false until it is there.
+    bool BeginRepack();
+    bool ReadRepackSource(uint16_t rows);
+    bool RepackRegion(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t padding,
+                      uint16_t &newX, uint16_t &newY);
+    size_t EndRepack();
+    void CancelRepack();
+    bool Repacking() const { return repacking_; }
+
     uint16_t Width() const { return width_; }
     uint16_t Height() const { return height_; }
-    unsigned int TextureID() const { return texture_; }
+    int Channels() const { return channels_; }
+    unsigned int TextureID() const;
+    int Layer() const { return layer_; }
+    int Plane() const { return plane_; }
+    bool Packed() const;
+    AtlasShadow Shadow() const { return shadow_; }
+    // Memory of the shadow, and of a full one for comparison.
+    size_t ShadowBytes() const;
+    size_t FullShadowBytes() const { return (size_t)width_ * height_ * channels_; }
 
-    float Occupancy() { return binPacker_.Occupancy(); }
+    float Occupancy() { return (packer_ == AtlasPacker::Shelf) ? shelfPacker_.Occupancy() : binPacker_.Occupancy(); }
+    int Shelves() const { return (packer_ == AtlasPacker::Shelf) ? shelfPacker_.Shelves() : 0; }
     
 private:
+    bool init(TextureArray &array, int layer, int plane, int channels, AtlasShadow shadow, AtlasPacker packer);
+    void markDirty(int x, int y, int width, int height);
+    int flushMoves();
+    void coalesceDirty();
+    void copyRegion(const binpack::Rect &r, uint8_t *dst);
+    void readTexels(const binpack::Rect &r, uint8_t *dst, size_t pitch) const;
+    void decodeRegions(const RegionStore &store, const binpack::Rect &r, uint8_t *dst, size_t pitch) const;
+    void storeRegion(RegionStore &store, const binpack::Rect &r, const uint8_t *texels);
+    bool overlapsUploaded(const binpack::Rect &r) const;
+    void placeRegion(const binpack::Rect &r, const uint8_t *data, uint16_t width, uint16_t height, uint16_t padding);
+    void writeRegion(uint8_t *region, size_t pitch, const binpack::Rect &r, const uint8_t *data, size_t dataPitch,
+                     uint16_t width, uint16_t height, uint16_t padding);
+
+
     uint16_t width_;
     uint16_t height_;
+    int channels_;
+    AtlasPacker packer_;
     binpack::SkylineBinPack binPacker_;
-    uint8_t *data_;
-    unsigned int texture_;
+    ShelfPacker shelfPacker_;
+    AtlasShadow shadow_;
+    uint8_t *data_;        // Full shadow
+    uint8_t *resizeData_;  // Full shadow of the next Resize, see ReserveResize
+    RegionStore regions_;  // Other shadows
+    TextureArray *array_;
+    int layer_;
+    int plane_;
+    std::vector<binpack::Rect> dirty_;  // Changed since the last Flush
+    std::vector<Move> moves_;           // Copied on the GPU by the next Flush
+    PixelReadBuffer moveSource_;        // The page before Clear, see BeginMove
+    RegionStore moveRegions_;           // Its regions, those not uploaded are moved from here
+    uint16_t moveWidth_;                // Width of the page in moveSource_
+    bool moveQueued_;                   // BeginMove without Clear yet
+    PixelReadBuffer readback_;          // See QueueRead
+    std::vector<uint8_t> zeros_;        // Row of a missing plane
+    binpack::SkylineBinPack repackPacker_;
+    ShelfPacker repackShelfPacker_;
+    bool repacking_;
+    uint8_t *repackData_;              // New layout while repacking, full shadow
+    RegionStore repackRegions_;        // Other shadows
+    std::vector<uint8_t> repackSource_;  // Copy of the page without a full shadow
+    PixelReadBuffer repackReadback_;     // The page on its way back
+    bool repackReadQueued_;
+    uint16_t repackSourceRows_;        // Rows of it read so far
+    int repackRows_;                   // Rows of the new layout in use
 };
 
 #endif // !__TEXTURE_ATLAS_H__
@@ -0,0 +1,128 @@
+#include "zoom_bench.h"
+#include "text_render.h"
+
+#include <glad/glad.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Frames of the animation, half of them zooming in.
+static const int ZoomFrames = 240;
+static const float ZoomMinSize = 12.0f;
+static const float ZoomMaxSize = 96.0f;
+// Atlas pages per channel count before evicting.
+static const int ZoomPages = 2;
+static const int ZoomRunLength = 24;
+
+// Codepoint ranges of the text, every glyph drawn in each frame.
+static const uint32_t ZoomRanges[][2] = {
+    { 0x41, 0x7A },     // Latin
+    { 0xC0, 0x17F },    // Latin-1 and Extended-A letters
+    { 0x391, 0x3C9 },   // Greek
+    { 0x410, 0x44F },   // Cyrillic
+};
+
+enum class ZoomMode {
+    Bitmap,
+    Buckets,    // Bitmaps at size buckets while zooming
+    SDF
+};
+
+//------------------------------------------------------------------------------
+
+static void appendUTF8(std::string &s, uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        s += (char)cp;
+    }
+    else
+    {
+        s += (char)(0xC0 | (cp >> 6));
+        s += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool runZoom(FT_Library ftLib, const char *fontFile, ZoomMode mode, int fbWidth, int fbHeight)
+{
+    typedef std::chrono::steady_clock Clock;
+    TextRender render;
+    if (!render.Init(ZoomPages, 256, 4 * 1024 * 1024, 0))
+    {
+        return false;
+    }
+    Font font(ftLib, fontFile, ZoomMinSize, 1.0f, false, false);
+    if (!font.Ok())
+    {
+        return false;
+    }
+    if (mode == ZoomMode::SDF)
+    {
+        font.SetGlyphFormat(GlyphFormat::SDF);
+    }
+    // every size is rasterized, so the modes compare by what they store
+    render.SetRasterBudget(1 << 20);
+
+    std::vector<std::unique_ptr<TextRun>> runs;
+    for (size_t r = 0; r < sizeof(ZoomRanges) / sizeof(ZoomRanges[0]); r++)
+    {
+        std::string s;
+        for (uint32_t c = ZoomRanges[r][0]; c <= ZoomRanges[r][1]; c++)
+        {
+            appendUTF8(s, c);
+            if ((c - ZoomRanges[r][0]) % ZoomRunLength == ZoomRunLength - 1 || c == ZoomRanges[r][1])
+            {
+                runs.push_back(std::unique_ptr<TextRun>(new TextRun(font, s, HB_DIRECTION_LTR, HB_SCRIPT_COMMON,
+                                                                    hb_language_from_string("en", -1), false)));
+                s.clear();
+            }
+        }
+    }
+
+    Clock::time_point start = Clock::now();
+    for (int frame = 0; frame <= ZoomFrames; frame++)
+    {
+        // exponentially, every octave takes as many frames
+        int half = ZoomFrames / 2;
+        float t = (frame <= half) ? (float)frame / half : (float)(ZoomFrames - frame) / half;
+        float size = ZoomMinSize * std::pow(ZoomMaxSize / ZoomMinSize, t);
+        font.SetSize(size);
+        render.SetZooming(mode == ZoomMode::Buckets && frame < ZoomFrames);
+
+        glClear(GL_COLOR_BUFFER_BIT);
+        render.Begin(fbWidth, fbHeight);
+        float y = fbHeight - size;
+        for (size_t i = 0; i < runs.size() && y >= 0; i++)
+        {
+            render.DrawText(*runs[i], 10, y, glm::vec3(0, 0, 0));
+            y -= size * 1.3f;
+        }
+        render.End();
+        render.WaitIdle();
+    }
+    glFinish();
+
+    const char *names[] = { "bitmap", "bitmap at zoom buckets", "sdf" };
+    fprintf(stdout, "%s: %.0f ms\n", names[(int)mode],
+            std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    render.PrintStats();
+    return true;
+}
+
+void RunZoomBenchmark(FT_Library ftLib, const char *fontFile, int fbWidth, int fbHeight)
+{
+    fprintf(stdout, "----zoom benchmark (%.0f to %.0f pt and back, %d frames, %d pages)----\n",
+            ZoomMinSize, ZoomMaxSize, ZoomFrames, ZoomPages);
+    for (ZoomMode mode : { ZoomMode::Bitmap, ZoomMode::Buckets, ZoomMode::SDF })
+    {
+        if (!runZoom(ftLib, fontFile, mode, fbWidth, fbHeight))
+        {
+            fprintf(stderr, "zoom benchmark: can't load %s\n", fontFile);
+            return;
+        }
+    }
+}
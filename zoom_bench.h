@@ -0,0 +1,18 @@
+#ifndef __ZOOM_BENCH_H__
+#define __ZOOM_BENCH_H__
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+//------------------------------------------------------------------------------
+
+// Animates a page of Latin, Greek and Cyrillic text of fontFile from 12 to
+// 96 pt and back, as bitmaps, as bitmaps at zoom size buckets (see
+// TextRender::SetZooming) and as signed distance fields, and prints the run
+// time and the atlas statistics of each to stdout. Needs a current GL
+// context with a framebuffer of fbWidth x fbHeight.
+void RunZoomBenchmark(FT_Library ftLib, const char *fontFile, int fbWidth, int fbHeight);
+
+//------------------------------------------------------------------------------
+
+#endif // !__ZOOM_BENCH_H__